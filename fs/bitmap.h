@@ -0,0 +1,96 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/*
+ * Bitmaps are arrays of 64-bit words, bit i being bit (i % 64) of word i / 64.
+ */
+
+#define BITMAP_WORD_BITS (64)
+
+/**
+ * Number of words needed to store a bitmap with the given number of bits.
+ */
+static inline size_t bitmap_words(size_t bits) {
+    return (bits + BITMAP_WORD_BITS - 1) / BITMAP_WORD_BITS;
+}
+
+/**
+ * Mask with every bit of a word from bit onwards set.
+ */
+static inline uint64_t bitmap_mask_from(size_t bit) {
+    return ~UINT64_C(0) << (bit % BITMAP_WORD_BITS);
+}
+
+/**
+ * Mask with count bits of a word set, starting at bit (the range must not
+ * cross a word boundary).
+ */
+static inline uint64_t bitmap_mask_range(size_t bit, size_t count) {
+    uint64_t ones = count >= BITMAP_WORD_BITS ? ~UINT64_C(0)
+                                              : (UINT64_C(1) << count) - 1;
+    return ones << (bit % BITMAP_WORD_BITS);
+}
+
+/**
+ * Index of the least significant set bit of a (non-zero) word.
+ */
+static inline size_t bitmap_ctz(uint64_t word) {
+    return (size_t)__builtin_ctzll(word);
+}
+
+static inline bool bitmap_test(uint64_t const *map, size_t bit) {
+    return (map[bit / BITMAP_WORD_BITS] >> (bit % BITMAP_WORD_BITS)) & 1;
+}
+
+static inline void bitmap_set(uint64_t *map, size_t bit) {
+    map[bit / BITMAP_WORD_BITS] |= UINT64_C(1) << (bit % BITMAP_WORD_BITS);
+}
+
+static inline void bitmap_clear(uint64_t *map, size_t bit) {
+    map[bit / BITMAP_WORD_BITS] &= ~(UINT64_C(1) << (bit % BITMAP_WORD_BITS));
+}
+
+/**
+ * Find the first run of clear bits in a word.
+ *
+ * Input:
+ *   - word: the word
+ *   - count: length of the run (1 to BITMAP_WORD_BITS)
+ *
+ * Returns the first bit of the run, or BITMAP_WORD_BITS if there is none.
+ */
+static inline size_t bitmap_find_clear_run(uint64_t word, size_t count) {
+    // keep the clear bits followed by count - 1 clear bits, doubling the
+    // length of the runs checked at each step
+    uint64_t starts = ~word;
+    for (size_t length = 1; length < count && starts != 0;) {
+        size_t shift = length < count - length ? length : count - length;
+        starts &= starts >> shift;
+        length += shift;
+    }
+    return starts != 0 ? bitmap_ctz(starts) : BITMAP_WORD_BITS;
+}
+
+/**
+ * Clear the first bits of a bitmap, setting the padding bits of its last
+ * word so that they are never found clear.
+ *
+ * Input:
+ *   - map: bitmap with bitmap_words(bits) words
+ *   - bits: number of bits in use
+ */
+static inline void bitmap_init(uint64_t *map, size_t bits) {
+    size_t words = bitmap_words(bits);
+    for (size_t i = 0; i < words; i++) {
+        map[i] = 0;
+    }
+    if (bits % BITMAP_WORD_BITS != 0) {
+        map[words - 1] = bitmap_mask_from(bits);
+    }
+}
+
+#endif // BITMAP_H
@@ -4,10 +4,26 @@
 // FS root inode number
 #define ROOT_DIR_INUM (0)
 
-#define MAX_FILE_NAME (40)
+// Maximum length of a file name (a component of a path), plus its null byte
+#define MAX_FILE_NAME (256)
+
+// Maximum length of the target of a symbolic link, plus its null byte
+#define MAX_SYM_TARGET (40)
+
+// Number of block pointers stored directly in an inode
+#define INODE_DIRECT_BLOCKS (12)
+
+// Number of extents stored in an inode
+#define INODE_EXTENTS (4)
 
 #define DELAY (5000)
 
+// Size of the huge pages fs_data may be backed by
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+// Size of a CPU cache line, to keep independently used data apart
+#define CACHE_LINE_SIZE (64)
+
 // Buffer to use when reading from external filesystems
 #define EXT_BUFFER 512
 
@@ -0,0 +1,149 @@
+#ifndef FINGERPRINT_H
+#define FINGERPRINT_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#endif
+
+/*
+ * Arrays of one-byte fingerprints, packed 8 to an atomic 64-bit word (byte i
+ * of a word being its bits 8 * i to 8 * i + 7), so that they may be changed
+ * while being searched. They are searched a group of FP_GROUP_WORDS words at
+ * a time, with the widest SIMD instructions the CPU has (see fp_match_select).
+ *
+ * Fingerprints are 7 bits long, so that FP_NONE matches none of them.
+ */
+
+#define FP_GROUP_WORDS (4)
+#define FP_GROUP (8 * FP_GROUP_WORDS) // fingerprints per group
+#define FP_NONE (0x80)
+#define FP_NONE_WORD (UINT64_C(0x8080808080808080))
+
+/**
+ * Find the fingerprints of a group equal to a given one.
+ *
+ * Input:
+ *   - group: the group's FP_GROUP_WORDS words
+ *   - fp: the fingerprint
+ *
+ * Returns a mask with bit i set if fingerprint i of the group is equal.
+ */
+typedef uint32_t (*fp_match_t)(_Atomic uint64_t const *group, uint8_t fp);
+
+/**
+ * Fingerprint of a 64-bit hash (from its high bits).
+ */
+static inline uint8_t fp_of_hash(uint64_t hash) {
+    return (uint8_t)(hash >> 57);
+}
+
+/**
+ * Change a fingerprint of an array (writers should be serialized).
+ */
+static inline void fp_store(_Atomic uint64_t *fps, size_t i, uint8_t fp) {
+    _Atomic uint64_t *word = &fps[i / 8];
+    unsigned shift = (unsigned)(i % 8) * 8;
+    uint64_t value = atomic_load_explicit(word, memory_order_relaxed);
+    value = (value & ~(UINT64_C(0xFF) << shift)) | (uint64_t)fp << shift;
+    atomic_store_explicit(word, value, memory_order_relaxed);
+}
+
+/**
+ * Find the fingerprints of a word equal to a given one, with plain integer
+ * operations (bit i of the result is set if fingerprint i is equal).
+ */
+static inline uint32_t fp_match_word(uint64_t word, uint8_t fp) {
+    uint64_t const low7 = UINT64_C(0x7F7F7F7F7F7F7F7F);
+    uint64_t x = word ^ (UINT64_C(0x0101010101010101) * fp);
+    // the high bit of each byte of x that is zero (and only those)
+    uint64_t zero = ~(((x & low7) + low7) | x | low7);
+    // gathers the high bits into the top byte
+    return (uint32_t)(((zero >> 7) * UINT64_C(0x0102040810204080)) >> 56);
+}
+
+static inline uint32_t fp_match_scalar(_Atomic uint64_t const *group,
+                                       uint8_t fp) {
+    uint32_t mask = 0;
+    for (unsigned w = 0; w < FP_GROUP_WORDS; w++) {
+        uint64_t word = atomic_load_explicit(&group[w], memory_order_relaxed);
+        mask |= fp_match_word(word, fp) << (8 * w);
+    }
+    return mask;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+// the words are loaded one by one (as atomics), and compared all at once
+
+__attribute__((target("sse2"))) static inline uint32_t
+fp_match_sse2(_Atomic uint64_t const *group, uint8_t fp) {
+    __m128i key = _mm_set1_epi8((char)fp);
+    uint32_t mask = 0;
+    for (unsigned w = 0; w < FP_GROUP_WORDS; w += 2) {
+        __m128i fps = _mm_set_epi64x(
+            (long long)atomic_load_explicit(&group[w + 1],
+                                            memory_order_relaxed),
+            (long long)atomic_load_explicit(&group[w], memory_order_relaxed));
+        mask |= (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(fps, key))
+                << (8 * w);
+    }
+    return mask;
+}
+
+__attribute__((target("avx2"))) static inline uint32_t
+fp_match_avx2(_Atomic uint64_t const *group, uint8_t fp) {
+    __m256i fps = _mm256_set_epi64x(
+        (long long)atomic_load_explicit(&group[3], memory_order_relaxed),
+        (long long)atomic_load_explicit(&group[2], memory_order_relaxed),
+        (long long)atomic_load_explicit(&group[1], memory_order_relaxed),
+        (long long)atomic_load_explicit(&group[0], memory_order_relaxed));
+    __m256i key = _mm256_set1_epi8((char)fp);
+    return (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(fps, key));
+}
+
+/**
+ * Whether the OS saves the AVX (YMM) registers on context switches, as read
+ * from XCR0 (which should only be read if CPUID reports OSXSAVE).
+ */
+static inline bool fp_os_saves_ymm(void) {
+    uint32_t low, high;
+    __asm__ volatile("xgetbv" : "=a"(low), "=d"(high) : "c"(0));
+    (void)high;
+    return (low & 0x6) == 0x6; // SSE and AVX state
+}
+
+#endif
+
+/**
+ * Pick the fastest way of matching fingerprints the CPU supports, as
+ * reported by CPUID: AVX2, SSE2, or plain integer operations.
+ *
+ * Input:
+ *   - simd: whether SIMD instructions may be used at all
+ */
+static inline fp_match_t fp_match_select(bool simd) {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if (simd && __get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        bool avx = (ecx & bit_OSXSAVE) && (ecx & bit_AVX) && fp_os_saves_ymm();
+        bool sse2 = edx & bit_SSE2;
+        if (avx && __get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx) &&
+            (ebx & bit_AVX2)) {
+            return fp_match_avx2;
+        }
+        if (sse2) {
+            return fp_match_sse2;
+        }
+    }
+#else
+    (void)simd;
+#endif
+    return fp_match_scalar;
+}
+
+#endif // FINGERPRINT_H
@@ -0,0 +1,211 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Fast LZ77 compressor, with the sequence format of LZ4 blocks: a token byte
+ * holding the number of literals (high 4 bits) and the match length minus
+ * LZ_MIN_MATCH (low 4 bits), each extended by bytes of 255 (and a final
+ * smaller one) when equal to 15, followed by the literals and by the 2-byte
+ * little-endian offset of the match. The last sequence only has literals.
+ */
+
+#define LZ_MIN_MATCH (4)
+#define LZ_MAX_OFFSET (65535)
+#define LZ_HASH_BITS (12)
+
+static inline uint32_t lz_read32(uint8_t const *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline size_t lz_hash(uint32_t sequence) {
+    return (sequence * UINT32_C(2654435761)) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Append an extended length (the part of a length from 15 onwards).
+ *
+ * Returns the new output position, or cap + 1 if the output is full.
+ */
+static inline size_t lz_put_length(uint8_t *dst, size_t out, size_t cap,
+                                   size_t length) {
+    for (; length >= 255; length -= 255) {
+        if (out >= cap) {
+            return cap + 1;
+        }
+        dst[out++] = 255;
+    }
+    if (out >= cap) {
+        return cap + 1;
+    }
+    dst[out++] = (uint8_t)length;
+    return out;
+}
+
+/**
+ * Append a sequence: literals followed by a match (if match_length is not 0).
+ *
+ * Returns the new output position, or cap + 1 if the output is full.
+ */
+static inline size_t lz_put_sequence(uint8_t *dst, size_t out, size_t cap,
+                                     uint8_t const *literals, size_t count,
+                                     size_t offset, size_t match_length) {
+    size_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+    if (out >= cap) {
+        return cap + 1;
+    }
+    dst[out++] = (uint8_t)(((count < 15 ? count : 15) << 4) |
+                           (match_code < 15 ? match_code : 15));
+    if (count >= 15 && (out = lz_put_length(dst, out, cap, count - 15)) > cap) {
+        return cap + 1;
+    }
+
+    if (count > cap - out) {
+        return cap + 1;
+    }
+    memcpy(dst + out, literals, count);
+    out += count;
+    if (match_length == 0) {
+        return out;
+    }
+
+    if (cap - out < 2) {
+        return cap + 1;
+    }
+    dst[out++] = (uint8_t)(offset & 0xff);
+    dst[out++] = (uint8_t)(offset >> 8);
+    if (match_code >= 15) {
+        out = lz_put_length(dst, out, cap, match_code - 15);
+    }
+    return out;
+}
+
+/**
+ * Compress a buffer.
+ *
+ * Input:
+ *   - src: the buffer
+ *   - len: length of the buffer
+ *   - dst: output buffer
+ *   - cap: size of the output buffer
+ *
+ * Returns the compressed length, or 0 if it would not fit in cap bytes.
+ */
+static inline size_t lz_compress(void const *src, size_t len, void *dst,
+                                 size_t cap) {
+    uint8_t const *in = src;
+    uint8_t *out_buf = dst;
+    // positions (plus one, 0 meaning none) of recent sequences, by hash
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+
+    size_t out = 0, anchor = 0, i = 0;
+    while (len >= LZ_MIN_MATCH && i <= len - LZ_MIN_MATCH) {
+        uint32_t sequence = lz_read32(in + i);
+        size_t h = lz_hash(sequence);
+        size_t candidate = table[h];
+        table[h] = (uint32_t)(i + 1);
+
+        if (candidate == 0 || i - (candidate - 1) > LZ_MAX_OFFSET ||
+            lz_read32(in + candidate - 1) != sequence) {
+            i++;
+            continue;
+        }
+
+        size_t match = candidate - 1;
+        size_t length = LZ_MIN_MATCH;
+        while (i + length < len && in[match + length] == in[i + length]) {
+            length++;
+        }
+        out = lz_put_sequence(out_buf, out, cap, in + anchor, i - anchor,
+                              i - match, length);
+        if (out > cap) {
+            return 0;
+        }
+        i += length;
+        anchor = i;
+    }
+
+    out = lz_put_sequence(out_buf, out, cap, in + anchor, len - anchor, 0, 0);
+    return out > cap ? 0 : out;
+}
+
+/**
+ * Read an extended length.
+ *
+ * Returns false if the input ends first.
+ */
+static inline bool lz_get_length(uint8_t const *in, size_t len, size_t *pos,
+                                 size_t *length) {
+    uint8_t b;
+    do {
+        if (*pos >= len) {
+            return false;
+        }
+        b = in[(*pos)++];
+        *length += b;
+    } while (b == 255);
+    return true;
+}
+
+/**
+ * Decompress a buffer compressed with lz_compress.
+ *
+ * Input:
+ *   - src: the compressed buffer
+ *   - len: length of the compressed buffer
+ *   - dst: output buffer
+ *   - size: expected length of the decompressed contents
+ *
+ * Returns whether the buffer was decompressed to exactly size bytes.
+ */
+static inline bool lz_decompress(void const *src, size_t len, void *dst,
+                                 size_t size) {
+    uint8_t const *in = src;
+    uint8_t *out = dst;
+    size_t pos = 0, produced = 0;
+
+    while (pos < len) {
+        uint8_t token = in[pos++];
+        size_t count = token >> 4;
+        if (count == 15 && !lz_get_length(in, len, &pos, &count)) {
+            return false;
+        }
+        if (count > len - pos || count > size - produced) {
+            return false;
+        }
+        memcpy(out + produced, in + pos, count);
+        pos += count;
+        produced += count;
+        if (pos == len) {
+            break; // the last sequence has no match
+        }
+
+        if (len - pos < 2) {
+            return false;
+        }
+        size_t offset = (size_t)in[pos] | ((size_t)in[pos + 1] << 8);
+        pos += 2;
+        size_t length = (size_t)(token & 15);
+        if (length == 15 && !lz_get_length(in, len, &pos, &length)) {
+            return false;
+        }
+        length += LZ_MIN_MATCH;
+        if (offset == 0 || offset > produced || length > size - produced) {
+            return false;
+        }
+
+        // byte by byte, as the match may overlap the bytes it produces
+        for (size_t i = 0; i < length; i++, produced++) {
+            out[produced] = out[produced - offset];
+        }
+    }
+    return produced == size;
+}
+
+#endif // LZ_H
@@ -9,13 +9,22 @@
 
 #include "betterassert.h"
 
-static pthread_mutex_t tfs_open_lock;
 tfs_params tfs_default_params() {
     tfs_params params = {
         .max_inode_count = 64,
         .max_block_count = 1024,
         .max_open_files_count = 16,
         .block_size = 1024,
+        .block_magazine_size = 16,
+        .allocation_group_count = 4,
+        .delayed_alloc_size = 0,
+        .dentry_cache_size = 256,
+        .simd_dir_lookups = true,
+        .dedup_blocks = false,
+        .compress_blocks = false,
+        .max_snapshot_count = 8,
+        .arena_backing = TFS_ARENA_MMAP,
+        .arena_numa = TFS_NUMA_DEFAULT,
     };
     return params;
 }
@@ -33,11 +42,10 @@ int tfs_init(tfs_params const *params_ptr) {
     }
 
     // create root inode
-    int root = inode_create(T_DIRECTORY);
+    int root = inode_create(T_DIRECTORY, -1);
     if (root != ROOT_DIR_INUM) {
         return -1;
     }
-    init_mutex(&tfs_open_lock);
 
     return 0;
 }
@@ -46,7 +54,6 @@ int tfs_destroy() {
     if (state_destroy() != 0) {
         return -1;
     }
-    destroy_mutex(&tfs_open_lock);
     return 0;
 }
 
@@ -55,27 +62,107 @@ static bool valid_pathname(char const *name) {
 }
 
 /**
- * Looks for a file.
+ * Obtain the next component of a path.
  *
- * Note: as a simplification, only a plain directory space (root directory only)
- * is supported.
+ * Input:
+ *   - path: the path, right after a '/'
+ *   - component: where to copy the component to (MAX_FILE_NAME bytes)
+ *
+ * Returns the rest of the path (starting at the '/' after the component, or
+ * empty), or NULL if the component is empty or too long to be a file name.
+ */
+static char const *path_component(char const *path, char *component) {
+    size_t length = strcspn(path, "/");
+    if (length == 0 || length > MAX_FILE_NAME - 1) {
+        return NULL;
+    }
+    memcpy(component, path, length);
+    component[length] = '\0';
+    return path + length;
+}
+
+/**
+ * Looks for a file, walking its path from the root directory one component
+ * at a time.
+ *
+ * Takes no locks (see find_in_dir): the result is where the path led at some
+ * point during the call, so callers that go on to lock the file should check
+ * it is still there.
  *
  * Input:
  *   - name: absolute path name
- *   - root_inode: the root directory inode (should be read-locked)
  * Returns the inumber of the file, -1 if unsuccessful.
  */
-static int tfs_lookup(char const *name, const inode_t *root_inode) {
-    ALWAYS_ASSERT(inode_get(ROOT_DIR_INUM) == root_inode,
-                  "tfs_lookup: the root_inode is not the root directory.");
+static int tfs_lookup(char const *name) {
+    if (!valid_pathname(name)) {
+        return -1;
+    }
+
+    char component[MAX_FILE_NAME];
+    int inum = ROOT_DIR_INUM;
+    while (*name == '/' && inum != -1) {
+        name = path_component(name + 1, component);
+        if (name == NULL) {
+            return -1;
+        }
+        inum = find_in_dir(inode_get(inum), component);
+    }
+    return inum;
+}
 
+/**
+ * Walks a path to the directory its last component is in, locking
+ * directories hand over hand: each one stays read-locked until the next one
+ * is locked, so that none can be removed in the meantime.
+ *
+ * Input:
+ *   - name: absolute path name
+ *   - last: where to copy the last component to (MAX_FILE_NAME bytes)
+ *   - write: whether to lock the directory for writing (or reading)
+ *
+ * Returns the inumber of the directory, which stays locked, or -1 (with no
+ * locks held) if it does not exist or the path is invalid.
+ */
+static int tfs_lookup_parent(char const *name, char *last, bool write) {
     if (!valid_pathname(name)) {
         return -1;
     }
 
-    // skip the initial '/' character
-    name++;
-    return find_in_dir(root_inode, name);
+    int dir = ROOT_DIR_INUM;
+    name = path_component(name + 1, last);
+    if (write && name != NULL && *name == '\0') {
+        lock_wr_inode(dir);
+    } else {
+        lock_rd_inode(dir);
+    }
+
+    while (name != NULL && *name == '/') {
+        int sub = find_in_dir(inode_get(dir), last);
+        char const *rest = path_component(name + 1, last);
+        if (sub == -1 || rest == NULL) {
+            unlock_inode(dir);
+            return -1;
+        }
+        if (write && *rest == '\0') {
+            lock_wr_inode(sub);
+        } else {
+            lock_rd_inode(sub);
+        }
+        unlock_inode(dir);
+        dir = sub;
+        name = rest;
+
+        if (inode_get(dir)->i_node_type != T_DIRECTORY) {
+            unlock_inode(dir);
+            return -1;
+        }
+    }
+
+    if (name == NULL) {
+        unlock_inode(dir);
+        return -1;
+    }
+    return dir;
 }
 
 int tfs_open(char const *name, tfs_file_mode_t mode) {
@@ -84,44 +171,50 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         return -1;
     }
 
-    inode_t *root_dir_inode = inode_get(ROOT_DIR_INUM);
-
-    ALWAYS_ASSERT(root_dir_inode != NULL,
-                  "tfs_open: root dir inode must exist");
-
-    lock_mutex(&tfs_open_lock);
-    lock_wr_inode(ROOT_DIR_INUM);
-    int inum = tfs_lookup(name, root_dir_inode);
+    // Existing files are looked up without locking their directory, which is
+    // only locked to create files
+    int inum = tfs_lookup(name);
     size_t offset;
 
     if (inum >= 0) {
         // The file already exists
-        // Unlock mutex
-
         inode_t *inode = inode_get(inum);
         ALWAYS_ASSERT(inode != NULL,
                       "tfs_open: directory files must have an inode");
-        lock_rd_inode(inum); // TODO: talvez trocar p/ bloqueio de leitura
+        // only truncating changes the file (and so preserves it for
+        // snapshots, see lock_wr_inode)
+        if (mode & TFS_O_TRUNC) {
+            lock_wr_inode(inum);
+        } else {
+            lock_rd_inode(inum);
+        }
+        if (tfs_lookup(name) != inum) {
+            // unlinked (and maybe its inode reused) since it was looked up;
+            // while its inode is locked, it no longer can be
+            unlock_inode(inum);
+            return tfs_open(name, mode);
+        }
+        if (inode->i_node_type == T_DIRECTORY) {
+            unlock_inode(inum);
+            return -1; // directories cannot be opened
+        }
         if (inode->i_node_type == T_SYM_LINK) {
             // preventing infinite recursion
-            if (strcmp(inode->i_target_d_name, name) == 0) {
+            char const *target = inode_sym_target(inum);
+            if (strcmp(target, name) == 0) {
                 unlock_inode(inum);
-                unlock_inode(ROOT_DIR_INUM);
-                unlock_mutex(&tfs_open_lock);
                 return -1;
             }
+            char link_target[MAX_SYM_TARGET];
+            strcpy(link_target, target);
             unlock_inode(inum);
-            unlock_inode(ROOT_DIR_INUM);
-            unlock_mutex(&tfs_open_lock);
-            return tfs_open(inode->i_target_d_name, mode);
+            return tfs_open(link_target, mode);
         }
 
         // Truncate (if requested)
         if (mode & TFS_O_TRUNC) {
-            if (inode->i_size > 0) {
-                data_block_free(inode->i_data_block);
-                inode->i_size = 0;
-            }
+            inode_blocks_free(inode);
+            inode->i_size = 0;
         }
         // Determine initial offset
         if (mode & TFS_O_APPEND) {
@@ -132,31 +225,37 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
         unlock_inode(inum);
     } else if (mode & TFS_O_CREAT) {
         // The file does not exist; the mode specified that it should be created
+        char sub_name[MAX_FILE_NAME];
+        int dir = tfs_lookup_parent(name, sub_name, true);
+        if (dir == -1) {
+            return -1; // no such directory
+        }
+        inode_t *dir_inode = inode_get(dir);
+        if (find_in_dir(dir_inode, sub_name) != -1) {
+            // created by someone else in the meantime
+            unlock_inode(dir);
+            return tfs_open(name, mode);
+        }
         // Create inode
-        inum = inode_create(T_FILE);
+        inum = inode_create(T_FILE, dir);
         if (inum == -1) {
-            unlock_inode(ROOT_DIR_INUM);
-            unlock_mutex(&tfs_open_lock);
+            unlock_inode(dir);
             return -1; // no space in inode table
         }
         lock_wr_inode(inum);
-        // Add entry in the root directory
-        if (add_dir_entry(root_dir_inode, name + 1, inum) == -1) {
+        // Add entry in the directory
+        if (add_dir_entry(dir_inode, sub_name, inum) == -1) {
             inode_delete(inum);
             unlock_inode(inum);
-            unlock_inode(ROOT_DIR_INUM);
-            unlock_mutex(&tfs_open_lock);
+            unlock_inode(dir);
             return -1; // no space in directory
         }
         unlock_inode(inum);
+        unlock_inode(dir);
         offset = 0; // TODO: este offset estava originalmente aqui?
     } else {
-        unlock_inode(ROOT_DIR_INUM);
-        unlock_mutex(&tfs_open_lock);
         return -1;
     }
-    unlock_inode(ROOT_DIR_INUM);
-    unlock_mutex(&tfs_open_lock);
     // Finally, add entry to the open file table and return the corresponding
     // handle
     return add_to_open_file_table(inum, offset);
@@ -169,26 +268,28 @@ int tfs_open(char const *name, tfs_file_mode_t mode) {
 int tfs_sym_link(char const *target, char const *link_name) {
     if (!valid_pathname(link_name) || !valid_pathname(target))
         return -1;
+    if (strlen(target) > MAX_SYM_TARGET - 1)
+        return -1; // does not fit in the link
 
-    inode_t *iroot = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(iroot != NULL, "tfs_sym_link: failed to find root dir inode");
-    // ver TODO mais abaixo
-    lock_wr_inode(ROOT_DIR_INUM);
-    int i_target_num = tfs_lookup(target, iroot);
-    if (i_target_num == -1) {
-        unlock_inode(ROOT_DIR_INUM);
+    // the target is only checked to exist, which needs no lock
+    if (tfs_lookup(target) == -1) {
+        return -1;
+    }
+    char link_sub[MAX_FILE_NAME];
+    int dir = tfs_lookup_parent(link_name, link_sub, true);
+    if (dir == -1) {
         return -1;
     }
 
-    int i_link_number = inode_create(T_SYM_LINK);
+    int i_link_number = inode_create(T_SYM_LINK, dir);
     if (i_link_number == -1) {
-        unlock_inode(ROOT_DIR_INUM);
+        unlock_inode(dir);
         return -1;
     }
 
     inode_t *i_link = inode_get(i_link_number);
     if (i_link == NULL) {
-        unlock_inode(ROOT_DIR_INUM);
+        unlock_inode(dir);
         return -1;
     }
     // TODO: Isto tem que ser read-lock? Não poderá ser read-lock? confirmar
@@ -199,18 +300,16 @@ int tfs_sym_link(char const *target, char const *link_name) {
     // inode_t como const
     lock_wr_inode(i_link_number);
     // initializes link's inode
-    strcpy(i_link->i_target_d_name, target);
-
-    const char *link_sub = link_name + 1;
+    strcpy(inode_sym_target(i_link_number), target);
 
-    if (add_dir_entry(iroot, link_sub, i_link_number) == -1) {
+    if (add_dir_entry(inode_get(dir), link_sub, i_link_number) == -1) {
         unlock_inode(i_link_number);
-        unlock_inode(ROOT_DIR_INUM);
+        unlock_inode(dir);
         return -1;
     }
 
     unlock_inode(i_link_number);
-    unlock_inode(ROOT_DIR_INUM);
+    unlock_inode(dir);
 
     return 0;
 }
@@ -219,169 +318,652 @@ int tfs_link(char const *target, char const *link_name) {
     if (!valid_pathname(target) || !valid_pathname(link_name))
         return -1;
 
-    // we must remove the '/' when adding to dir entry
-    const char *link_sub = link_name + 1;
-
-    inode_t *iroot = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(iroot != NULL, "tfs_link: failed to find root dir inode");
-    lock_wr_inode(ROOT_DIR_INUM);
-    int target_inumber = tfs_lookup(target, iroot);
-
+    int target_inumber = tfs_lookup(target);
     if (target_inumber == -1) {
-        unlock_inode(ROOT_DIR_INUM);
         return -1;
     }
 
+    // The link is counted before its entry is added, with no directory
+    // locked, so that the file cannot be deleted in the meantime (files are
+    // only locked after their directory)
     inode_t *itarget = inode_get(target_inumber);
-    if (itarget == NULL) {
-        unlock_inode(ROOT_DIR_INUM);
-        return -1;
-    }
     lock_wr_inode(target_inumber);
-    // cannot create links to symbolic links
-    if (itarget->i_node_type == T_SYM_LINK) {
+    // cannot create links to symbolic links (nor directories), and the file
+    // may have been unlinked since it was looked up
+    if (tfs_lookup(target) != target_inumber ||
+        itarget->i_node_type != T_FILE) {
         unlock_inode(target_inumber);
-        unlock_inode(ROOT_DIR_INUM);
         return -1;
     }
+    itarget->i_links++;
+    unlock_inode(target_inumber);
 
+    char link_sub[MAX_FILE_NAME];
+    int dir = tfs_lookup_parent(link_name, link_sub, true);
     // target_inumber nunca é usado para obter o respetivo inode (não é
     // necessário lock)
-    if (add_dir_entry(iroot, link_sub, target_inumber) == -1) {
-        unlock_inode(target_inumber);
-        unlock_inode(ROOT_DIR_INUM);
-        return -1;
+    if (dir != -1 &&
+        add_dir_entry(inode_get(dir), link_sub, target_inumber) != -1) {
+        unlock_inode(dir);
+        return 0;
+    }
+    if (dir != -1) {
+        unlock_inode(dir);
     }
 
-    itarget->i_links++;
+    // the file's other links may have been removed meanwhile
+    lock_wr_inode(target_inumber);
+    if (--itarget->i_links <= 0) {
+        inode_delete(target_inumber);
+    }
     unlock_inode(target_inumber);
-    unlock_inode(ROOT_DIR_INUM);
-    return 0;
+    return -1;
 }
 
-int tfs_close(int fhandle) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
-    if (file == NULL) {
-        return -1; // invalid fd
+int tfs_clone(char const *source, char const *dest) {
+    if (!valid_pathname(source) || !valid_pathname(dest)) {
+        return -1;
     }
 
-    remove_from_open_file_table(fhandle);
+    int source_inumber = tfs_lookup(source);
+    if (source_inumber == -1) {
+        return -1;
+    }
 
+    // The clone is made before its directory is locked (files are only
+    // locked after their directory); until then, no one else can reach it
+    inode_t *isource = inode_get(source_inumber);
+    lock_rd_inode(source_inumber);
+    // only regular files can be cloned, and the source may have been
+    // unlinked since it was looked up
+    if (tfs_lookup(source) != source_inumber ||
+        isource->i_node_type != T_FILE) {
+        unlock_inode(source_inumber);
+        return -1;
+    }
+
+    // placed near the source, whose blocks it shares
+    int dest_inumber = inode_create(T_FILE, source_inumber);
+    if (dest_inumber == -1) {
+        unlock_inode(source_inumber);
+        return -1; // no space in inode table
+    }
+    inode_t *idest = inode_get(dest_inumber);
+    lock_wr_inode(dest_inumber);
+    int cloned = inode_clone(idest, isource);
+    unlock_inode(source_inumber);
+
+    char dest_sub[MAX_FILE_NAME];
+    int dir = cloned == -1 ? -1 : tfs_lookup_parent(dest, dest_sub, true);
+    if (dir == -1 || find_in_dir(inode_get(dir), dest_sub) != -1 ||
+        add_dir_entry(inode_get(dir), dest_sub, dest_inumber) == -1) {
+        inode_delete(dest_inumber);
+        unlock_inode(dest_inumber);
+        if (dir != -1) {
+            unlock_inode(dir);
+        }
+        return -1;
+    }
+
+    unlock_inode(dest_inumber);
+    unlock_inode(dir);
     return 0;
 }
 
-ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+/**
+ * Write to a file, allocating its blocks as needed.
+ *
+ * Input:
+ *   - inode: the file's inode (should be write-locked)
+ *   - offset: offset to write at, advanced past the written bytes
+ *   - buffer: contents to write
+ *   - to_write: number of bytes to write (not past the maximum file size)
+ *
+ * Returns the number of bytes written (lower than to_write if the file
+ * system ran out of blocks).
+ */
+static size_t inode_write(inode_t *inode, size_t *offset, void const *buffer,
+                          size_t to_write) {
+    // Small files are moved to a larger slot (or to blocks of their own) when
+    // the write does not fit in the space they have
+    size_t end = *offset + to_write;
+    if (inode->i_layout != L_BLOCKS && end > inode_small_capacity(inode) &&
+        inode_small_grow(inode, end) == -1) {
+        // no space for the file to grow: fill the space it has
+        size_t capacity = inode_small_capacity(inode);
+        to_write = *offset < capacity ? capacity - *offset : 0;
+    }
+
+    size_t written = 0;
+    if (inode->i_layout != L_BLOCKS) {
+        memcpy(inode_small_data(inode) + *offset, buffer, to_write);
+        *offset += to_write;
+        written = to_write;
+    }
+
+    // Write run by run, allocating blocks as the file grows (sequential
+    // writes get contiguous runs, copied with a single memcpy each)
+    size_t block_size = state_block_size();
+    while (written < to_write) {
+        size_t block_index = *offset / block_size;
+        size_t block_offset = *offset % block_size;
+        size_t remaining = to_write - written;
+        size_t blocks =
+            (block_offset + remaining + block_size - 1) / block_size;
+
+        size_t run;
+        int bnum = inode_block_lookup(inode, block_index, &run);
+        bool fresh = bnum == -1;
+        if (fresh) {
+            bnum = inode_block_alloc(inode, block_index, blocks, &run);
+        } else {
+            bnum = inode_block_unshare(inode, block_index, bnum, &run);
+        }
+        if (bnum == -1) {
+            break; // no space
+        }
+
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > remaining) {
+            chunk = remaining;
+        }
+
+        char *block = data_block_get_run(
+            bnum, (block_offset + chunk + block_size - 1) / block_size);
+        ALWAYS_ASSERT(block != NULL,
+                      "inode_write: data block deleted mid-write");
+
+        if (fresh) {
+            // the rest of new blocks reads as a hole (zeros)
+            memset(block, 0, block_offset);
+            memset(block + block_offset + chunk, 0,
+                   run * block_size - block_offset - chunk);
+        }
+
+        // Perform the actual write
+        memcpy(block + block_offset, (char const *)buffer + written, chunk);
+
+        // The offset is incremented accordingly
+        *offset += chunk;
+        written += chunk;
+
+        // Blocks filled up to their end can be deduplicated
+        size_t size = *offset > inode->i_size ? *offset : inode->i_size;
+        size_t full_end = size / block_size;
+        if (full_end > block_index + run) {
+            full_end = block_index + run;
+        }
+        if (full_end > block_index) {
+            inode_blocks_dedup(inode, block_index, full_end - block_index);
+        }
+    }
+
+    if (*offset > inode->i_size) {
+        inode->i_size = *offset;
+    }
+    return written;
+}
+
+/**
+ * Get the entry of an open file, locking it (see open_file_lock): calls
+ * through the same handle share its offset and staging buffer, so they are
+ * serialized.
+ *
+ * Input:
+ *   - fhandle: file handle
+ *
+ * Returns the entry, or NULL (without locking it) if the handle is not open.
+ */
+static open_file_entry_t *lock_open_file(int fhandle) {
+    if (get_open_file_entry(fhandle) == NULL) {
+        return NULL;
+    }
+    open_file_lock(fhandle);
     open_file_entry_t *file = get_open_file_entry(fhandle);
     if (file == NULL) {
-        return -1;
+        open_file_unlock(fhandle); // closed meanwhile
+    }
+    return file;
+}
+
+/**
+ * Write the contents staged in an open file's buffer (delayed allocation),
+ * allocating their blocks in a single batch.
+ *
+ * Input:
+ *   - file: the open file entry (which should be locked)
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No space for the staged contents (which are then partly or not at all
+ *     written).
+ */
+static int flush_stage(open_file_entry_t *file) {
+    if (file->of_stage_length == 0) {
+        return 0;
     }
 
-    //  From the open file table entry, we get the inode
     inode_t *inode = inode_get(file->of_inumber);
-    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+    ALWAYS_ASSERT(inode != NULL, "flush_stage: inode of open file deleted");
     lock_wr_inode(file->of_inumber);
+    size_t offset = file->of_stage_offset;
+    size_t written =
+        inode_write(inode, &offset, file->of_stage, file->of_stage_length);
+    unlock_inode(file->of_inumber);
+
+    bool complete = written == file->of_stage_length;
+    file->of_stage_length = 0;
+    return complete ? 0 : -1;
+}
+
+/**
+ * Write to an open file, starting at the current offset (see tfs_write).
+ *
+ * Input:
+ *   - file: the open file entry (which should be locked)
+ *   - buffer: buffer containing the contents to write
+ *   - to_write: length of the buffer contents
+ *
+ * Returns the number of bytes that were written, or -1 in case of error.
+ */
+static ssize_t file_write(open_file_entry_t *file, void const *buffer,
+                          size_t to_write) {
+    if (file->of_snapshot != -1) {
+        return -1; // snapshots are read-only
+    }
 
     // Determine how many bytes to write
-    size_t block_size = state_block_size();
-    if (to_write + file->of_offset > block_size) {
-        to_write = block_size - file->of_offset;
+    size_t max_size = inode_max_size();
+    if (file->of_offset >= max_size) {
+        to_write = 0;
+    } else if (to_write > max_size - file->of_offset) {
+        to_write = max_size - file->of_offset;
     }
 
-    if (to_write > 0) {
-        if (inode->i_size == 0) {
-            // If empty file, allocate new block
-            int bnum = data_block_alloc();
-            if (bnum == -1) {
-                unlock_inode(file->of_inumber);
-                return -1; // no space
-            }
+    // With delayed allocation, writes that follow each other are staged in
+    // the handle's buffer, under the handle's lock only, and only written to
+    // the file when the buffer is flushed
+    if (file->of_stage != NULL) {
+        size_t stage_end = file->of_stage_offset + file->of_stage_length;
+        size_t stage_size = state_delayed_alloc_size();
+        if (file->of_stage_length > 0 &&
+            (file->of_offset != stage_end ||
+             file->of_stage_length + to_write > stage_size) &&
+            flush_stage(file) == -1) {
+            return -1; // no space for the previously staged contents
+        }
 
-            inode->i_data_block = bnum;
+        if (to_write <= stage_size) {
+            if (file->of_stage_length == 0) {
+                file->of_stage_offset = file->of_offset;
+            }
+            memcpy(file->of_stage + file->of_stage_length, buffer, to_write);
+            file->of_stage_length += to_write;
+            file->of_offset += to_write;
+            return (ssize_t)to_write;
         }
+        // larger writes are not staged
+    }
 
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_write: data block deleted mid-write");
+    //  From the open file table entry, we get the inode
+    inode_t *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_write: inode of open file deleted");
+    lock_wr_inode(file->of_inumber);
+    size_t written = inode_write(inode, &file->of_offset, buffer, to_write);
+    unlock_inode(file->of_inumber);
 
-        // Perform the actual write
-        memcpy(block + file->of_offset, buffer, to_write);
+    if (written == 0 && to_write > 0) {
+        return -1; // no space for a single byte
+    }
+    return (ssize_t)written;
+}
 
-        // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_write;
-        if (file->of_offset > inode->i_size) {
-            inode->i_size = file->of_offset;
-        }
+ssize_t tfs_write(int fhandle, void const *buffer, size_t to_write) {
+    open_file_entry_t *file = lock_open_file(fhandle);
+    if (file == NULL) {
+        return -1;
     }
-    unlock_inode(file->of_inumber);
 
-    return (ssize_t)to_write;
+    ssize_t written = file_write(file, buffer, to_write);
+    open_file_unlock(fhandle);
+    return written;
 }
 
-ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
-    open_file_entry_t *file = get_open_file_entry(fhandle);
+int tfs_fsync(int fhandle) {
+    open_file_entry_t *file = lock_open_file(fhandle);
     if (file == NULL) {
         return -1;
     }
 
+    int flushed = flush_stage(file);
+    open_file_unlock(fhandle);
+    return flushed;
+}
+
+int tfs_close(int fhandle) {
+    open_file_entry_t *file = lock_open_file(fhandle);
+    if (file == NULL) {
+        return -1; // invalid fd
+    }
+
+    // the file is closed even if its staged contents do not fit
+    int flushed = flush_stage(file);
+    remove_from_open_file_table(fhandle);
+    open_file_unlock(fhandle);
+
+    return flushed;
+}
+
+/**
+ * Read from a file opened in a snapshot, starting at the current offset.
+ *
+ * Input:
+ *   - file: the open file entry (which should be locked)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *
+ * Returns the number of bytes that were copied from the file to the buffer.
+ */
+static size_t snapshot_read(open_file_entry_t *file, void *buffer,
+                            size_t len) {
+    int snapshot = file->of_snapshot;
+    int inumber = file->of_inumber;
+    lock_rd_inode(inumber);
+    inode_t const *inode = snapshot_inode_get(snapshot, inumber);
+
+    size_t to_read = 0;
+    if (file->of_offset < inode->i_size) {
+        to_read = inode->i_size - file->of_offset;
+    }
+    if (to_read > len) {
+        to_read = len;
+    }
+
+    size_t read = 0;
+    if (inode->i_layout != L_BLOCKS) {
+        memcpy(buffer, snapshot_small_data(snapshot, inumber) + file->of_offset,
+               to_read);
+        file->of_offset += to_read;
+        read = to_read;
+    }
+
+    size_t block_size = state_block_size();
+    while (read < to_read) {
+        size_t block_offset = file->of_offset % block_size;
+        int bnum = snapshot_block_lookup(snapshot, inumber,
+                                         file->of_offset / block_size);
+        size_t chunk = block_size - block_offset;
+        if (chunk > to_read - read) {
+            chunk = to_read - read;
+        }
+
+        if (bnum == -1) {
+            memset((char *)buffer + read, 0, chunk);
+        } else {
+            char const *block = data_block_get(bnum);
+            memcpy((char *)buffer + read, block + block_offset, chunk);
+        }
+        file->of_offset += chunk;
+        read += chunk;
+    }
+    unlock_inode(inumber);
+
+    return to_read;
+}
+
+/**
+ * Read from an open file, starting at the current offset (see tfs_read).
+ *
+ * Input:
+ *   - file: the open file entry (which should be locked)
+ *   - buffer: destination buffer
+ *   - len: length of the buffer
+ *
+ * Returns the number of bytes that were copied from the file to the buffer,
+ * or -1 in case of error.
+ */
+static ssize_t file_read(open_file_entry_t *file, void *buffer, size_t len) {
+    if (file->of_snapshot != -1) {
+        return (ssize_t)snapshot_read(file, buffer, len);
+    }
+
+    // reads see the contents staged through the same handle
+    if (flush_stage(file) == -1) {
+        return -1;
+    }
+
+    // most reads do not race with any write: try copying the file without
+    // locking it first
+    ssize_t copied = inode_read_optimistic(file->of_inumber, file->of_offset,
+                                           buffer, len);
+    if (copied != -1) {
+        file->of_offset += (size_t)copied;
+        return copied;
+    }
+
     // From the open file table entry, we get the inode
     inode_t const *inode = inode_get(file->of_inumber);
     ALWAYS_ASSERT(inode != NULL, "tfs_read: inode of open file deleted");
 
     lock_rd_inode(file->of_inumber);
     // Determine how many bytes to read
-    size_t to_read = inode->i_size - file->of_offset;
+    size_t to_read = 0;
+    if (file->of_offset < inode->i_size) {
+        to_read = inode->i_size - file->of_offset;
+    }
     if (to_read > len) {
         to_read = len;
     }
 
-    if (to_read > 0) {
-        void *block = data_block_get(inode->i_data_block);
-        ALWAYS_ASSERT(block != NULL, "tfs_read: data block deleted mid-read");
+    size_t read = 0;
+    if (inode->i_layout != L_BLOCKS) {
+        memcpy(buffer, inode_small_data(inode) + file->of_offset, to_read);
+        file->of_offset += to_read;
+        read = to_read;
+    }
+
+    // Read run by run (contiguous blocks are copied with a single memcpy)
+    size_t block_size = state_block_size();
+    while (read < to_read) {
+        size_t block_index = file->of_offset / block_size;
+        size_t block_offset = file->of_offset % block_size;
+
+        size_t run;
+        int bnum = inode_block_lookup(inode, block_index, &run);
+        size_t chunk = run * block_size - block_offset;
+        if (chunk > to_read - read) {
+            chunk = to_read - read;
+        }
+
+        if (bnum == -1) {
+            // holes read as zeros, without any data block
+            memset((char *)buffer + read, 0, chunk);
+        } else {
+            char *block = data_block_get_run(
+                bnum, (block_offset + chunk + block_size - 1) / block_size);
+            ALWAYS_ASSERT(block != NULL,
+                          "tfs_read: data block deleted mid-read");
 
-        // Perform the actual read
-        memcpy(buffer, block + file->of_offset, to_read);
+            // Perform the actual read
+            memcpy((char *)buffer + read, block + block_offset, chunk);
+        }
         // The offset associated with the file handle is incremented accordingly
-        file->of_offset += to_read;
+        file->of_offset += chunk;
+        read += chunk;
     }
     unlock_inode(file->of_inumber);
 
     return (ssize_t)to_read;
 }
 
-int tfs_unlink(char const *target) {
-    if (!valid_pathname(target))
+ssize_t tfs_read(int fhandle, void *buffer, size_t len) {
+    open_file_entry_t *file = lock_open_file(fhandle);
+    if (file == NULL) {
         return -1;
+    }
 
-    const char *target_sub = target + 1;
+    ssize_t read = file_read(file, buffer, len);
+    open_file_unlock(fhandle);
+    return read;
+}
 
-    inode_t *iroot = inode_get(ROOT_DIR_INUM);
-    ALWAYS_ASSERT(iroot != NULL, "tfs_unlink: failed to find root dir inode");
-    lock_wr_inode(ROOT_DIR_INUM);
-    int i_target_num = tfs_lookup(target, iroot);
+/**
+ * Move the offset of an open file (see tfs_lseek).
+ *
+ * Input:
+ *   - file: the open file entry (which should be locked)
+ *   - offset: new offset, relative to the position given by whence
+ *   - whence: SEEK_SET, SEEK_CUR or SEEK_END
+ *
+ * Returns the resulting offset, or -1 in case of error.
+ */
+static off_t file_lseek(open_file_entry_t *file, off_t offset, int whence) {
+    // SEEK_END is relative to the size with the staged contents
+    if (whence == SEEK_END && flush_stage(file) == -1) {
+        return -1;
+    }
 
-    if (i_target_num == -1) {
-        unlock_inode(ROOT_DIR_INUM);
+    inode_t const *inode = inode_get(file->of_inumber);
+    ALWAYS_ASSERT(inode != NULL, "tfs_lseek: inode of open file deleted");
+    // only the size is read under the inode's lock: the offset is the
+    // handle's, which is locked
+    lock_rd_inode(file->of_inumber);
+    if (file->of_snapshot != -1) {
+        inode = snapshot_inode_get(file->of_snapshot, file->of_inumber);
+    }
+
+    off_t base;
+    switch (whence) {
+    case SEEK_SET:
+        base = 0;
+        break;
+    case SEEK_CUR:
+        base = (off_t)file->of_offset;
+        break;
+    case SEEK_END:
+        base = (off_t)inode->i_size;
+        break;
+    default:
+        unlock_inode(file->of_inumber);
+        return -1; // invalid whence
+    }
+
+    if (offset < -base || offset > (off_t)inode_max_size() - base) {
+        unlock_inode(file->of_inumber);
+        return -1; // before the start of the file or past its maximum size
+    }
+    // offsets past the end of the file are allowed; writing there leaves a
+    // hole (that reads as zeros) before the written data
+    file->of_offset = (size_t)(base + offset);
+    unlock_inode(file->of_inumber);
+
+    return base + offset;
+}
+
+off_t tfs_lseek(int fhandle, off_t offset, int whence) {
+    open_file_entry_t *file = lock_open_file(fhandle);
+    if (file == NULL) {
         return -1;
     }
 
-    inode_t *i_target = inode_get(i_target_num);
-    if (i_target == NULL) {
-        unlock_inode(ROOT_DIR_INUM);
+    off_t moved = file_lseek(file, offset, whence);
+    open_file_unlock(fhandle);
+    return moved;
+}
+
+int tfs_unlink(char const *target) {
+    char target_sub[MAX_FILE_NAME];
+    int dir = tfs_lookup_parent(target, target_sub, true);
+    if (dir == -1) {
+        return -1;
+    }
+    inode_t *idir = inode_get(dir);
+    int i_target_num = find_in_dir(idir, target_sub);
+
+    if (i_target_num == -1) {
+        unlock_inode(dir);
         return -1;
     }
 
+    inode_t *i_target = inode_get(i_target_num);
     lock_wr_inode(i_target_num);
+    // directories are removed with tfs_rmdir
+    if (i_target->i_node_type == T_DIRECTORY) {
+        unlock_inode(i_target_num);
+        unlock_inode(dir);
+        return -1;
+    }
     if (i_target->i_links - 1 <= 0) {
         inode_delete(i_target_num);
     } else {
         i_target->i_links--;
     }
 
-    clear_dir_entry(iroot, target_sub);
-    unlock_inode(ROOT_DIR_INUM);
+    clear_dir_entry(idir, target_sub);
+    unlock_inode(dir);
     unlock_inode(i_target_num);
     return 0;
 }
 
+int tfs_mkdir(char const *path) {
+    char sub_name[MAX_FILE_NAME];
+    int dir = tfs_lookup_parent(path, sub_name, true);
+    if (dir == -1) {
+        return -1;
+    }
+    inode_t *idir = inode_get(dir);
+    if (find_in_dir(idir, sub_name) != -1) {
+        unlock_inode(dir);
+        return -1; // already exists
+    }
+
+    int inum = inode_create(T_DIRECTORY, dir);
+    if (inum == -1) {
+        unlock_inode(dir);
+        return -1; // no space in inode table (or for its entries)
+    }
+    lock_wr_inode(inum);
+    if (add_dir_entry(idir, sub_name, inum) == -1) {
+        inode_delete(inum);
+        unlock_inode(inum);
+        unlock_inode(dir);
+        return -1; // no space in directory
+    }
+    unlock_inode(inum);
+    unlock_inode(dir);
+    return 0;
+}
+
+int tfs_rmdir(char const *path) {
+    char sub_name[MAX_FILE_NAME];
+    int dir = tfs_lookup_parent(path, sub_name, true);
+    if (dir == -1) {
+        return -1;
+    }
+    inode_t *idir = inode_get(dir);
+    int inum = find_in_dir(idir, sub_name);
+    if (inum == -1) {
+        unlock_inode(dir);
+        return -1;
+    }
+
+    // while it is locked, nothing can be added to it (its entries are only
+    // added with it write-locked)
+    inode_t *inode = inode_get(inum);
+    lock_wr_inode(inum);
+    if (inode->i_node_type != T_DIRECTORY || !dir_empty(inode)) {
+        unlock_inode(inum);
+        unlock_inode(dir);
+        return -1;
+    }
+    clear_dir_entry(idir, sub_name);
+    inode_delete(inum);
+    unlock_inode(inum);
+    unlock_inode(dir);
+    return 0;
+}
+
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
     // Open source
     FILE *source = fopen(source_path, "r");
@@ -414,3 +996,77 @@ int tfs_copy_from_external_fs(char const *source_path, char const *dest_path) {
 
     return 0;
 }
+
+size_t tfs_compress_cold(void) { return data_blocks_compress_cold(); }
+
+int tfs_stats(tfs_stats_t *stats) {
+    if (stats == NULL) {
+        return -1;
+    }
+    state_stats(stats);
+    return 0;
+}
+
+int tfs_snapshot_create(void) { return snapshot_create(); }
+
+/**
+ * Looks for a file as it was when a snapshot was created, walking its path
+ * one directory at a time (each locked while it is looked in, so that it is
+ * not copied into the snapshot in the meantime).
+ *
+ * Input:
+ *   - snapshot: snapshot number
+ *   - name: absolute path name
+ * Returns the inumber of the file, -1 if unsuccessful.
+ */
+static int snapshot_lookup(int snapshot, char const *name) {
+    char component[MAX_FILE_NAME];
+    int inum = ROOT_DIR_INUM;
+    while (*name == '/' && inum != -1) {
+        name = path_component(name + 1, component);
+        if (name == NULL) {
+            return -1;
+        }
+        int dir = inum;
+        lock_rd_inode(dir);
+        inum = snapshot_find_in_dir(snapshot, dir, component);
+        unlock_inode(dir);
+    }
+    return inum;
+}
+
+int tfs_snapshot_open(int snapshot, char const *name) {
+    if (!valid_snapshot(snapshot) || !valid_pathname(name)) {
+        return -1;
+    }
+
+    int inum = snapshot_lookup(snapshot, name);
+    if (inum == -1) {
+        return -1;
+    }
+
+    // the inode may have been deleted or reused since, but then the snapshot
+    // has a copy of it
+    lock_rd_inode(inum);
+    inode_t const *inode = snapshot_inode_get(snapshot, inum);
+    if (inode->i_node_type == T_SYM_LINK) {
+        char target[MAX_SYM_TARGET];
+        strcpy(target, snapshot_sym_target(snapshot, inum));
+        unlock_inode(inum);
+        if (strcmp(target, name) == 0) {
+            return -1; // preventing infinite recursion
+        }
+        return tfs_snapshot_open(snapshot, target);
+    }
+    bool regular = inode->i_node_type == T_FILE;
+    unlock_inode(inum);
+    if (!regular) {
+        return -1;
+    }
+
+    int fhandle = add_to_open_file_table(inum, 0);
+    if (fhandle != -1) {
+        get_open_file_entry(fhandle)->of_snapshot = snapshot;
+    }
+    return fhandle;
+}
@@ -2,8 +2,29 @@
 #define OPERATIONS_H
 
 #include "config.h"
+#include <stdbool.h>
+#include <stdio.h>
 #include <sys/types.h>
 
+/**
+ * Memory backing the data blocks.
+ */
+typedef enum {
+    TFS_ARENA_MMAP,    // anonymous mapping, with pages of the default size
+    TFS_ARENA_MALLOC,  // malloc
+    TFS_ARENA_HUGETLB, // mapping of reserved huge pages (MAP_HUGETLB)
+    TFS_ARENA_THP,     // mapping of transparent huge pages (MADV_HUGEPAGE)
+} tfs_arena_backing;
+
+/**
+ * Placement of the data blocks on NUMA nodes (only for mapped backings).
+ */
+typedef enum {
+    TFS_NUMA_DEFAULT,    // on the node of the thread that first touches them
+    TFS_NUMA_INTERLEAVE, // interleaved over every node
+    TFS_NUMA_GROUPS,     // each allocation group prefers a node of its own
+} tfs_arena_numa;
+
 /**
  * TécnicoFS parameters.
  */
@@ -12,7 +33,57 @@ typedef struct {
     size_t max_block_count;
     size_t max_open_files_count;
 
+    // Size of the data blocks, which should hold at least one directory
+    // entry (76 bytes); with blocks under 496 bytes, directories only hold
+    // shorter names than MAX_FILE_NAME allows (up to 16 bytes with blocks of
+    // 76 bytes, 112 with blocks of 256 bytes)
     size_t block_size;
+
+    // Number of free block numbers each thread may keep cached, so that most
+    // allocations and frees do not touch the global block allocator (0
+    // disables the per-thread caches)
+    size_t block_magazine_size;
+
+    // Number of allocation groups the inode table and the data blocks are
+    // split into, each with its own free map and lock (may be lowered to
+    // keep groups a multiple of 64 blocks)
+    size_t allocation_group_count;
+
+    // Size of the per-handle buffer where consecutive writes are staged, so
+    // that their blocks are only allocated (in a single batch) when the
+    // buffer is flushed (0 disables delayed allocation)
+    size_t delayed_alloc_size;
+
+    // Number of entries of the cache of directory lookups, which maps
+    // (directory, name) pairs to inumbers and also remembers names that were
+    // not found; a power of two (0 disables the cache)
+    size_t dentry_cache_size;
+
+    // Whether directory lookups compare the fingerprints of names with SIMD
+    // instructions (the widest the CPU has, as reported by CPUID), rather
+    // than a 64-bit word at a time
+    bool simd_dir_lookups;
+
+    // Whether full data blocks with the same contents are shared between
+    // files (and within a file) instead of stored twice
+    bool dedup_blocks;
+
+    // Whether data blocks of files that go unused are kept compressed (by
+    // tfs_compress_cold), and decompressed back when accessed; only with the
+    // TFS_ARENA_MMAP backing (tfs_init fails otherwise, or if the mapping
+    // fails), as the memory saved is that of the pages that only hold
+    // compressed blocks, which are returned to the OS; reads copy files
+    // without locking them, but for reads that reach a compressed block,
+    // which lock the file to decompress it
+    bool compress_blocks;
+
+    // Maximum number of snapshots (see tfs_snapshot_create)
+    size_t max_snapshot_count;
+
+    // Memory backing the data blocks (backings that are not available fall
+    // back to malloc), and its placement on NUMA nodes
+    tfs_arena_backing arena_backing;
+    tfs_arena_numa arena_numa;
 } tfs_params;
 
 /**
@@ -77,13 +148,30 @@ int tfs_sym_link(char const *target, char const *link_name);
  */
 int tfs_link(char const *target_file, char const *link_name);
 
+/**
+ * Create a file with the same contents as another one (a clone), without
+ * copying its data blocks: both files share them until one of the files
+ * writes to them, which copies the blocks it writes to.
+ *
+ * Input:
+ *   - source: absolute path name of the file to clone
+ *   - dest: absolute path name of the clone, which must not exist
+ *
+ * Contents still staged in a handle of the source (see tfs_fsync) are not
+ * part of the clone.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_clone(char const *source, char const *dest);
+
 /**
  * Close a file.
  *
  * Input:
  *   - fhandle: file handle (obtained from a previous call to tfs_open)
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise (the file is also closed if its staged
+ * contents could not be written).
  */
 int tfs_close(int fhandle);
 
@@ -100,6 +188,22 @@ int tfs_close(int fhandle);
  */
 ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
 
+/**
+ * Write the contents staged for an open file (with delayed allocation) to the
+ * file, allocating their blocks.
+ *
+ * Staged contents are also written when the file is closed or read from, and
+ * when a write does not follow them or does not fit in the staging buffer.
+ * Until then, they are not visible through other handles.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *
+ * Returns 0 if successful, -1 otherwise (e.g. if there was no space for the
+ * staged contents).
+ */
+int tfs_fsync(int fhandle);
+
 /**
  * Read from an open file, starting at the current offset.
  *
@@ -113,6 +217,23 @@ ssize_t tfs_write(int fhandle, void const *buffer, size_t len);
  */
 ssize_t tfs_read(int fhandle, void *buffer, size_t len);
 
+/**
+ * Move the offset of an open file.
+ *
+ * Input:
+ *   - fhandle: file handle (obtained from a previous call to tfs_open)
+ *   - offset: new offset, relative to the position given by whence
+ *   - whence: SEEK_SET (start of the file), SEEK_CUR (current offset) or
+ *     SEEK_END (end of the file)
+ *
+ * The offset may be moved past the end of the file: a write there leaves a
+ * hole, which takes no data blocks and reads as zeros.
+ *
+ * Returns the resulting offset (from the start of the file), or -1 in case of
+ * error.
+ */
+off_t tfs_lseek(int fhandle, off_t offset, int whence);
+
 /**
  * Delete a link, or a file if the number of hard links reaches 0, that
  * exists in TécnicoFS.
@@ -124,6 +245,27 @@ ssize_t tfs_read(int fhandle, void *buffer, size_t len);
  */
 int tfs_unlink(char const *target);
 
+/**
+ * Create an empty directory in TécnicoFS.
+ *
+ * Input:
+ *   - path: absolute path name of the directory (whose parent directory must
+ *     already exist)
+ *
+ * Returns 0 if successful, -1 otherwise (e.g. if the path already exists).
+ */
+int tfs_mkdir(char const *path);
+
+/**
+ * Remove an empty directory from TécnicoFS.
+ *
+ * Input:
+ *   - path: absolute path name of the directory
+ *
+ * Returns 0 if successful, -1 otherwise (e.g. if the directory is not empty).
+ */
+int tfs_rmdir(char const *path);
+
 /**
  * Copy the contents of a file that exists in the OS' file system tree
  * (outside TécnicoFS) to the TécnicoFS.
@@ -137,4 +279,57 @@ int tfs_unlink(char const *target);
  */
 int tfs_copy_from_external_fs(char const *source_path, char const *dest_path);
 
+/**
+ * Create a point-in-time snapshot of the whole file system, which later
+ * changes do not affect. Creating a snapshot copies nothing: files are only
+ * copied (sharing their data blocks with the snapshot) before they change.
+ *
+ * Returns the snapshot's number if successful, -1 otherwise (if there are
+ * already max_snapshot_count snapshots).
+ */
+int tfs_snapshot_create(void);
+
+/**
+ * Open a file as it was when a snapshot was created, for reading only
+ * (tfs_write fails on the returned handle).
+ *
+ * Input:
+ *   - snapshot: snapshot number (obtained from tfs_snapshot_create)
+ *   - name: absolute path name
+ *
+ * Returns file handle of the opened file if successful, -1 otherwise.
+ */
+int tfs_snapshot_open(int snapshot, char const *name);
+
+/**
+ * TécnicoFS block usage statistics.
+ */
+typedef struct {
+    size_t block_count;            // total number of data blocks
+    size_t free_block_count;       // number of free data blocks
+    size_t compressed_block_count; // number of compressed data blocks
+    size_t compressed_bytes;       // memory taken by the compressed blocks
+    // uncompressed over compressed size of the compressed blocks (1 if none)
+    double compression_ratio;
+} tfs_stats_t;
+
+/**
+ * Compress the data blocks of files that went unused since the previous call
+ * (if block compression is enabled). Blocks accessed in between are left
+ * decompressed until the next call, so that the blocks in use stay hot.
+ *
+ * Returns the number of blocks compressed.
+ */
+size_t tfs_compress_cold(void);
+
+/**
+ * Obtain block usage statistics.
+ *
+ * Input:
+ *   - stats: where to store the statistics
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+int tfs_stats(tfs_stats_t *stats);
+
 #endif // OPERATIONS_H
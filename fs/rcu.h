@@ -0,0 +1,92 @@
+#ifndef RCU_H
+#define RCU_H
+
+#include "config.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+/*
+ * Read-copy-update style protection of data read without locks: readers
+ * announce themselves in one of two phases, and a writer that retired
+ * something waits, with rcu_synchronize, until every reader that may still
+ * see it is gone before reusing it.
+ *
+ * Readers count themselves in stripes (one cache line each, given to threads
+ * in turn), so that readers on different threads write no shared memory.
+ */
+
+#define RCU_STRIPES (64)
+
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) atomic_long rs_readers[2]; // readers per phase
+} rcu_stripe_t;
+
+typedef struct {
+    rcu_stripe_t r_stripes[RCU_STRIPES];
+    atomic_uint r_phase;       // readers count themselves in r_phase % 2
+    atomic_uint r_next_stripe; // stripe for the next thread to read
+    pthread_mutex_t r_lock;    // taken by rcu_synchronize
+} rcu_t;
+
+// stripe of the calling thread, plus 1 (0 if it has none yet)
+static _Thread_local unsigned rcu_thread_stripe;
+
+static inline void rcu_init(rcu_t *rcu) {
+    for (size_t s = 0; s < RCU_STRIPES; s++) {
+        atomic_init(&rcu->r_stripes[s].rs_readers[0], 0);
+        atomic_init(&rcu->r_stripes[s].rs_readers[1], 0);
+    }
+    atomic_init(&rcu->r_phase, 0);
+    atomic_init(&rcu->r_next_stripe, 0);
+    pthread_mutex_init(&rcu->r_lock, NULL);
+}
+
+static inline void rcu_destroy(rcu_t *rcu) {
+    pthread_mutex_destroy(&rcu->r_lock);
+}
+
+/**
+ * Start reading data protected by rcu (which must not block on anything an
+ * rcu_synchronize caller may hold).
+ *
+ * Returns the token to pass to rcu_read_unlock.
+ */
+static inline unsigned rcu_read_lock(rcu_t *rcu) {
+    if (rcu_thread_stripe == 0) {
+        rcu_thread_stripe =
+            atomic_fetch_add(&rcu->r_next_stripe, 1) % RCU_STRIPES + 1;
+    }
+    unsigned stripe = rcu_thread_stripe - 1;
+    unsigned phase = atomic_load(&rcu->r_phase) % 2;
+    atomic_fetch_add(&rcu->r_stripes[stripe].rs_readers[phase], 1);
+    return stripe * 2 + phase;
+}
+
+static inline void rcu_read_unlock(rcu_t *rcu, unsigned token) {
+    atomic_fetch_sub_explicit(&rcu->r_stripes[token / 2].rs_readers[token % 2],
+                              1, memory_order_release);
+}
+
+/**
+ * Wait for every reader that started before the call to finish.
+ *
+ * Readers that read the phase before a flip may still count themselves in the
+ * old phase, so both phases are waited on. Each is first flipped away from,
+ * so that new readers cannot keep the wait going.
+ */
+static inline void rcu_synchronize(rcu_t *rcu) {
+    pthread_mutex_lock(&rcu->r_lock);
+    for (int flip = 0; flip < 2; flip++) {
+        unsigned phase = atomic_fetch_add(&rcu->r_phase, 1) % 2;
+        for (size_t s = 0; s < RCU_STRIPES; s++) {
+            while (atomic_load(&rcu->r_stripes[s].rs_readers[phase]) != 0) {
+                sched_yield();
+            }
+        }
+    }
+    pthread_mutex_unlock(&rcu->r_lock);
+}
+
+#endif // RCU_H
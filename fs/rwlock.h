@@ -0,0 +1,126 @@
+#ifndef RWLOCK_H
+#define RWLOCK_H
+
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/*
+ * Compact reader-writer lock: a single 32-bit word holding the number of
+ * readers, whether a writer holds the lock and whether threads sleep on it
+ * (on a futex, after spinning for a while). A zeroed word is an unlocked
+ * lock. Like the default pthread rwlock, readers are preferred, so a thread
+ * may take a read lock it already holds.
+ *
+ * Uses syscall, so it needs _DEFAULT_SOURCE (or _GNU_SOURCE).
+ */
+
+typedef _Atomic uint32_t rwlock_t;
+
+#define RWLOCK_WRITER (UINT32_C(1) << 31)  // a writer holds the lock
+#define RWLOCK_WAITERS (UINT32_C(1) << 30) // threads may sleep on the lock
+#define RWLOCK_READERS (RWLOCK_WAITERS - 1) // number of readers
+#define RWLOCK_SPINS (100)
+
+static inline void rwlock_cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+/**
+ * Wait for a lock to change (spinning first, then sleeping).
+ *
+ * Input:
+ *   - lock: the lock
+ *   - value: the value that was seen (with a held lock)
+ *   - spins: number of times the caller waited so far
+ */
+static inline void rwlock_wait(rwlock_t *lock, uint32_t value,
+                               unsigned spins) {
+    if (spins < RWLOCK_SPINS) {
+        rwlock_cpu_relax();
+        return;
+    }
+    // let the holder know it should wake up waiters when releasing the lock
+    if (!(value & RWLOCK_WAITERS) &&
+        !atomic_compare_exchange_weak_explicit(lock, &value,
+                                               value | RWLOCK_WAITERS,
+                                               memory_order_relaxed,
+                                               memory_order_relaxed)) {
+        return; // changed in the meantime
+    }
+    syscall(SYS_futex, lock, FUTEX_WAIT_PRIVATE, value | RWLOCK_WAITERS, NULL,
+            NULL, 0);
+}
+
+static inline void rwlock_rdlock(rwlock_t *lock) {
+    uint32_t value = atomic_load_explicit(lock, memory_order_relaxed);
+    for (unsigned spins = 0;; spins++) {
+        if (!(value & RWLOCK_WRITER)) {
+            if (atomic_compare_exchange_weak_explicit(
+                    lock, &value, value + 1, memory_order_acquire,
+                    memory_order_relaxed)) {
+                return;
+            }
+            continue;
+        }
+        rwlock_wait(lock, value, spins);
+        value = atomic_load_explicit(lock, memory_order_relaxed);
+    }
+}
+
+/**
+ * Try to take a lock for writing, without waiting.
+ *
+ * Returns whether the lock was taken.
+ */
+static inline bool rwlock_trywrlock(rwlock_t *lock) {
+    uint32_t value = atomic_load_explicit(lock, memory_order_relaxed);
+    while (!(value & (RWLOCK_WRITER | RWLOCK_READERS))) {
+        if (atomic_compare_exchange_weak_explicit(
+                lock, &value, value | RWLOCK_WRITER, memory_order_acquire,
+                memory_order_relaxed)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static inline void rwlock_wrlock(rwlock_t *lock) {
+    for (unsigned spins = 0;; spins++) {
+        if (rwlock_trywrlock(lock)) {
+            return;
+        }
+        uint32_t value = atomic_load_explicit(lock, memory_order_relaxed);
+        if (value & (RWLOCK_WRITER | RWLOCK_READERS)) {
+            rwlock_wait(lock, value, spins);
+        }
+    }
+}
+
+/**
+ * Release a lock held for reading or writing.
+ */
+static inline void rwlock_unlock(rwlock_t *lock) {
+    uint32_t value = atomic_load_explicit(lock, memory_order_relaxed);
+    uint32_t next;
+    do {
+        next = value & RWLOCK_WRITER ? value & ~RWLOCK_WRITER : value - 1;
+        // waiters can only go on once no one holds the lock
+        if (!(next & RWLOCK_READERS)) {
+            next &= ~RWLOCK_WAITERS;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        lock, &value, next, memory_order_release, memory_order_relaxed));
+
+    if ((value & RWLOCK_WAITERS) && !(next & RWLOCK_WAITERS)) {
+        syscall(SYS_futex, lock, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+    }
+}
+
+#endif // RWLOCK_H
@@ -1,11 +1,23 @@
+// MAP_ANONYMOUS, madvise and syscall are not part of POSIX
+#define _DEFAULT_SOURCE
+
 #include "state.h"
 #include "betterassert.h"
+#include "bitmap.h"
+#include "fingerprint.h"
+#include "lz.h"
+#include "rcu.h"
+#include "rwlock.h"
+#include "xxhash.h"
 
 #include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 /*
  * Persistent FS state
@@ -16,33 +28,290 @@ static tfs_params fs_params;
 
 // Inode table
 static inode_t *inode_table;
-static pthread_rwlock_t *inode_rwlocks_table;
-static allocation_state_t *freeinode_ts;
-static pthread_mutex_t freeinode_ts_lock;
+// block map of each inode (kept apart from inode_table, which scans read)
+static inode_map_t *inode_maps;
+// one lock per inode; consecutive inodes, which are often used together, have
+// their locks on different cache lines (see inode_rwlock)
+static rwlock_t *inode_rwlocks_table;
+static size_t inode_rwlock_lines; // cache lines taken by inode_rwlocks_table
+// sequence counter per inode: odd while a writer holds the inode's lock, so
+// readers that copied the file without the lock can tell whether it changed
+static _Atomic uint32_t *inode_seqs;
+#define RWLOCKS_PER_LINE (CACHE_LINE_SIZE / sizeof(rwlock_t))
+// Blocks of entries of a directory, found by extendible hashing: each name
+// goes in the block of the slot picked by its hash (see dir_route), so a
+// lookup reads a single block. A block of local depth d holds the names whose
+// routes share their d low bits, and takes the 2^(dm_depth - d) slots with
+// those bits; a full block is split in two (see dir_split), which only
+// doubles the slots (not the blocks) when d is dm_depth.
+typedef struct {
+    _Atomic int ds_block; // block number
+    uint32_t ds_index;    // index of the block inside the directory
+    uint32_t ds_depth;    // local depth of the block
+} dir_slot_t;
+typedef struct {
+    size_t dm_depth; // the map has 2^dm_depth slots
+    dir_slot_t dm_slots[];
+} dir_map_t;
+// blocks of each directory inode (NULL for other inodes), published for
+// lookups that do not lock the directory; maps and blocks a directory no
+// longer uses are only freed once such lookups are over (see dir_rcu)
+static _Atomic(dir_map_t *) *dir_maps;
+static rcu_t dir_rcu;
+// a block of directory entries starts with maps of its taken entries and of
+// the taken units of its name heap, and the fingerprints of their names (see
+// dir_entry_find); the entries follow, and then the name heap, where the name
+// of each entry takes a run of units
+static size_t dir_entry_count;  // entries per directory block
+static size_t dir_name_units;   // units of its name heap
+static size_t dir_taken_words;  // words of its map of taken entries
+static size_t dir_unit_words;   // words of its map of taken name units
+static size_t dir_fp_words;     // words of fingerprints (whole groups)
+static size_t dir_name_max;     // longest name its heap holds
+static fp_match_t dir_fp_match; // how fingerprints are compared
+
+/**
+ * Cache of directory lookups (if enabled): direct-mapped, each entry holding
+ * the result of looking a name up in a directory (-1 if it was not found).
+ * Entries are read and filled without locks, each under a sequence counter,
+ * and a change to a directory invalidates the entry of the name it changed
+ * (see dentry_invalidate). Only names shorter than DENTRY_NAME_MAX (as most
+ * are) are cached.
+ */
+#define DENTRY_NAME_MAX (40)
+#define DENTRY_NAME_WORDS ((DENTRY_NAME_MAX + 7) / sizeof(uint64_t))
+typedef struct {
+    _Alignas(CACHE_LINE_SIZE) _Atomic uint32_t dc_seq; // odd while written
+    _Atomic int dc_parent; // the directory (-1 if the entry is empty)
+    _Atomic int dc_inumber;
+    _Atomic uint64_t dc_name[DENTRY_NAME_WORDS]; // padded with zeros
+} dentry_t;
+
+static dentry_t *dentry_cache;
+// targets of symbolic links, per inode (kept apart from inode_table, which is
+// used far more often)
+static char (*inode_targets)[MAX_SYM_TARGET];
+// one bit per inode, set if taken; claimed and released with atomic operations
+static _Atomic uint64_t *freeinode_ts;
 // Data blocks
 static char *fs_data; // # blocks * block size
-static allocation_state_t *free_blocks;
-static pthread_mutex_t free_blocks_lock;
+static size_t fs_data_size;
+// size of the pages backing fs_data, which can be returned to the OS one by
+// one (0 if fs_data is not mapped, and so they cannot)
+static size_t fs_data_page_size;
+
+/**
+ * Allocation group: a slice of the inode table and of the data blocks, with
+ * its own free block map and lock (in the style of ext2 block groups).
+ * Blocks of a file are allocated from the group of its inode, so that they
+ * stay close together in fs_data.
+ */
+typedef struct {
+    // protects ag_free_blocks and ag_free_blocks_full (each group's lock is in
+    // its own cache line)
+    _Alignas(CACHE_LINE_SIZE) pthread_mutex_t ag_lock;
+    size_t ag_first_block;
+    size_t ag_block_count;
+    uint64_t *ag_free_blocks;      // one bit per block, set if taken
+    uint64_t *ag_free_blocks_full; // one bit per ag_free_blocks word, set if
+                                   // the word is full
+    atomic_size_t ag_free_count;   // number of free blocks
+    size_t ag_first_inode;
+    size_t ag_inode_count;
+    // word of freeinode_ts (relative to the group's first one) where the next
+    // inode allocation starts looking
+    atomic_size_t ag_inode_hint;
+} alloc_group_t;
+
+static alloc_group_t *alloc_groups;
+static size_t group_count;
+static size_t group_blocks; // blocks per group (a multiple of 64)
+static size_t group_inodes; // inodes per group
+
+/**
+ * Packed blocks: data blocks shared by the contents of small files (tail
+ * packing), split in PACK_UNITS units. Each file takes a slot of contiguous
+ * units of a single block.
+ */
+static uint64_t *pack_units; // one word per data block, one bit per unit of
+                             // packed blocks, set if taken
+static int *pack_blocks;     // packed blocks with free units
+static size_t pack_block_count;
+static pthread_mutex_t pack_lock; // protects pack_units and pack_blocks
+
+/**
+ * Block deduplication (if enabled): full data blocks of files are indexed by
+ * the hash of their contents, and a block with the same contents as an
+ * indexed one is replaced by a reference to it. Indexed and shared blocks are
+ * never written in place (shared ones are copied on write).
+ */
+typedef struct {
+    uint64_t de_hash;
+    int de_block; // -1 if the entry is empty
+} dedup_entry_t;
+
+static dedup_entry_t *dedup_index; // open addressing, with linear probing
+static size_t dedup_index_size;    // a power of two, over twice DATA_BLOCKS
+static uint64_t *block_hashes;  // per data block, hash it is indexed by
+static uint64_t *block_indexed; // one bit per data block, set if indexed
+
+/**
+ * Shared data blocks: with deduplication, once a file is cloned or once a
+ * snapshot is taken, a data block may be mapped by several files (or several
+ * times by the same file, or by snapshots), and is copied before being
+ * written in place.
+ *
+ * Only blocks whose bit is set in block_shared are looked at under
+ * share_lock. A block only becomes shared while the file mapping it is
+ * locked (it is cloned or preserved, or indexed by its file's writes, and
+ * only indexed blocks are mapped again), so a file holding its lock can tell
+ * its blocks are private without the lock.
+ */
+static uint32_t *block_refs; // per data block, references besides the
+                             // first one
+// one bit per data block, set while it has references besides the first one
+// or is in the deduplication index (changed with share_lock held)
+static _Atomic uint64_t *block_shared;
+static pthread_mutex_t share_lock; // protects block_refs and the
+                                   // deduplication index
+
+/**
+ * Snapshots: creating one only bumps snapshot_count. Each inode is preserved
+ * (copied, for the latest snapshot) before its first change afterwards, with
+ * its data blocks shared with the live file. A snapshot sees the oldest copy
+ * of an inode made for it or a later snapshot, or the live inode if it has
+ * not changed since.
+ */
+typedef struct snapshot_inode {
+    struct snapshot_inode *si_next; // copy for an earlier snapshot
+    size_t si_snapshot;             // latest snapshot when it was copied
+    inode_t si_inode;
+    inode_map_t si_map; // block map of si_inode
+    dir_map_t *si_dir_map; // map of the blocks of directories (else NULL)
+    char si_target[MAX_SYM_TARGET]; // target of symbolic links
+    int *si_blocks;        // data blocks of the contents, each holding a
+                           // reference (-1 for holes)
+    size_t si_block_count; // number of entries in si_blocks
+    char *si_data;         // contents of small (inline or packed) files
+} snapshot_inode_t;
+
+static snapshot_inode_t **inode_copies; // per inode, its latest copy (NULL
+                                         // if none)
+static atomic_size_t snapshot_count;
+static size_t *inode_epochs; // per inode, snapshot_count when it was last
+                             // preserved or created
+
+/**
+ * Block compression (if enabled): blocks of files that are not accessed
+ * between two compression passes are replaced by a compressed copy, and pages
+ * of fs_data that only hold compressed blocks are returned to the OS. A
+ * compressed block is decompressed back in place when accessed, so the blocks
+ * in use stay decompressed (as a cache of hot blocks) until they cool down.
+ */
+static _Atomic uint64_t *block_compressed; // one bit per data block, set if
+                                           // it is compressed
+static uint8_t **block_store;       // per data block, its compressed copy
+static size_t *block_store_size;    // per data block, size of the copy
+static _Atomic uint8_t *block_accessed; // per data block, set when accessed
+static uint8_t *compress_buffer;
+static size_t compressed_blocks;
+static size_t compressed_bytes;
+// protects the compressed copies, their counters and compress_buffer
+static pthread_mutex_t compress_lock;
 
 /*
  * Volatile FS state
  */
 static open_file_entry_t *open_file_table;
-static pthread_mutex_t *open_file_locks_table; //TODO do me
-static allocation_state_t *free_open_file_entries;
+static char *open_file_stages; // staging buffers of the open file entries
+static pthread_mutex_t *open_file_locks_table; // one per file handle
+// taken with free_open_file_entries_lock held, but looked up without it
+static _Atomic allocation_state_t *free_open_file_entries;
 static pthread_mutex_t free_open_file_entries_lock; 
 
+/**
+ * Per-thread cache (magazine) of free block numbers, with a slot of
+ * fs_params.block_magazine_size blocks for each allocation group. Cached
+ * blocks are marked as taken in their group's free block map.
+ */
+typedef struct block_magazine {
+    // only contended when another thread reclaims the cached blocks
+    pthread_mutex_t bm_lock;
+    struct block_magazine *bm_next; // next in the magazines list
+    size_t *bm_counts;              // number of cached blocks of each group
+    int *bm_blocks; // cached blocks of group g start at g * MAGAZINE_SIZE
+} block_magazine_t;
+
+static block_magazine_t *magazines; // every thread's magazine
+static pthread_mutex_t magazines_lock;
+static pthread_key_t magazine_key; // releases a thread's magazine on exit
+// Incremented on every state_init, so magazines of a previous instance of the
+// FS are never used
+static size_t fs_generation;
+static _Thread_local block_magazine_t *thread_magazine;
+static _Thread_local size_t thread_magazine_generation;
+
 // Convenience macros
 #define INODE_TABLE_SIZE (fs_params.max_inode_count)
 #define DATA_BLOCKS (fs_params.max_block_count)
 #define MAX_OPEN_FILES (fs_params.max_open_files_count)
 #define BLOCK_SIZE (fs_params.block_size)
-#define MAX_DIR_ENTRIES (BLOCK_SIZE / sizeof(dir_entry_t))
+#define MAGAZINE_SIZE (fs_params.block_magazine_size)
+#define DELAYED_ALLOC_SIZE (fs_params.delayed_alloc_size)
+#define DENTRY_CACHE_SIZE (fs_params.dentry_cache_size)
+#define DEDUP_BLOCKS (fs_params.dedup_blocks)
+#define SIMD_DIR_LOOKUPS (fs_params.simd_dir_lookups)
+#define COMPRESS_BLOCKS (fs_params.compress_blocks)
+#define MAX_SNAPSHOTS (fs_params.max_snapshot_count)
+#define ARENA_BACKING (fs_params.arena_backing)
+#define ARENA_NUMA (fs_params.arena_numa)
+
+// NUMA memory policies of mbind (as in the kernel's uapi/linux/mempolicy.h)
+#define MPOL_PREFERRED (1)
+#define MPOL_INTERLEAVE (3)
+
+#define MAX_DIR_ENTRIES (dir_entry_count)
+// Slots a directory map may have per block of the directory (a split that
+// needs more slots fails, which bounds the cost of doubling the map)
+#define DIR_SLOTS_PER_BLOCK (16)
+#define BLOCK_POINTERS (BLOCK_SIZE / sizeof(int))
+#define PACK_UNITS (BITMAP_WORD_BITS)
+#define PACK_UNIT_SIZE (BLOCK_SIZE / PACK_UNITS)
+// Files larger than this get blocks of their own
+#define PACK_MAX_SIZE (BLOCK_SIZE / 2)
+// Times a read without locks is tried before locking the inode
+#define OPTIMISTIC_READ_TRIES (4)
+// Bytes of a unit of the name heap of a block of directory entries
+#define DIR_NAME_UNIT (8)
+// Units of name heap per directory entry, which makes room for names of
+// 2 * DIR_NAME_UNIT bytes on average
+#define DIR_NAME_UNITS_PER_ENTRY (2)
 
 static inline bool valid_inumber(int inumber) {
     return inumber >= 0 && inumber < INODE_TABLE_SIZE;
 }
 
+/**
+ * Lock of an inode. Locks are spread over the cache lines of
+ * inode_rwlocks_table column by column, so that locks of neighbouring inodes
+ * do not share a cache line.
+ */
+static inline rwlock_t *inode_rwlock(int inumber) {
+    size_t i = (size_t)inumber;
+    return &inode_rwlocks_table[(i % inode_rwlock_lines) * RWLOCKS_PER_LINE +
+                                i / inode_rwlock_lines];
+}
+
+/**
+ * Mark an inode whose lock was just taken for writing as being changed (until
+ * unlock_inode).
+ */
+static inline void inode_seq_write_begin(int inumber) {
+    atomic_fetch_add_explicit(&inode_seqs[inumber], 1, memory_order_relaxed);
+    // the changes that follow cannot be seen before the counter is odd
+    atomic_thread_fence(memory_order_release);
+}
+
 static inline bool valid_block_number(int block_number) {
     return block_number >= 0 && block_number < DATA_BLOCKS;
 }
@@ -53,6 +322,8 @@ static inline bool valid_file_handle(int file_handle) {
 
 size_t state_block_size(void) { return BLOCK_SIZE; }
 
+size_t state_delayed_alloc_size(void) { return DELAYED_ALLOC_SIZE; }
+
 /**
  * Do nothing, while preventing the compiler from performing any optimizations.
  *
@@ -84,6 +355,308 @@ static void insert_delay(void) {
     }
 }
 
+static void magazine_release(void *magazine);
+static bool block_run_compressed(int block_number, size_t count);
+
+/**
+ * Split the inode table and the data blocks into allocation groups.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - malloc failure when allocating the groups' free block maps.
+ */
+static int alloc_groups_init(void) {
+    size_t wanted = fs_params.allocation_group_count;
+    if (wanted == 0) {
+        wanted = 1;
+    }
+
+    // Groups hold whole words of the free block maps
+    group_blocks = (DATA_BLOCKS + wanted - 1) / wanted;
+    group_blocks = bitmap_words(group_blocks) * BITMAP_WORD_BITS;
+    group_count = (DATA_BLOCKS + group_blocks - 1) / group_blocks;
+    if (group_count == 0) {
+        group_count = 1;
+    }
+    group_inodes = (INODE_TABLE_SIZE + group_count - 1) / group_count;
+
+    alloc_groups =
+        aligned_alloc(CACHE_LINE_SIZE, group_count * sizeof(alloc_group_t));
+    if (alloc_groups == NULL) {
+        return -1;
+    }
+
+    for (size_t g = 0; g < group_count; g++) {
+        alloc_group_t *group = &alloc_groups[g];
+        init_mutex(&group->ag_lock);
+
+        group->ag_first_block = g * group_blocks;
+        group->ag_block_count = DATA_BLOCKS - group->ag_first_block;
+        if (group->ag_block_count > group_blocks) {
+            group->ag_block_count = group_blocks;
+        }
+        size_t words = bitmap_words(group->ag_block_count);
+        group->ag_free_blocks = malloc(words * sizeof(uint64_t));
+        group->ag_free_blocks_full =
+            malloc(bitmap_words(words) * sizeof(uint64_t));
+        if (!group->ag_free_blocks || !group->ag_free_blocks_full) {
+            return -1;
+        }
+        bitmap_init(group->ag_free_blocks, group->ag_block_count);
+        bitmap_init(group->ag_free_blocks_full, words);
+        if (group->ag_free_blocks[words - 1] == ~UINT64_C(0)) {
+            // only padding bits in the last word
+            bitmap_set(group->ag_free_blocks_full, words - 1);
+        }
+        atomic_init(&group->ag_free_count, group->ag_block_count);
+
+        group->ag_first_inode = g * group_inodes;
+        group->ag_inode_count = 0;
+        if (group->ag_first_inode < INODE_TABLE_SIZE) {
+            group->ag_inode_count = INODE_TABLE_SIZE - group->ag_first_inode;
+            if (group->ag_inode_count > group_inodes) {
+                group->ag_inode_count = group_inodes;
+            }
+        }
+        atomic_init(&group->ag_inode_hint, 0);
+    }
+
+    return 0;
+}
+
+/**
+ * Free the allocation groups.
+ */
+static void alloc_groups_destroy(void) {
+    for (size_t g = 0; g < group_count; g++) {
+        destroy_mutex(&alloc_groups[g].ag_lock);
+        free(alloc_groups[g].ag_free_blocks);
+        free(alloc_groups[g].ag_free_blocks_full);
+    }
+    free(alloc_groups);
+    alloc_groups = NULL;
+}
+
+/**
+ * Allocate fs_data with the backing selected by the arena_backing parameter,
+ * falling back to malloc unless blocks are compressed (sets fs_data to NULL
+ * if even that fails).
+ *
+ * Huge pages (reserved, or transparent) cover more of fs_data with each TLB
+ * entry, so large reads and writes miss the TLB less often.
+ */
+static void fs_data_map(void) {
+    size_t size = DATA_BLOCKS * BLOCK_SIZE;
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+
+    switch (ARENA_BACKING) {
+    case TFS_ARENA_MALLOC:
+        page_size = 0;
+        break;
+    case TFS_ARENA_HUGETLB:
+        page_size = HUGE_PAGE_SIZE;
+        flags |= MAP_HUGETLB;
+        break;
+    case TFS_ARENA_THP:
+        page_size = HUGE_PAGE_SIZE;
+        break;
+    case TFS_ARENA_MMAP:
+        break;
+    default:
+        PANIC("fs_data_map: unknown arena backing");
+    }
+
+    if (page_size > 0) {
+        // mappings are made of whole pages
+        fs_data_size = (size + page_size - 1) / page_size * page_size;
+        // transparent huge pages need aligned mappings: map an extra huge
+        // page, and unmap what is left around the aligned part
+        size_t extra = ARENA_BACKING == TFS_ARENA_THP ? page_size : 0;
+        char *mapping = mmap(NULL, fs_data_size + extra,
+                             PROT_READ | PROT_WRITE, flags, -1, 0);
+        if (mapping != MAP_FAILED) {
+            size_t skip = 0;
+            if (extra > 0) {
+                skip = (page_size - (uintptr_t)mapping % page_size) % page_size;
+            }
+            if (skip > 0) {
+                munmap(mapping, skip);
+            }
+            if (extra > skip) {
+                munmap(mapping + skip + fs_data_size, extra - skip);
+            }
+            fs_data = mapping + skip;
+            fs_data_page_size = page_size;
+            if (ARENA_BACKING == TFS_ARENA_THP) {
+                madvise(fs_data, fs_data_size, MADV_HUGEPAGE);
+            }
+            return;
+        }
+    }
+
+    // malloc, or the mapping failed (e.g. no huge pages are reserved)
+    fs_data_size = size;
+    fs_data_page_size = 0;
+    fs_data = COMPRESS_BLOCKS ? NULL : malloc(size); // (see state_init)
+}
+
+/**
+ * Free fs_data.
+ */
+static void fs_data_unmap(void) {
+    if (fs_data_page_size > 0) {
+        munmap(fs_data, fs_data_size);
+    } else {
+        free(fs_data);
+    }
+    fs_data = NULL;
+}
+
+/**
+ * Obtain the NUMA nodes that are online.
+ *
+ * Returns a mask of the nodes (up to the 64th), with only node 0 if they
+ * cannot be determined.
+ */
+static uint64_t numa_online_nodes(void) {
+    FILE *online = fopen("/sys/devices/system/node/online", "r");
+    if (online == NULL) {
+        return 1;
+    }
+
+    // a list of ranges, such as "0-3,8"
+    uint64_t nodes = 0;
+    unsigned first, last;
+    int n;
+    while ((n = fscanf(online, "%u-%u", &first, &last)) >= 1) {
+        if (n == 1) {
+            last = first;
+        }
+        for (unsigned node = first; node <= last && node < 64; node++) {
+            nodes |= UINT64_C(1) << node;
+        }
+        if (fgetc(online) != ',') {
+            break;
+        }
+    }
+    fclose(online);
+    return nodes != 0 ? nodes : 1;
+}
+
+/**
+ * Set the NUMA memory policy of a part of fs_data (the pages it spans).
+ *
+ * Failures are ignored: placement only affects performance.
+ */
+static void fs_data_bind(size_t offset, size_t length, int mode,
+                         uint64_t nodes) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = offset / page_size * page_size;
+    size_t end = (offset + length + page_size - 1) / page_size * page_size;
+    unsigned long mask = (unsigned long)nodes;
+    syscall(SYS_mbind, fs_data + start, end - start, mode, &mask,
+            sizeof(mask) * 8 + 1, 0);
+}
+
+/**
+ * Place fs_data on NUMA nodes as selected by the arena_numa parameter:
+ * interleaved over every node, or each allocation group preferring a node
+ * of its own (so that files of a group, and the threads working on them,
+ * can stay on one node).
+ */
+static void fs_data_place(void) {
+    if (ARENA_NUMA == TFS_NUMA_DEFAULT || fs_data == NULL ||
+        fs_data_page_size == 0) {
+        return; // first touch; memory from malloc may be shared with others
+    }
+
+    uint64_t nodes = numa_online_nodes();
+    if (ARENA_NUMA == TFS_NUMA_INTERLEAVE) {
+        fs_data_bind(0, fs_data_size, MPOL_INTERLEAVE, nodes);
+        return;
+    }
+
+    size_t node_count = (size_t)__builtin_popcountll(nodes);
+    for (size_t g = 0; g < group_count; g++) {
+        // the (g % node_count)-th online node
+        uint64_t rest = nodes;
+        for (size_t i = 0; i < g % node_count; i++) {
+            rest &= rest - 1;
+        }
+        fs_data_bind(alloc_groups[g].ag_first_block * BLOCK_SIZE,
+                     alloc_groups[g].ag_block_count * BLOCK_SIZE,
+                     MPOL_PREFERRED, UINT64_C(1) << bitmap_ctz(rest));
+    }
+}
+
+/**
+ * Allocate the block deduplication index and per-block state.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int dedup_init(void) {
+    dedup_index_size = 1;
+    while (dedup_index_size < 2 * DATA_BLOCKS) {
+        dedup_index_size *= 2;
+    }
+    dedup_index = malloc(dedup_index_size * sizeof(dedup_entry_t));
+    block_hashes = malloc(DATA_BLOCKS * sizeof(uint64_t));
+    block_indexed = calloc(bitmap_words(DATA_BLOCKS), sizeof(uint64_t));
+    if (!dedup_index || !block_hashes || !block_indexed) {
+        return -1;
+    }
+
+    for (size_t i = 0; i < dedup_index_size; i++) {
+        dedup_index[i].de_block = -1;
+    }
+    return 0;
+}
+
+/**
+ * Allocate the block compression state.
+ *
+ * Returns 0 if successful, -1 otherwise.
+ */
+static int compress_init(void) {
+    block_compressed = calloc(bitmap_words(DATA_BLOCKS), sizeof(uint64_t));
+    block_store = calloc(DATA_BLOCKS, sizeof(uint8_t *));
+    block_store_size = calloc(DATA_BLOCKS, sizeof(size_t));
+    block_accessed = calloc(DATA_BLOCKS, sizeof(uint8_t));
+    compress_buffer = malloc(BLOCK_SIZE);
+    compressed_blocks = 0;
+    compressed_bytes = 0;
+    if (!block_compressed || !block_store || !block_store_size ||
+        !block_accessed || !compress_buffer) {
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Lay blocks of directory entries out for a given number of entries each.
+ *
+ * Returns the space a block takes, in bytes.
+ */
+static size_t dir_layout(size_t entries) {
+    dir_entry_count = entries;
+    dir_name_units = entries * DIR_NAME_UNITS_PER_ENTRY;
+    dir_taken_words = bitmap_words(entries);
+    dir_unit_words = bitmap_words(dir_name_units);
+    dir_fp_words = (entries + FP_GROUP - 1) / FP_GROUP * FP_GROUP_WORDS;
+    return (dir_taken_words + dir_unit_words + dir_fp_words) *
+               sizeof(uint64_t) +
+           entries * sizeof(dir_entry_t) + dir_name_units * DIR_NAME_UNIT;
+}
+
+/**
+ * Number of units of a name heap a name takes.
+ */
+static size_t dir_units(size_t length) {
+    return (length + DIR_NAME_UNIT - 1) / DIR_NAME_UNIT;
+}
+
 /**
  * Initialize FS state.
  *
@@ -102,385 +675,3367 @@ int state_init(tfs_params params) {
     if (inode_table != NULL) {
         return -1; // already initialized
     }
+    if ((DENTRY_CACHE_SIZE & (DENTRY_CACHE_SIZE - 1)) != 0) {
+        return -1; // not a power of two
+    }
+    if (COMPRESS_BLOCKS && ARENA_BACKING != TFS_ARENA_MMAP) {
+        // compressed blocks only save memory if the pages they leave are
+        // returned to the OS, which needs pages the size of a few blocks
+        return -1;
+    }
+    // as many entries as fit in a block, along with their names (small
+    // blocks only hold names shorter than the longest file names)
+    size_t dir_entries = 1;
+    while (dir_layout(dir_entries + 1) <= BLOCK_SIZE) {
+        dir_entries++;
+    }
+    if (dir_layout(dir_entries) > BLOCK_SIZE) {
+        return -1; // blocks too small for a single entry
+    }
+    dir_name_max = dir_name_units * DIR_NAME_UNIT;
+    if (dir_name_max > MAX_FILE_NAME - 1) {
+        dir_name_max = MAX_FILE_NAME - 1;
+    }
 
     inode_table = malloc(INODE_TABLE_SIZE * sizeof(inode_t));
-    inode_rwlocks_table = malloc(INODE_TABLE_SIZE * sizeof(pthread_rwlock_t));
-    freeinode_ts = malloc(INODE_TABLE_SIZE * sizeof(allocation_state_t));
-    init_mutex(&freeinode_ts_lock);
-    fs_data = malloc(DATA_BLOCKS * BLOCK_SIZE);
-    free_blocks = malloc(DATA_BLOCKS * sizeof(allocation_state_t));
-    init_mutex(&free_blocks_lock);
+    inode_maps = malloc(INODE_TABLE_SIZE * sizeof(inode_map_t));
+    inode_targets = malloc(INODE_TABLE_SIZE * sizeof(*inode_targets));
+    inode_seqs = calloc(INODE_TABLE_SIZE, sizeof(*inode_seqs));
+    dir_maps = calloc(INODE_TABLE_SIZE, sizeof(*dir_maps));
+    rcu_init(&dir_rcu);
+    dir_fp_match = fp_match_select(SIMD_DIR_LOOKUPS);
+    dentry_cache = NULL;
+    if (DENTRY_CACHE_SIZE > 0) {
+        dentry_cache = aligned_alloc(CACHE_LINE_SIZE,
+                                     DENTRY_CACHE_SIZE * sizeof(dentry_t));
+    }
+    // zeroed locks are unlocked, so they need no further initialization
+    inode_rwlock_lines =
+        (INODE_TABLE_SIZE + RWLOCKS_PER_LINE - 1) / RWLOCKS_PER_LINE;
+    inode_rwlocks_table =
+        aligned_alloc(CACHE_LINE_SIZE, inode_rwlock_lines * CACHE_LINE_SIZE);
+    if (inode_rwlocks_table != NULL) {
+        memset(inode_rwlocks_table, 0, inode_rwlock_lines * CACHE_LINE_SIZE);
+    }
+    freeinode_ts = malloc(bitmap_words(INODE_TABLE_SIZE) * sizeof(uint64_t));
+    fs_data_map();
+    if (alloc_groups_init() != 0) {
+        return -1;
+    }
+    fs_data_place();
+    magazines = NULL;
+    init_mutex(&magazines_lock);
+    ALWAYS_ASSERT(pthread_key_create(&magazine_key, magazine_release) == 0,
+                  "state_init: failed to create magazine key");
+    fs_generation++;
+    block_refs = calloc(DATA_BLOCKS, sizeof(uint32_t));
+    block_shared = calloc(bitmap_words(DATA_BLOCKS), sizeof(uint64_t));
+    init_mutex(&share_lock);
+    if (DEDUP_BLOCKS && dedup_init() != 0) {
+        return -1;
+    }
+    init_mutex(&compress_lock);
+    if (COMPRESS_BLOCKS && compress_init() != 0) {
+        return -1;
+    }
+    inode_copies = calloc(INODE_TABLE_SIZE, sizeof(snapshot_inode_t *));
+    atomic_store(&snapshot_count, 0);
+    inode_epochs = calloc(INODE_TABLE_SIZE, sizeof(size_t));
+    pack_units = calloc(DATA_BLOCKS, sizeof(uint64_t));
+    pack_blocks = malloc(DATA_BLOCKS * sizeof(int));
+    pack_block_count = 0;
+    init_mutex(&pack_lock);
     open_file_table = malloc(MAX_OPEN_FILES * sizeof(open_file_entry_t));
+    open_file_stages = malloc(MAX_OPEN_FILES * DELAYED_ALLOC_SIZE);
     open_file_locks_table = malloc(MAX_OPEN_FILES * sizeof(pthread_mutex_t));
     free_open_file_entries =
-        malloc(MAX_OPEN_FILES * sizeof(allocation_state_t));
+        malloc(MAX_OPEN_FILES * sizeof(*free_open_file_entries));
     // malloc(MAX_OPEN_FILES * sizeof(allocation_state_t)); TODO
     init_mutex(&free_open_file_entries_lock);
-    if (!inode_table || !freeinode_ts || !fs_data || !free_blocks ||
-        !open_file_table || !free_open_file_entries) {
+    if (!inode_table || !inode_maps || !inode_targets ||
+        !inode_rwlocks_table || !inode_seqs || !dir_maps || !freeinode_ts ||
+        !fs_data || !open_file_table || !free_open_file_entries ||
+        !pack_units || !pack_blocks || !block_refs || !block_shared ||
+        !inode_copies || !inode_epochs ||
+        (DENTRY_CACHE_SIZE > 0 && !dentry_cache) ||
+        (DELAYED_ALLOC_SIZE > 0 && !open_file_stages)) {
         return -1; // allocation failed
     }
 
+    for (size_t i = 0; i < bitmap_words(INODE_TABLE_SIZE); i++) {
+        // padding bits past the last inode are permanently taken
+        uint64_t padding = i == INODE_TABLE_SIZE / BITMAP_WORD_BITS
+                               ? bitmap_mask_from(INODE_TABLE_SIZE)
+                               : 0;
+        atomic_init(&freeinode_ts[i], padding);
+    }
     for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        freeinode_ts[i] = FREE;
+        inode_table[i].i_map = &inode_maps[i];
+        atomic_init(&dir_maps[i], NULL);
     }
-
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        free_blocks[i] = FREE;
+    for (size_t i = 0; i < DENTRY_CACHE_SIZE; i++) {
+        atomic_init(&dentry_cache[i].dc_seq, 0);
+        atomic_init(&dentry_cache[i].dc_parent, -1);
+        atomic_init(&dentry_cache[i].dc_inumber, -1);
+        for (size_t w = 0; w < DENTRY_NAME_WORDS; w++) {
+            atomic_init(&dentry_cache[i].dc_name[w], 0);
+        }
     }
+
     // Init open file locks table
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
         init_mutex(&open_file_locks_table[i]);
     }
+    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
+        atomic_init(&free_open_file_entries[i], FREE);
+    }
 
-    // Init inode table rwlocks
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        init_rwlock(&inode_rwlocks_table[i]);
+    return 0;
+}
+
+/**
+ * Free the copies of inodes kept by snapshots.
+ */
+static void snapshots_destroy(void) {
+    for (size_t i = 0; inode_copies != NULL && i < INODE_TABLE_SIZE; i++) {
+        snapshot_inode_t *copy = inode_copies[i];
+        while (copy != NULL) {
+            snapshot_inode_t *next = copy->si_next;
+            free(copy->si_blocks);
+            free(copy->si_data);
+            free(copy->si_dir_map);
+            free(copy);
+            copy = next;
+        }
+    }
+    free(inode_copies);
+    free(inode_epochs);
+    inode_copies = NULL;
+    inode_epochs = NULL;
+}
+
+/**
+ * Destroy FS state.
+ *
+ * Returns 0 if succesful, -1 otherwise.
+ */
+int state_destroy(void) {
+    snapshots_destroy();
+
+    free(inode_rwlocks_table);
+    free(inode_seqs);
+    for (size_t i = 0; dir_maps != NULL && i < INODE_TABLE_SIZE; i++) {
+        free(atomic_load(&dir_maps[i]));
+    }
+    free(dir_maps);
+    free(dentry_cache);
+    dentry_cache = NULL;
+    rcu_destroy(&dir_rcu);
+    free(inode_table);
+    free(inode_maps);
+    free(inode_targets);
+    free(freeinode_ts);
+    fs_data_unmap();
+    alloc_groups_destroy();
+    free(dedup_index);
+    free(block_refs);
+    free(block_shared);
+    free(block_hashes);
+    free(block_indexed);
+    dedup_index = NULL;
+    block_refs = NULL;
+    block_shared = NULL;
+    block_hashes = NULL;
+    block_indexed = NULL;
+    destroy_mutex(&share_lock);
+    if (block_store != NULL) {
+        for (size_t i = 0; i < DATA_BLOCKS; i++) {
+            free(block_store[i]);
+        }
+    }
+    free(block_compressed);
+    free(block_store);
+    free(block_store_size);
+    free(block_accessed);
+    free(compress_buffer);
+    block_compressed = NULL;
+    block_store = NULL;
+    block_store_size = NULL;
+    block_accessed = NULL;
+    compress_buffer = NULL;
+    destroy_mutex(&compress_lock);
+    free(pack_units);
+    free(pack_blocks);
+    destroy_mutex(&pack_lock);
+    // Magazines of running threads are discarded along with the blocks they
+    // cache (those threads will see a new fs_generation)
+    ALWAYS_ASSERT(pthread_key_delete(magazine_key) == 0,
+                  "state_destroy: failed to delete magazine key");
+    while (magazines != NULL) {
+        block_magazine_t *next = magazines->bm_next;
+        destroy_mutex(&magazines->bm_lock);
+        free(magazines);
+        magazines = next;
     }
+    destroy_mutex(&magazines_lock);
+    free(open_file_table);
+    free(open_file_stages);
+    // Destroy mutexes in open file locks table
     for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        free_open_file_entries[i] = FREE;
+        destroy_mutex(&open_file_locks_table[i]);
+    }
+    free(open_file_locks_table);
+    free(free_open_file_entries);
+    destroy_mutex(&free_open_file_entries_lock);
+
+    inode_table = NULL;
+    freeinode_ts = NULL;
+    fs_data = NULL;
+    open_file_table = NULL;
+    free_open_file_entries = NULL;
+
+    return 0;
+}
+
+/**
+ * Allocation group an inode belongs to.
+ */
+static size_t inode_group(int inumber) {
+    return (size_t)inumber / group_inodes;
+}
+
+/**
+ * (Try to) Allocate a new inode in an allocation group, without initializing
+ * its data.
+ *
+ * Lock-free: a free inode is claimed by atomically setting its bit in
+ * freeinode_ts, so concurrent allocations never wait for each other.
+ *
+ * Input:
+ *   - group: the allocation group
+ *
+ * Returns the inumber of the newly allocated inode, or -1 if the group has no
+ * free inodes.
+ */
+static int group_inode_alloc(alloc_group_t *group) {
+    if (group->ag_inode_count == 0) {
+        return -1;
+    }
+    size_t first = group->ag_first_inode;
+    size_t end = first + group->ag_inode_count;
+    size_t first_word = first / BITMAP_WORD_BITS;
+    size_t words = (end - 1) / BITMAP_WORD_BITS - first_word + 1;
+    // next fit: start where the last allocation succeeded, so that taken
+    // inodes are not scanned over and over again
+    size_t hint =
+        atomic_load_explicit(&group->ag_inode_hint, memory_order_relaxed);
+
+    for (size_t i = 0; i < words; i++) {
+        size_t w = first_word + (hint + i) % words;
+        if ((i * sizeof(uint64_t)) % BLOCK_SIZE == 0) {
+            insert_delay(); // simulate storage access delay (to freeinode_ts)
+        }
+
+        // the first and last words may be shared with other groups
+        size_t lo = w * BITMAP_WORD_BITS < first ? first : w * BITMAP_WORD_BITS;
+        size_t hi = (w + 1) * BITMAP_WORD_BITS > end
+                        ? end
+                        : (w + 1) * BITMAP_WORD_BITS;
+        uint64_t others = ~bitmap_mask_range(lo, hi - lo);
+
+        uint64_t taken =
+            atomic_load_explicit(&freeinode_ts[w], memory_order_relaxed);
+        while ((taken | others) != ~UINT64_C(0)) {
+            // Claims the first free inode in the word, unless another thread
+            // changes the word first (in which case taken is reloaded)
+            size_t bit = bitmap_ctz(~(taken | others));
+            if (atomic_compare_exchange_weak_explicit(
+                    &freeinode_ts[w], &taken, taken | (UINT64_C(1) << bit),
+                    memory_order_acquire, memory_order_relaxed)) {
+                atomic_store_explicit(&group->ag_inode_hint, w - first_word,
+                                      memory_order_relaxed);
+                return (int)(w * BITMAP_WORD_BITS + bit);
+            }
+        }
+    }
+
+    return -1;
+}
+
+/**
+ * (Try to) Allocate a new inode in the inode table, without initializing its
+ * data.
+ *
+ * Input:
+ *   - goal: allocation group to allocate from (other groups are used if it
+ *     is full)
+ *
+ * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ */
+static int inode_alloc(size_t goal) {
+    for (size_t i = 0; i < group_count; i++) {
+        alloc_group_t *group = &alloc_groups[(goal + i) % group_count];
+        int inumber = group_inode_alloc(group);
+        if (inumber != -1) {
+            return inumber;
+        }
+    }
+
+    // no free inodes
+    return -1;
+}
+
+/**
+ * Mark every entry of an inode's block map as unmapped.
+ *
+ * Input:
+ *   - inode: inode whose block map is reset (its blocks are not freed)
+ */
+static void inode_blocks_init(inode_t *inode) {
+    inode_map_t *map = inode->i_map;
+    inode->i_layout = L_BLOCKS;
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        map->i_direct[i] = -1;
+    }
+    map->i_indirect = -1;
+    map->i_double_indirect = -1;
+    map->i_extent_count = 0;
+}
+
+static uint64_t dir_name_hash(char const *sub_name) {
+    return xxhash64(sub_name, strnlen(sub_name, MAX_FILE_NAME), 0);
+}
+
+/**
+ * Fingerprints of the names of the entries of a block of directory entries
+ * (FP_NONE for entries that are not taken), which lookups compare a whole
+ * group at a time before comparing any name.
+ */
+static _Atomic uint64_t *dir_fingerprints(dir_entry_t *dir_entry) {
+    return (_Atomic uint64_t *)dir_entry - dir_fp_words;
+}
+
+/**
+ * Name heap of a block of directory entries, which holds the name of each
+ * entry (without a null byte) at its d_name_offset.
+ */
+static char *dir_heap(dir_entry_t *dir_entry) {
+    return (char *)(dir_entry + MAX_DIR_ENTRIES);
+}
+
+static uint64_t dir_entry_hash(dir_entry_t *dir_entry, size_t i) {
+    return xxhash64(dir_heap(dir_entry) + dir_entry[i].d_name_offset,
+                    dir_entry[i].d_name_length, 0);
+}
+
+/**
+ * Find a directory entry in a block of directory entries.
+ *
+ * Takes no locks: entries are only published once filled in, and neither
+ * they nor their names are reused while lookups may be reading them (see
+ * dir_rcu).
+ *
+ * Input:
+ *   - dir_entry: the block's entries
+ *   - sub_name: sub file name
+ *   - hash: its hash (see dir_name_hash)
+ *   - sub_inumber: where to store the inumber of the entry
+ *
+ * Returns the number of the entry, or -1 if no entry has that name.
+ */
+static int dir_entry_find(dir_entry_t *dir_entry, char const *sub_name,
+                          uint64_t hash, int *sub_inumber) {
+    _Atomic uint64_t *fps = dir_fingerprints(dir_entry);
+    char const *heap = dir_heap(dir_entry);
+    uint8_t fp = fp_of_hash(hash);
+    size_t length = strnlen(sub_name, MAX_FILE_NAME);
+    for (size_t g = 0; g < dir_fp_words; g += FP_GROUP_WORDS) {
+        uint32_t candidates = dir_fp_match(&fps[g], fp);
+        for (; candidates != 0; candidates &= candidates - 1) {
+            // equal fingerprints are confirmed, so collisions are harmless
+            dir_entry_t *entry = &dir_entry[g * 8 + bitmap_ctz(candidates)];
+            int inumber =
+                atomic_load_explicit(&entry->d_inumber, memory_order_acquire);
+            if (inumber >= 0 && entry->d_name_length == length &&
+                memcmp(heap + entry->d_name_offset, sub_name, length) == 0) {
+                *sub_inumber = inumber;
+                return (int)(entry - dir_entry);
+            }
+        }
+    }
+    return -1;
+}
+
+/**
+ * Entries of a block of directory entries, which come after a header with
+ * the maps of the taken ones and of the taken units of the name heap (see
+ * dir_taken), and the fingerprints of their names.
+ *
+ * Input:
+ *   - block_number: the block
+ */
+static dir_entry_t *dir_block_entries(int block_number) {
+    return (dir_entry_t *)((uint64_t *)data_block_get(block_number) +
+                           dir_taken_words + dir_unit_words + dir_fp_words);
+}
+
+/**
+ * Map of the taken units of the name heap of a block of directory entries,
+ * with a bit set per taken unit.
+ */
+static uint64_t *dir_units_taken(dir_entry_t *dir_entry) {
+    return (uint64_t *)dir_fingerprints(dir_entry) - dir_unit_words;
+}
+
+/**
+ * Map of the taken (not DIR_ENTRY_FREE) entries of a block of directory
+ * entries, with a bit set per taken entry. Only changed with the directory
+ * write-locked, and only read then (as is the map of taken units), so that
+ * inserts find a free entry without looking at the entries themselves.
+ */
+static uint64_t *dir_taken(dir_entry_t *dir_entry) {
+    return dir_units_taken(dir_entry) - dir_taken_words;
+}
+
+/**
+ * Fill a block of directory entries with free entries.
+ */
+static void dir_block_init(int block_number) {
+    dir_entry_t *dir_entry = dir_block_entries(block_number);
+    bitmap_init(dir_taken(dir_entry), MAX_DIR_ENTRIES);
+    bitmap_init(dir_units_taken(dir_entry), dir_name_units);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        atomic_init(&dir_entry[i].d_inumber, DIR_ENTRY_FREE);
+    }
+    _Atomic uint64_t *fps = dir_fingerprints(dir_entry);
+    for (size_t w = 0; w < dir_fp_words; w++) {
+        atomic_init(&fps[w], FP_NONE_WORD);
+    }
+}
+
+/**
+ * Number of blocks of entries of a directory.
+ */
+static size_t dir_block_count(const inode_t *inode) {
+    return inode->i_size / BLOCK_SIZE;
+}
+
+/**
+ * Slot of the map of a directory a name goes in (from other bits of its hash
+ * than the ones its fingerprint is taken from).
+ *
+ * Input:
+ *   - hash: hash of the name
+ *   - depth: depth of the map (dm_depth)
+ */
+static size_t dir_route(uint64_t hash, size_t depth) {
+    return (size_t)(hash >> 16) & (((size_t)1 << depth) - 1);
+}
+
+static dir_map_t *dir_map_alloc(size_t depth) {
+    dir_map_t *map = malloc(sizeof(dir_map_t) +
+                            ((size_t)1 << depth) * sizeof(dir_slot_t));
+    ALWAYS_ASSERT(map != NULL, "dir_map_alloc: failed to allocate map");
+    map->dm_depth = depth;
+    return map;
+}
+
+/**
+ * Copy of the map of a directory (for a snapshot).
+ */
+static dir_map_t *dir_map_copy(dir_map_t const *map) {
+    dir_map_t *copy = dir_map_alloc(map->dm_depth);
+    for (size_t s = 0; s < (size_t)1 << map->dm_depth; s++) {
+        atomic_init(&copy->dm_slots[s].ds_block,
+                    atomic_load_explicit(&map->dm_slots[s].ds_block,
+                                         memory_order_relaxed));
+        copy->dm_slots[s].ds_index = map->dm_slots[s].ds_index;
+        copy->dm_slots[s].ds_depth = map->dm_slots[s].ds_depth;
+    }
+    return copy;
+}
+
+/**
+ * Make every slot of the block a slot of a directory map points to point to
+ * another block (a copy of it).
+ *
+ * Input:
+ *   - map: the map (the directory should be write-locked)
+ *   - slot: one of the block's slots
+ *   - block_number: the other block, which lookups may read from now on
+ */
+static void dir_slots_publish(dir_map_t *map, size_t slot, int block_number) {
+    size_t step = (size_t)1 << map->dm_slots[slot].ds_depth;
+    for (size_t s = slot & (step - 1); s < (size_t)1 << map->dm_depth;
+         s += step) {
+        atomic_store_explicit(&map->dm_slots[s].ds_block, block_number,
+                              memory_order_release);
+    }
+}
+
+/**
+ * Find the first run of free units of the name heap of a block of directory
+ * entries that a name fits in.
+ *
+ * Input:
+ *   - units_taken: the heap's map of taken units
+ *   - units: number of units of the name
+ *
+ * Returns the first unit of the run, or dir_name_units if there is none.
+ */
+static size_t dir_units_find(uint64_t const *units_taken, size_t units) {
+    size_t run = 0;
+    for (size_t u = 0; u < dir_name_units; u++) {
+        run = bitmap_test(units_taken, u) ? 0 : run + 1;
+        if (run == units) {
+            return u + 1 - units;
+        }
+    }
+    return dir_name_units;
+}
+
+/**
+ * Take a free entry of a block of directory entries, from its map of taken
+ * entries, along with room for its name in the block's name heap (the first
+ * that fits, so that names added to an empty block are packed together).
+ *
+ * Input:
+ *   - dir_entry: the block's entries (the directory should be write-locked)
+ *   - length: length of the entry's name
+ *
+ * Returns the number of the entry, or -1 if none is free or there is no room
+ * for the name.
+ */
+static int dir_entry_take(dir_entry_t *dir_entry, size_t length) {
+    uint64_t *taken = dir_taken(dir_entry);
+    size_t w = 0;
+    while (w < dir_taken_words && ~taken[w] == 0) {
+        w++;
+    }
+    uint64_t *units_taken = dir_units_taken(dir_entry);
+    size_t units = dir_units(length);
+    size_t first = dir_units_find(units_taken, units);
+    if (w == dir_taken_words || first == dir_name_units) {
+        return -1;
+    }
+
+    size_t i = w * BITMAP_WORD_BITS + bitmap_ctz(~taken[w]);
+    bitmap_set(taken, i);
+    for (size_t u = first; u < first + units; u++) {
+        bitmap_set(units_taken, u);
+    }
+    dir_entry[i].d_name_offset = (uint32_t)(first * DIR_NAME_UNIT);
+    dir_entry[i].d_name_length = (uint32_t)length;
+    return (int)i;
+}
+
+/**
+ * Fill in a taken directory entry, and publish it for lookups.
+ *
+ * Input:
+ *   - dir_entry: the block's entries (the directory should be write-locked)
+ *   - i: number of the entry (see dir_entry_take)
+ *   - sub_name: sub file name, of the length the entry was taken for (need
+ *     not be null-terminated)
+ *   - hash: its hash
+ *   - sub_inumber: inumber of the sub inode
+ */
+static void dir_entry_fill(dir_entry_t *dir_entry, size_t i,
+                           char const *sub_name, uint64_t hash,
+                           int sub_inumber) {
+    memcpy(dir_heap(dir_entry) + dir_entry[i].d_name_offset, sub_name,
+           dir_entry[i].d_name_length);
+    fp_store(dir_fingerprints(dir_entry), i, fp_of_hash(hash));
+    // lookups only see the entry once its name is complete
+    atomic_store_explicit(&dir_entry[i].d_inumber, sub_inumber,
+                          memory_order_release);
+}
+
+/**
+ * Remove a directory entry.
+ *
+ * Lookups may still be comparing the entry's name, so it is only retired
+ * (and made free by dir_block_reclaim once they are over).
+ *
+ * Input:
+ *   - dir_entry: the block's entries (the directory should be write-locked)
+ *   - i: number of the entry
+ */
+static void dir_entry_retire(dir_entry_t *dir_entry, size_t i) {
+    atomic_store_explicit(&dir_entry[i].d_inumber, DIR_ENTRY_RETIRED,
+                          memory_order_relaxed);
+    fp_store(dir_fingerprints(dir_entry), i, FP_NONE);
+}
+
+/**
+ * Create a new inode in the inode table.
+ *
+ * Allocates and initializes a new inode.
+ * Directories will have their first data block allocated and initialized, with
+ * i_size set to BLOCK_SIZE. Regular files will not have any data block
+ * allocated (i_size will be set to 0 and their contents stored inline).
+ *
+ * Files and symbolic links are placed in the allocation group of their
+ * directory; new directories go to the group with the most free blocks.
+ *
+ * Input:
+ *   - i_type: the type of the node (file or directory)
+ *   - dir_inumber: inumber of the directory the node is created in (-1 for
+ *     the root directory)
+ *
+ * Returns inumber of the new inode, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - No free slots in inode table.
+ *   - (if creating a directory) No free data blocks.
+ *   - Failed to initialize inode rwlock.
+ */
+int inode_create(inode_type i_type, int dir_inumber) {
+    size_t goal = 0;
+    if (dir_inumber >= 0 && i_type == T_DIRECTORY) {
+        size_t most_free = 0;
+        for (size_t g = 0; g < group_count; g++) {
+            size_t free_count = atomic_load_explicit(
+                &alloc_groups[g].ag_free_count, memory_order_relaxed);
+            if (free_count > most_free) {
+                most_free = free_count;
+                goal = g;
+            }
+        }
+    } else if (dir_inumber >= 0) {
+        goal = inode_group(dir_inumber);
+    }
+
+    int inumber = inode_alloc(goal);
+    if (inumber == -1) {
+        return -1; // no free slots in inode table
+    }
+    // a new inode takes the epoch of its directory (locked by the caller):
+    // snapshots created since the directory was locked see the entry, and so
+    // the inode, which is preserved for them before it changes; its epoch is
+    // only set under the lock, which a stale lookup of the inumber may be
+    // taking (and reading the epoch under) meanwhile
+    rwlock_wrlock(inode_rwlock(inumber));
+    inode_seq_write_begin(inumber);
+    inode_epochs[inumber] = dir_inumber >= 0 ? inode_epochs[dir_inumber]
+                                             : atomic_load(&snapshot_count);
+    inode_t *inode = &inode_table[inumber];
+    insert_delay(); // simulate storage access delay (to inode)
+
+    inode->i_node_type = i_type;
+    inode_blocks_init(inode);
+    switch (i_type) {
+    case T_DIRECTORY: {
+        // Initializes directory (filling its block with empty entries, labeled
+        // with inumber==DIR_ENTRY_FREE)
+        int b = inode_block_alloc(inode, 0, 1, NULL);
+        if (b == -1) {
+            // ensure fields are initialized
+            inode->i_size = 0;
+
+            // run regular deletion process
+            inode_delete(inumber);
+            unlock_inode(inumber);
+            return -1;
+        }
+
+        inode_table[inumber].i_size = BLOCK_SIZE;
+        inode_table[inumber].i_links = 1;
+
+        dir_block_init(b);
+        dir_map_t *map = dir_map_alloc(0);
+        atomic_init(&map->dm_slots[0].ds_block, b);
+        map->dm_slots[0].ds_index = 0;
+        map->dm_slots[0].ds_depth = 0;
+        atomic_store_explicit(&dir_maps[inumber], map, memory_order_release);
+    } break;
+    case T_FILE:
+        inode->i_layout = L_INLINE;
+        memset(inode->i_map->i_inline_data, 0, INODE_INLINE_SIZE);
+        /* FALLTHROUGH */
+    case T_SYM_LINK:
+        // In case of a new file or a symbolic link, simply sets its size to 0
+        inode_table[inumber].i_size = 0;
+        inode_table[inumber].i_links = 1;
+        break;
+    default:
+        PANIC("inode_create: unknown file type");
+    }
+    unlock_inode(inumber);
+    return inumber;
+}
+
+/**
+ * Delete an inode.
+ *
+ * Input:
+ *   - inumber: inode's number
+ */
+void inode_delete(int inumber) {
+    // simulate storage access delay (to inode and freeinode_ts)
+    insert_delay();
+    insert_delay();
+
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
+
+    dir_map_t *map =
+        atomic_load_explicit(&dir_maps[inumber], memory_order_relaxed);
+    if (map != NULL) {
+        // lookups may still be reading the directory's blocks
+        atomic_store_explicit(&dir_maps[inumber], NULL, memory_order_relaxed);
+        rcu_synchronize(&dir_rcu);
+        free(map);
+    }
+    inode_blocks_free(&inode_table[inumber]);
+
+    size_t w = (size_t)inumber / BITMAP_WORD_BITS;
+    uint64_t bit = UINT64_C(1) << ((size_t)inumber % BITMAP_WORD_BITS);
+    uint64_t taken = atomic_fetch_and_explicit(&freeinode_ts[w], ~bit,
+                                               memory_order_release);
+    ALWAYS_ASSERT((taken & bit) != 0, "inode_delete: inode already freed");
+}
+
+/**
+ * Obtain a pointer to an inode from its inumber.
+ *
+ * Input:
+ *   - inumber: inode's number
+ *
+ * Returns pointer to inode.
+ */
+inode_t *inode_get(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+
+    insert_delay(); // simulate storage access delay to inode
+
+    return &inode_table[inumber];
+}
+
+/**
+ * Obtain the target of a symbolic link from its inumber.
+ *
+ * Input:
+ *   - inumber: the link's inode number
+ *
+ * Returns a pointer to the target (MAX_SYM_TARGET bytes).
+ */
+char *inode_sym_target(int inumber) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "inode_sym_target: invalid inode number");
+    return inode_targets[inumber];
+}
+
+/**
+ * Obtain the inumber of an inode of the inode table.
+ */
+static int inode_inumber(const inode_t *inode) {
+    ALWAYS_ASSERT(inode >= inode_table &&
+                      inode < inode_table + INODE_TABLE_SIZE,
+                  "inode_inumber: inode is not in the inode table");
+    return (int)(inode - inode_table);
+}
+
+/**
+ * Map of the blocks of a directory (see dir_maps).
+ *
+ * Input:
+ *   - inode: directory inode (should be write-locked)
+ */
+static dir_map_t *dir_map(const inode_t *inode) {
+    return atomic_load_explicit(&dir_maps[inode_inumber(inode)],
+                                memory_order_relaxed);
+}
+
+/**
+ * Obtain a block of entries of a directory, to change it: a block shared
+ * with a snapshot is replaced by a copy first.
+ *
+ * Input:
+ *   - inode: directory inode (should be write-locked)
+ *   - slot: slot of the block in the directory's map
+ *
+ * Returns the block number, or -1 if a shared block could not be copied.
+ */
+static int dir_block_writable(inode_t *inode, size_t slot) {
+    dir_map_t *map = dir_map(inode);
+    int old = atomic_load_explicit(&map->dm_slots[slot].ds_block,
+                                   memory_order_relaxed);
+    size_t run = 1; // (only this block is written)
+    int b = inode_block_unshare(inode, map->dm_slots[slot].ds_index, old,
+                                &run);
+    if (b != -1 && b != old) {
+        // the snapshot keeps the old block, so lookups may go on reading it
+        dir_slots_publish(map, slot, b);
+    }
+    return b;
+}
+
+/**
+ * Split a block of entries of a directory in two, moving the entries whose
+ * route has the bit past the block's local depth set to a new block at the
+ * end of the directory. The map is doubled first if the block only takes a
+ * single slot; no other block is touched.
+ *
+ * Moved entries are added to the new block before it is published, and only
+ * removed from the old one once no lookup can still be looking for them
+ * there (see dir_rcu), so lookups never miss them.
+ *
+ * Input:
+ *   - inode: directory inode (should be write-locked)
+ *   - slot: slot of the block in the directory's map
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks (for the new block, or to copy the block if it is
+ *     shared with a snapshot).
+ *   - The directory is at the maximum file size.
+ */
+static int dir_split(inode_t *inode, size_t slot) {
+    int old = dir_block_writable(inode, slot);
+    if (old == -1) {
+        return -1;
+    }
+    size_t index = dir_block_count(inode);
+    if (index >= inode_max_size() / BLOCK_SIZE) {
+        return -1; // no room for another block
+    }
+
+    int inumber = inode_inumber(inode);
+    dir_map_t *map = dir_map(inode);
+    size_t depth = map->dm_slots[slot].ds_depth;
+    if (depth == map->dm_depth) {
+        if ((size_t)2 << map->dm_depth > DIR_SLOTS_PER_BLOCK * (index + 1)) {
+            return -1; // the names' hashes are too alike to spread them
+        }
+        dir_map_t *doubled = dir_map_alloc(map->dm_depth + 1);
+        size_t count = (size_t)1 << map->dm_depth;
+        for (size_t s = 0; s < 2 * count; s++) {
+            dir_slot_t const *from = &map->dm_slots[s % count];
+            atomic_init(&doubled->dm_slots[s].ds_block,
+                        atomic_load_explicit(&from->ds_block,
+                                             memory_order_relaxed));
+            doubled->dm_slots[s].ds_index = from->ds_index;
+            doubled->dm_slots[s].ds_depth = from->ds_depth;
+        }
+        atomic_store_explicit(&dir_maps[inumber], doubled,
+                              memory_order_release);
+        rcu_synchronize(&dir_rcu);
+        free(map);
+        map = doubled;
+    }
+
+    int b = inode_block_alloc(inode, index, 1, NULL);
+    if (b == -1) {
+        return -1; // (the doubled map is kept, as it maps the same blocks)
+    }
+    dir_block_init(b);
+    uint64_t bit = UINT64_C(1) << depth;
+    dir_entry_t *from = dir_block_entries(old);
+    dir_entry_t *to = dir_block_entries(b);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        int sub_inumber =
+            atomic_load_explicit(&from[i].d_inumber, memory_order_relaxed);
+        if (sub_inumber < 0) {
+            continue;
+        }
+        uint64_t hash = dir_entry_hash(from, i);
+        if ((hash >> 16) & bit) {
+            // the new block is empty, so the names moved to it fit
+            int j = dir_entry_take(to, from[i].d_name_length);
+            dir_entry_fill(to, (size_t)j,
+                           dir_heap(from) + from[i].d_name_offset, hash,
+                           sub_inumber);
+        }
+    }
+    inode->i_size += BLOCK_SIZE;
+
+    // the slots of the old block with the bit set are the new block's
+    for (size_t s = slot & (bit - 1); s < (size_t)1 << map->dm_depth;
+         s += bit) {
+        map->dm_slots[s].ds_depth = (uint32_t)depth + 1;
+        if (s & bit) {
+            map->dm_slots[s].ds_index = (uint32_t)index;
+            atomic_store_explicit(&map->dm_slots[s].ds_block, b,
+                                  memory_order_release);
+        }
+    }
+    rcu_synchronize(&dir_rcu);
+
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        int sub_inumber =
+            atomic_load_explicit(&from[i].d_inumber, memory_order_relaxed);
+        if (sub_inumber >= 0 && (dir_entry_hash(from, i) >> 16) & bit) {
+            dir_entry_retire(from, i);
+        }
+    }
+    return 0;
+}
+
+/**
+ * Entry of the dentry cache a name in a directory goes in.
+ *
+ * Input:
+ *   - parent: inumber of the directory
+ *   - hash: hash of the name (see dir_name_hash)
+ */
+static dentry_t *dentry_get(int parent, uint64_t hash) {
+    uint64_t mixed = hash ^ ((uint64_t)parent * UINT64_C(0x9E3779B97F4A7C15));
+    return &dentry_cache[(size_t)(mixed >> 32) & (DENTRY_CACHE_SIZE - 1)];
+}
+
+/**
+ * Look a name up in the dentry cache.
+ *
+ * Input:
+ *   - dentry: the entry the name goes in (see dentry_get)
+ *   - parent: inumber of the directory
+ *   - key: the name, padded with zeros to DENTRY_NAME_WORDS words
+ *   - sub_inumber: where to store the cached result
+ *   - seq: where to store the entry's sequence counter, for dentry_fill
+ *
+ * Returns whether the entry held the name.
+ */
+static bool dentry_lookup(dentry_t *dentry, int parent, uint64_t const *key,
+                          int *sub_inumber, uint32_t *seq) {
+    uint32_t start =
+        atomic_load_explicit(&dentry->dc_seq, memory_order_acquire);
+    *seq = start;
+    if (start & 1) {
+        return false; // being written
+    }
+
+    bool match =
+        atomic_load_explicit(&dentry->dc_parent, memory_order_relaxed) ==
+        parent;
+    for (size_t w = 0; w < DENTRY_NAME_WORDS && match; w++) {
+        match = atomic_load_explicit(&dentry->dc_name[w],
+                                     memory_order_relaxed) == key[w];
+    }
+    int inumber =
+        atomic_load_explicit(&dentry->dc_inumber, memory_order_relaxed);
+
+    // the entry only counts if it was not written meanwhile
+    atomic_thread_fence(memory_order_acquire);
+    if (!match ||
+        atomic_load_explicit(&dentry->dc_seq, memory_order_relaxed) != start) {
+        return false;
+    }
+    *sub_inumber = inumber;
+    return true;
+}
+
+/**
+ * Store the result of a directory lookup in the dentry cache, unless the
+ * entry changed since it was looked up in (in particular, if it was
+ * invalidated because the directory changed, so that the result may be
+ * stale).
+ *
+ * Input:
+ *   - dentry: the entry the name goes in
+ *   - seq: the entry's sequence counter, read before the directory lookup
+ *   - parent: inumber of the directory
+ *   - key: the name, padded with zeros to DENTRY_NAME_WORDS words
+ *   - sub_inumber: the result of the lookup
+ */
+static void dentry_fill(dentry_t *dentry, uint32_t seq, int parent,
+                        uint64_t const *key, int sub_inumber) {
+    if ((seq & 1) ||
+        !atomic_compare_exchange_strong_explicit(&dentry->dc_seq, &seq,
+                                                 seq + 1, memory_order_relaxed,
+                                                 memory_order_relaxed)) {
+        return;
+    }
+    // the odd counter is seen by readers that see any of what follows
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&dentry->dc_parent, parent, memory_order_relaxed);
+    for (size_t w = 0; w < DENTRY_NAME_WORDS; w++) {
+        atomic_store_explicit(&dentry->dc_name[w], key[w],
+                              memory_order_relaxed);
+    }
+    atomic_store_explicit(&dentry->dc_inumber, sub_inumber,
+                          memory_order_relaxed);
+    atomic_store_explicit(&dentry->dc_seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Invalidate the dentry cache entry of a name in a directory, after the name
+ * was added to or removed from it. Lookups that began before are not cached
+ * afterwards, since the entry's counter changes.
+ *
+ * Input:
+ *   - inode: directory inode (should be write-locked)
+ *   - hash: hash of the name
+ */
+static void dentry_invalidate(const inode_t *inode, uint64_t hash) {
+    if (DENTRY_CACHE_SIZE == 0) {
+        return;
+    }
+    dentry_t *dentry = dentry_get(inode_inumber(inode), hash);
+    uint32_t seq = atomic_load_explicit(&dentry->dc_seq, memory_order_relaxed);
+    do {
+        while (seq & 1) {
+            // a lookup is filling the entry in (without blocking)
+            sched_yield();
+            seq = atomic_load_explicit(&dentry->dc_seq, memory_order_relaxed);
+        }
+    } while (!atomic_compare_exchange_weak_explicit(
+        &dentry->dc_seq, &seq, seq + 1, memory_order_relaxed,
+        memory_order_relaxed));
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&dentry->dc_parent, -1, memory_order_relaxed);
+    atomic_store_explicit(&dentry->dc_seq, seq + 2, memory_order_release);
+}
+
+/**
+ * Clear the directory entry associated with a sub file.
+ *
+ * Input:
+ *   - inode: directory inode (should be write-locked)
+ *   - sub_name: sub file name
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain an entry for sub_name.
+ */
+int clear_dir_entry(inode_t *inode, char const *sub_name) {
+    insert_delay();
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    // Locates the block that would contain the entry
+    uint64_t hash = dir_name_hash(sub_name);
+    int b = dir_block_writable(inode,
+                               dir_route(hash, dir_map(inode)->dm_depth));
+    if (b == -1) {
+        return -1; // no space to copy a shared block
+    }
+    dir_entry_t *dir_entry = dir_block_entries(b);
+
+    int sub_inumber;
+    int i = dir_entry_find(dir_entry, sub_name, hash, &sub_inumber);
+    if (i == -1) {
+        return -1; // sub_name not found
+    }
+    dir_entry_retire(dir_entry, (size_t)i);
+    dentry_invalidate(inode, hash);
+    return 0;
+}
+
+/**
+ * Make the retired entries of a block of directory entries free, along with
+ * the units of its name heap their names took, once no lookup can be reading
+ * them anymore.
+ *
+ * Input:
+ *   - dir_entry: the block's entries (the directory should be write-locked)
+ *
+ * Returns whether any entry was freed.
+ */
+static bool dir_block_reclaim(dir_entry_t *dir_entry) {
+    bool retired = false;
+    for (size_t i = 0; i < MAX_DIR_ENTRIES && !retired; i++) {
+        retired = atomic_load_explicit(&dir_entry[i].d_inumber,
+                                       memory_order_relaxed) ==
+                  DIR_ENTRY_RETIRED;
+    }
+    if (!retired) {
+        return false;
+    }
+
+    rcu_synchronize(&dir_rcu);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (atomic_load_explicit(&dir_entry[i].d_inumber,
+                                 memory_order_relaxed) == DIR_ENTRY_RETIRED) {
+            atomic_store_explicit(&dir_entry[i].d_inumber, DIR_ENTRY_FREE,
+                                  memory_order_relaxed);
+            bitmap_clear(dir_taken(dir_entry), i);
+            size_t first = dir_entry[i].d_name_offset / DIR_NAME_UNIT;
+            size_t units = dir_units(dir_entry[i].d_name_length);
+            for (size_t u = first; u < first + units; u++) {
+                bitmap_clear(dir_units_taken(dir_entry), u);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Whether a name would fit in a block of directory entries once the names of
+ * its entries are packed together (see dir_block_compact).
+ *
+ * Input:
+ *   - dir_entry: the block's entries (the directory should be write-locked)
+ *   - length: length of the name
+ */
+static bool dir_block_fits(dir_entry_t *dir_entry, size_t length) {
+    size_t entries = 1;
+    size_t units = dir_units(length);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        if (atomic_load_explicit(&dir_entry[i].d_inumber,
+                                 memory_order_relaxed) >= 0) {
+            entries++;
+            units += dir_units(dir_entry[i].d_name_length);
+        }
+    }
+    return entries <= MAX_DIR_ENTRIES && units <= dir_name_units;
+}
+
+/**
+ * Replace a block of entries of a directory by a new one, with the same
+ * entries (but those retired), and their names packed together at the start
+ * of its name heap. Lookups may go on reading the old block, which is only
+ * freed once they are over (see dir_rcu).
+ *
+ * Input:
+ *   - inode: directory inode (should be write-locked)
+ *   - slot: slot of the block in the directory's map (the block should not
+ *     be shared, see dir_block_writable)
+ *
+ * Returns the new block, or -1 if there are no free data blocks.
+ */
+static int dir_block_compact(inode_t *inode, size_t slot) {
+    dir_map_t *map = dir_map(inode);
+    int old = atomic_load_explicit(&map->dm_slots[slot].ds_block,
+                                   memory_order_relaxed);
+    int b = inode_block_remap(inode, map->dm_slots[slot].ds_index);
+    if (b == -1) {
+        return -1;
+    }
+
+    dir_block_init(b);
+    dir_entry_t *from = dir_block_entries(old);
+    dir_entry_t *to = dir_block_entries(b);
+    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+        int sub_inumber =
+            atomic_load_explicit(&from[i].d_inumber, memory_order_relaxed);
+        if (sub_inumber >= 0) {
+            // the new block is empty, so the names fit as they did before
+            int j = dir_entry_take(to, from[i].d_name_length);
+            dir_entry_fill(to, (size_t)j,
+                           dir_heap(from) + from[i].d_name_offset,
+                           dir_entry_hash(from, i), sub_inumber);
+        }
+    }
+    dir_slots_publish(map, slot, b);
+    rcu_synchronize(&dir_rcu);
+    data_block_free(old);
+    return b;
+}
+
+/**
+ * Store the inumber for a sub file in a directory, where the block the name
+ * goes in is split (see dir_split) when it is full (has no free entry, or no
+ * room left in its name heap for the name). A block whose name heap only has
+ * room for the name in pieces is compacted instead.
+ *
+ * Input:
+ *   - inode: directory inode (should be write-locked)
+ *   - sub_name: sub file name
+ *   - sub_inumber: inumber of the sub inode
+ *
+ * Returns 0 if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
+ *   - sub_name is longer than the name heap of a directory block holds
+ *     (with blocks too small for names of MAX_FILE_NAME - 1 bytes).
+ *   - No free data blocks to grow the directory, or to copy its blocks if
+ *     they are shared with a snapshot.
+ *   - The directory is at its maximum size.
+ */
+int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
+    size_t length = strlen(sub_name);
+    if (length == 0 || length > MAX_FILE_NAME - 1) {
+        return -1; // invalid sub_name
+    }
+    if (length > dir_name_max) {
+        return -1; // longer than directory blocks hold
+    }
+
+    insert_delay(); // simulate storage access delay to inode with inumber
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+
+    uint64_t hash = dir_name_hash(sub_name);
+    for (;;) {
+        // Locates the block the entry goes in
+        size_t slot = dir_route(hash, dir_map(inode)->dm_depth);
+        int b = dir_block_writable(inode, slot);
+        if (b == -1) {
+            return -1; // no space to copy a shared block
+        }
+        dir_entry_t *dir_entry = dir_block_entries(b);
+
+        // Takes and fills a free entry
+        int i = dir_entry_take(dir_entry, length);
+        if (i == -1 && dir_block_reclaim(dir_entry)) {
+            i = dir_entry_take(dir_entry, length);
+        }
+        if (i == -1 && dir_block_fits(dir_entry, length)) {
+            b = dir_block_compact(inode, slot);
+            if (b == -1) {
+                return -1; // no space for the compacted block
+            }
+            dir_entry = dir_block_entries(b);
+            i = dir_entry_take(dir_entry, length);
+        }
+        if (i != -1) {
+            dir_entry_fill(dir_entry, (size_t)i, sub_name, hash, sub_inumber);
+            dentry_invalidate(inode, hash);
+            return 0;
+        }
+
+        if (dir_split(inode, slot) == -1) {
+            return -1; // no space for entry
+        }
+    }
+}
+
+/**
+ * Obtain the inumber for a sub file inside a block of directory entries.
+ *
+ * Input:
+ *   - block_number: the block of directory entries
+ *   - sub_name: sub file name
+ *   - hash: its hash
+ *
+ * Returns inumber linked to the target name, -1 if not found.
+ */
+static int dir_block_find(int block_number, char const *sub_name,
+                          uint64_t hash) {
+    int sub_inumber;
+    if (dir_entry_find(dir_block_entries(block_number), sub_name, hash,
+                       &sub_inumber) == -1) {
+        return -1; // entry not found
+    }
+    return sub_inumber;
+}
+
+/**
+ * Obtain the inumber for a sub file inside a directory.
+ *
+ * Takes no locks: the directory's entries are published atomically, and
+ * neither they nor the directory's blocks are reused while lookups may be
+ * reading them (see dir_rcu). The result is the entry as it was at some
+ * point during the call. Results are kept in the dentry cache (see
+ * dentry_t), so that looking the same names up again reads no directory.
+ *
+ * Input:
+ *   - inode: directory inode (need not be locked)
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if errors occur.
+ *
+ * Possible errors:
+ *   - inode is not a directory inode.
+ *   - Directory does not contain a file named sub_name.
+ */
+int find_in_dir(const inode_t *inode, char const *sub_name) {
+    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
+    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
+
+    int parent = inode_inumber(inode);
+    uint64_t hash = dir_name_hash(sub_name);
+    int sub_inumber;
+
+    // Names (short enough to be cached) are first looked up in the cache
+    dentry_t *dentry = NULL;
+    uint64_t key[DENTRY_NAME_WORDS] = {0};
+    uint32_t seq = 0;
+    size_t length = strnlen(sub_name, MAX_FILE_NAME);
+    if (DENTRY_CACHE_SIZE > 0 && length < DENTRY_NAME_MAX) {
+        dentry = dentry_get(parent, hash);
+        memcpy(key, sub_name, length);
+        if (dentry_lookup(dentry, parent, key, &sub_inumber, &seq)) {
+            return sub_inumber;
+        }
+    }
+
+    insert_delay(); // simulate storage access delay to inode with inumber
+
+    unsigned token = rcu_read_lock(&dir_rcu);
+    // Locates the block that would contain the entry
+    dir_map_t *map =
+        atomic_load_explicit(&dir_maps[parent], memory_order_acquire);
+    sub_inumber = -1; // not a directory
+    if (map != NULL) {
+        int b = atomic_load_explicit(
+            &map->dm_slots[dir_route(hash, map->dm_depth)].ds_block,
+            memory_order_acquire);
+        sub_inumber = dir_block_find(b, sub_name, hash);
+    }
+    rcu_read_unlock(&dir_rcu, token);
+
+    if (dentry != NULL && map != NULL) {
+        dentry_fill(dentry, seq, parent, key, sub_inumber);
+    }
+    return sub_inumber;
+}
+
+/**
+ * Whether a directory has no entries.
+ *
+ * Input:
+ *   - inode: directory inode (should be locked)
+ */
+bool dir_empty(const inode_t *inode) {
+    for (size_t k = 0; k < dir_block_count(inode); k++) {
+        dir_entry_t *dir_entry =
+            dir_block_entries(inode_block_lookup(inode, k, NULL));
+        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
+            if (atomic_load_explicit(&dir_entry[i].d_inumber,
+                                     memory_order_relaxed) >= 0) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Allocation group new blocks of an inode are allocated from (the group of
+ * the inode itself).
+ *
+ * Input:
+ *   - inode: the inode (must be in the inode table)
+ */
+static size_t inode_block_group(const inode_t *inode) {
+    return inode_group(inode_inumber(inode));
+}
+
+/**
+ * Largest file size supported by the inode block map.
+ */
+size_t inode_max_size(void) {
+    return (INODE_DIRECT_BLOCKS + BLOCK_POINTERS +
+            BLOCK_POINTERS * BLOCK_POINTERS) *
+           BLOCK_SIZE;
+}
+
+/**
+ * Obtain the slot of an indirect block that holds a given block number,
+ * optionally allocating the indirect block itself.
+ *
+ * Input:
+ *   - indirect: location of the indirect block number (-1 if unallocated)
+ *   - index: entry inside the indirect block
+ *   - alloc: whether to allocate the indirect block if it does not exist
+ *   - group: allocation group to allocate the indirect block from
+ *
+ * Returns a pointer to the entry, or NULL if the indirect block does not exist
+ * (and alloc is false) or could not be allocated.
+ */
+static int *indirect_block_slot(int *indirect, size_t index, bool alloc,
+                                size_t group) {
+    if (*indirect == -1) {
+        if (!alloc) {
+            return NULL;
+        }
+
+        int b = data_block_alloc(group);
+        if (b == -1) {
+            return NULL; // no space
+        }
+
+        int *entries = (int *)data_block_get(b);
+        for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+            entries[i] = -1;
+        }
+        *indirect = b;
+    }
+
+    int *entries = (int *)data_block_get(*indirect);
+    ALWAYS_ASSERT(entries != NULL,
+                  "indirect_block_slot: indirect block freed while in use");
+    return &entries[index];
+}
+
+/**
+ * Obtain the block map slot of the index-th block of an inode.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - index: index of the block inside the file
+ *   - alloc: whether to allocate missing indirect blocks along the way
+ *
+ * Returns a pointer to the slot, or NULL if it is not reachable.
+ */
+static int *inode_block_slot(inode_t *inode, size_t index, bool alloc) {
+    inode_map_t *map = inode->i_map;
+    if (index < INODE_DIRECT_BLOCKS) {
+        return &map->i_direct[index];
+    }
+    index -= INODE_DIRECT_BLOCKS;
+
+    size_t group = alloc ? inode_block_group(inode) : 0;
+    if (index < BLOCK_POINTERS) {
+        return indirect_block_slot(&map->i_indirect, index, alloc, group);
+    }
+    index -= BLOCK_POINTERS;
+
+    if (index < BLOCK_POINTERS * BLOCK_POINTERS) {
+        int *outer = indirect_block_slot(&map->i_double_indirect,
+                                         index / BLOCK_POINTERS, alloc, group);
+        if (outer == NULL) {
+            return NULL;
+        }
+        return indirect_block_slot(outer, index % BLOCK_POINTERS, alloc,
+                                   group);
+    }
+
+    return NULL; // beyond the maximum file size
+}
+
+/**
+ * Index of the first file block that is not covered by the inode's extents.
+ */
+static size_t inode_extent_end(const inode_t *inode) {
+    inode_map_t const *map = inode->i_map;
+    if (map->i_extent_count == 0) {
+        return 0;
+    }
+    extent_t const *last = &map->i_extents[map->i_extent_count - 1];
+    return last->e_index + last->e_length;
+}
+
+/**
+ * Whether the block map (direct and indirect pointers) is completely unmapped.
+ */
+static bool inode_block_map_empty(const inode_t *inode) {
+    inode_map_t const *map = inode->i_map;
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (map->i_direct[i] != -1) {
+            return false;
+        }
+    }
+    return map->i_indirect == -1 && map->i_double_indirect == -1;
+}
+
+/**
+ * Obtain the block number of the index-th block of an inode from its extents.
+ *
+ * Input:
+ *   - inode: the inode
+ *   - index: index of the block inside the file
+ *   - run: if not NULL, set to the number of contiguous blocks (if found)
+ *
+ * Returns the block number, or -1 if no extent covers that block.
+ */
+static int inode_extent_lookup(const inode_t *inode, size_t index,
+                               size_t *run) {
+    inode_map_t const *map = inode->i_map;
+    for (size_t i = 0; i < map->i_extent_count; i++) {
+        extent_t const *e = &map->i_extents[i];
+        if (index >= e->e_index && index < e->e_index + e->e_length) {
+            if (run != NULL) {
+                *run = e->e_index + e->e_length - index;
+            }
+            return e->e_block + (int)(index - e->e_index);
+        }
+    }
+    return -1;
+}
+
+/**
+ * Obtain the block number of the index-th block of an inode.
+ *
+ * Blocks covered by an extent are contiguous, so the caller may access up to
+ * *run consecutive blocks at once starting at the returned block (data blocks
+ * with consecutive numbers are adjacent in memory).
+ *
+ * Input:
+ *   - inode: the inode (should be locked)
+ *   - index: index of the block inside the file
+ *   - run: if not NULL, set to the number of contiguous mapped blocks
+ *
+ * Returns the block number, or -1 if that block is not mapped.
+ */
+int inode_block_lookup(const inode_t *inode, size_t index, size_t *run) {
+    ALWAYS_ASSERT(inode->i_layout == L_BLOCKS,
+                  "inode_block_lookup: file has no block map");
+    int b = inode_extent_lookup(inode, index, run);
+    if (b != -1) {
+        return b;
+    }
+
+    if (run != NULL) {
+        *run = 1;
+    }
+    // the slot is only read, so the inode is not modified
+    int *slot = inode_block_slot((inode_t *)inode, index, false);
+    return slot == NULL ? -1 : *slot;
+}
+
+/**
+ * Like inode_block_lookup, for an inode that is not locked: its indirect
+ * blocks may be freed and reused meanwhile, so their entries are not trusted.
+ *
+ * Input:
+ *   - inode: a consistent copy of the inode
+ *   - index: index of the block inside the file
+ *   - run: set to the number of contiguous mapped blocks
+ *
+ * Returns the block number, -1 if that block is not mapped, or any other
+ * invalid block number if an indirect block held garbage.
+ */
+static int inode_block_peek(const inode_t *inode, size_t index, size_t *run) {
+    inode_map_t const *map = inode->i_map;
+    int b = inode_extent_lookup(inode, index, run);
+    if (b != -1) {
+        return b;
+    }
+
+    *run = 1;
+    if (index < INODE_DIRECT_BLOCKS) {
+        return map->i_direct[index];
+    }
+    index -= INODE_DIRECT_BLOCKS;
+
+    int indirect = map->i_indirect;
+    if (index >= BLOCK_POINTERS) {
+        index -= BLOCK_POINTERS;
+        if (index >= BLOCK_POINTERS * BLOCK_POINTERS ||
+            map->i_double_indirect == -1) {
+            return -1;
+        }
+        indirect = ((int *)data_block_get(
+            map->i_double_indirect))[index / BLOCK_POINTERS];
+        index %= BLOCK_POINTERS;
+    }
+    if (!valid_block_number(indirect)) {
+        return indirect;
+    }
+    return ((int *)data_block_get(indirect))[index];
+}
+
+/**
+ * Read from a file without locking its inode: the inode and the contents are
+ * copied as they are, and the copy is only kept if no writer locked the inode
+ * in the meantime (see inode_seqs). Concurrent readers thus write no shared
+ * memory at all (but for marking blocks accessed, with block compression).
+ *
+ * Input:
+ *   - inumber: the file's inode number
+ *   - offset: where to start reading
+ *   - buffer: where to copy the contents to
+ *   - len: maximum number of bytes to read
+ *
+ * Returns the number of bytes read, or -1 if writers kept getting in the way
+ * (or a block to read is compressed, and so has to be decompressed); the
+ * file should then be read with its inode read-locked.
+ */
+ssize_t inode_read_optimistic(int inumber, size_t offset, void *buffer,
+                              size_t len) {
+    ALWAYS_ASSERT(valid_inumber(inumber),
+                  "inode_read_optimistic: invalid inode number");
+
+    for (int tries = 0; tries < OPTIMISTIC_READ_TRIES; tries++) {
+        uint32_t seq =
+            atomic_load_explicit(&inode_seqs[inumber], memory_order_acquire);
+        if (seq & 1) {
+            return -1; // a writer holds the lock: wait for it there
+        }
+
+        insert_delay(); // simulate storage access delay to inode
+        inode_t inode;
+        inode_map_t map;
+        memcpy(&inode, &inode_table[inumber], sizeof(inode_t));
+        memcpy(&map, &inode_maps[inumber], sizeof(inode_map_t));
+        inode.i_map = &map;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&inode_seqs[inumber],
+                                 memory_order_relaxed) != seq) {
+            continue; // torn copy
+        }
+
+        size_t to_read = 0;
+        if (offset < inode.i_size) {
+            to_read = inode.i_size - offset;
+        }
+        if (to_read > len) {
+            to_read = len;
+        }
+
+        size_t read = 0;
+        if (inode.i_layout != L_BLOCKS) {
+            memcpy(buffer, inode_small_data(&inode) + offset, to_read);
+            read = to_read;
+        }
+
+        while (read < to_read) {
+            size_t block_index = (offset + read) / BLOCK_SIZE;
+            size_t block_offset = (offset + read) % BLOCK_SIZE;
+
+            size_t run;
+            int bnum = inode_block_peek(&inode, block_index, &run);
+            size_t chunk = run * BLOCK_SIZE - block_offset;
+            if (chunk > to_read - read) {
+                chunk = to_read - read;
+            }
+
+            size_t blocks =
+                (block_offset + chunk + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            if (bnum == -1) {
+                memset((char *)buffer + read, 0, chunk);
+            } else if (valid_block_number(bnum)) {
+                if (block_run_compressed(bnum, blocks)) {
+                    return -1; // only decompressed under the lock
+                }
+                char *block = data_block_get_run(bnum, blocks);
+                memcpy((char *)buffer + read, block + block_offset, chunk);
+            } else {
+                break; // the block map changed under us
+            }
+            read += chunk;
+        }
+
+        // the copy only counts if no writer locked the inode since it began
+        atomic_thread_fence(memory_order_acquire);
+        uint32_t end =
+            atomic_load_explicit(&inode_seqs[inumber], memory_order_relaxed);
+        if (read == to_read && end == seq) {
+            return (ssize_t)to_read;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Map file blocks starting at the end of the inode's extents, either by
+ * growing the last extent in place or by starting a new one.
+ *
+ * Input:
+ *   - inode: the inode (should be write-locked)
+ *   - index: index of the first block to map (the end of the extents)
+ *   - count: number of blocks wanted
+ *   - run: if not NULL, set to the number of blocks actually mapped
+ *
+ * Returns the block number of the index-th block, or -1 if no extent could be
+ * grown or added.
+ */
+static int inode_extent_alloc(inode_t *inode, size_t index, size_t count,
+                              size_t *run) {
+    inode_map_t *map = inode->i_map;
+    if (map->i_extent_count > 0) {
+        extent_t *last = &map->i_extents[map->i_extent_count - 1];
+        int next = last->e_block + (int)last->e_length;
+        size_t got = data_block_extend(next, count);
+        if (got > 0) {
+            last->e_length += (uint32_t)got;
+            if (run != NULL) {
+                *run = got;
+            }
+            return next;
+        }
+    }
+
+    if (map->i_extent_count == INODE_EXTENTS) {
+        return -1; // no free extent slots
+    }
+
+    size_t got;
+    int b = data_block_alloc_run(inode_block_group(inode), count, &got);
+    if (b == -1) {
+        return -1; // no space
+    }
+
+    if (map->i_extent_count > 0) {
+        extent_t *last = &map->i_extents[map->i_extent_count - 1];
+        if (b == last->e_block + (int)last->e_length) {
+            // the run happens to follow the last extent
+            last->e_length += (uint32_t)got;
+            if (run != NULL) {
+                *run = got;
+            }
+            return b;
+        }
+    }
+
+    extent_t *e = &map->i_extents[map->i_extent_count++];
+    // block indices fit in 32 bits (files are at most inode_max_size())
+    e->e_index = (uint32_t)index;
+    e->e_block = b;
+    e->e_length = (uint32_t)got;
+    if (run != NULL) {
+        *run = got;
+    }
+    return b;
+}
+
+/**
+ * Obtain the block number of the index-th block of an inode, allocating it
+ * (and any indirect blocks needed to reach it) if it is not mapped yet.
+ *
+ * Files written sequentially are mapped with extents while the inode has free
+ * extent slots, allocating up to count contiguous blocks at once; afterwards
+ * (or for non-sequential writes) blocks are mapped one by one through the
+ * direct and indirect pointers.
+ *
+ * Input:
+ *   - inode: the inode (should be write-locked)
+ *   - index: index of the block inside the file
+ *   - count: number of blocks the caller is about to access from index on
+ *   - run: if not NULL, set to the number of contiguous mapped blocks
+ *
+ * Returns the block number, or -1 in the case of error.
+ *
+ * Possible errors:
+ *   - index is beyond the maximum file size.
+ *   - No free data blocks.
+ */
+int inode_block_alloc(inode_t *inode, size_t index, size_t count,
+                      size_t *run) {
+    int b = inode_block_lookup(inode, index, run);
+    if (b != -1) {
+        return b;
+    }
+
+    if (index == inode_extent_end(inode) && inode_block_map_empty(inode)) {
+        b = inode_extent_alloc(inode, index, count > 0 ? count : 1, run);
+        if (b != -1) {
+            return b;
+        }
+    }
+
+    int *slot = inode_block_slot(inode, index, true);
+    if (slot == NULL) {
+        return -1;
+    }
+
+    b = data_block_alloc(inode_block_group(inode));
+    if (b == -1) {
+        return -1; // no space
+    }
+    *slot = b;
+    if (run != NULL) {
+        *run = 1;
+    }
+    return b;
+}
+
+/**
+ * Free every block of an indirect block tree, including the indirect block.
+ *
+ * Input:
+ *   - indirect: location of the indirect block number (set to -1)
+ *   - depth: 1 for a single-indirect block, 2 for a double-indirect block
+ */
+static void indirect_blocks_free(int *indirect, int depth) {
+    if (*indirect == -1) {
+        return;
+    }
+
+    int *entries = (int *)data_block_get(*indirect);
+    ALWAYS_ASSERT(entries != NULL,
+                  "indirect_blocks_free: indirect block freed while in use");
+    for (size_t i = 0; i < BLOCK_POINTERS; i++) {
+        if (entries[i] == -1) {
+            continue;
+        }
+        if (depth > 1) {
+            indirect_blocks_free(&entries[i], depth - 1);
+        } else {
+            data_block_free(entries[i]);
+        }
+    }
+
+    data_block_free(*indirect);
+    *indirect = -1;
+}
+
+/**
+ * Remove a block from the list of packed blocks with free units.
+ *
+ * Should be called with pack_lock held.
+ */
+static void pack_blocks_remove(int block_number) {
+    for (size_t i = 0; i < pack_block_count; i++) {
+        if (pack_blocks[i] == block_number) {
+            pack_blocks[i] = pack_blocks[--pack_block_count];
+            return;
+        }
+    }
+    PANIC("pack_blocks_remove: block is not in the list");
+}
+
+/**
+ * Allocate a slot of contiguous units in a packed block, taking a new data
+ * block if no packed block has a large enough run of free units.
+ *
+ * Input:
+ *   - goal: allocation group to take a new data block from
+ *   - units: number of units of the slot (1 to PACK_UNITS)
+ *   - unit: set to the first unit of the slot
+ *
+ * Returns the number of the packed block if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+static int pack_slot_alloc(size_t goal, size_t units, size_t *unit) {
+    lock_mutex(&pack_lock);
+    insert_delay(); // simulate storage access delay to the packed block map
+
+    int b = -1;
+    size_t u = PACK_UNITS;
+    for (size_t i = 0; i < pack_block_count && u == PACK_UNITS; i++) {
+        b = pack_blocks[i];
+        u = bitmap_find_clear_run(pack_units[b], units);
+    }
+
+    if (u == PACK_UNITS) {
+        b = data_block_alloc(goal);
+        if (b == -1) {
+            unlock_mutex(&pack_lock);
+            return -1; // no space
+        }
+        u = 0;
+        pack_units[b] = 0;
+        pack_blocks[pack_block_count++] = b;
+    }
+
+    pack_units[b] |= bitmap_mask_range(u, units);
+    if (pack_units[b] == ~UINT64_C(0)) {
+        pack_blocks_remove(b);
+    }
+    unlock_mutex(&pack_lock);
+
+    *unit = u;
+    return b;
+}
+
+/**
+ * Free a slot of a packed block, freeing the block once it has no slots
+ * left.
+ *
+ * Input:
+ *   - block_number: the packed block
+ *   - unit: first unit of the slot
+ *   - units: number of units of the slot
+ */
+static void pack_slot_free(int block_number, size_t unit, size_t units) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "pack_slot_free: invalid block number");
+
+    lock_mutex(&pack_lock);
+    insert_delay(); // simulate storage access delay to the packed block map
+
+    uint64_t *taken = &pack_units[block_number];
+    if (*taken == ~UINT64_C(0)) {
+        pack_blocks[pack_block_count++] = block_number; // has free units again
+    }
+    *taken &= ~bitmap_mask_range(unit, units);
+    if (*taken == 0) {
+        pack_blocks_remove(block_number);
+        data_block_free(block_number);
+    }
+    unlock_mutex(&pack_lock);
+}
+
+/**
+ * Free every data block of an inode (or its slot of a packed block), leaving
+ * its block map unmapped. Regular files are left empty and inline.
+ *
+ * Input:
+ *   - inode: the inode (should be write-locked)
+ */
+void inode_blocks_free(inode_t *inode) {
+    inode_map_t *map = inode->i_map;
+    if (inode->i_layout == L_PACKED) {
+        pack_slot_free(map->i_pack_block, map->i_pack_unit,
+                       map->i_pack_units);
+    }
+    if (inode->i_layout != L_BLOCKS) {
+        inode->i_layout = L_INLINE;
+        memset(map->i_inline_data, 0, INODE_INLINE_SIZE);
+        return;
+    }
+
+    for (size_t i = 0; i < map->i_extent_count; i++) {
+        data_block_free_run(map->i_extents[i].e_block,
+                            map->i_extents[i].e_length);
+    }
+    map->i_extent_count = 0;
+
+    for (size_t i = 0; i < INODE_DIRECT_BLOCKS; i++) {
+        if (map->i_direct[i] != -1) {
+            data_block_free(map->i_direct[i]);
+            map->i_direct[i] = -1;
+        }
+    }
+    indirect_blocks_free(&map->i_indirect, 1);
+    indirect_blocks_free(&map->i_double_indirect, 2);
+
+    if (inode->i_node_type == T_FILE) {
+        // emptied files start over inline
+        inode->i_layout = L_INLINE;
+        memset(map->i_inline_data, 0, INODE_INLINE_SIZE);
+    }
+}
+
+/**
+ * Contents of a small (inline or packed) file.
+ *
+ * Input:
+ *   - inode: the file's inode (should be locked)
+ *
+ * Returns a pointer to inode_small_capacity(inode) bytes holding the
+ * contents.
+ */
+char *inode_small_data(inode_t const *inode) {
+    inode_map_t const *map = inode->i_map;
+    if (inode->i_layout == L_INLINE) {
+        return (char *)map->i_inline_data;
+    }
+    ALWAYS_ASSERT(inode->i_layout == L_PACKED,
+                  "inode_small_data: file is not small");
+
+    char *block = data_block_get(map->i_pack_block);
+    return block + map->i_pack_unit * PACK_UNIT_SIZE;
+}
+
+/**
+ * Number of bytes a small (inline or packed) file can hold without moving.
+ *
+ * Input:
+ *   - inode: the file's inode (should be locked)
+ */
+size_t inode_small_capacity(inode_t const *inode) {
+    if (inode->i_layout == L_INLINE) {
+        return INODE_INLINE_SIZE;
+    }
+    ALWAYS_ASSERT(inode->i_layout == L_PACKED,
+                  "inode_small_capacity: file is not small");
+    return inode->i_map->i_pack_units * PACK_UNIT_SIZE;
+}
+
+/**
+ * Move the contents of a small (inline or packed) file to a space that can
+ * hold a given size: a larger slot of a packed block, or data blocks of its
+ * own once the size is over PACK_MAX_SIZE.
+ *
+ * Input:
+ *   - inode: the file's inode (should be write-locked)
+ *   - size: size the file should be able to grow to
+ *
+ * Returns 0 if successful, -1 otherwise (in which case the file is left
+ * where it was).
+ *
+ * Possible errors:
+ *   - No free data blocks (or slots of packed blocks).
+ */
+int inode_small_grow(inode_t *inode, size_t size) {
+    ALWAYS_ASSERT(inode->i_layout != L_BLOCKS,
+                  "inode_small_grow: file is not small");
+
+    // the new space may overlay the old one in the inode, so the contents
+    // are copied from a copy of the inode
+    inode_t old = *inode;
+    inode_map_t old_map = *inode->i_map;
+    old.i_map = &old_map;
+    char const *contents = old.i_layout == L_INLINE ? old_map.i_inline_data
+                                                    : inode_small_data(&old);
+
+    if (PACK_UNIT_SIZE > 0 && size <= PACK_MAX_SIZE) {
+        size_t units = (size + PACK_UNIT_SIZE - 1) / PACK_UNIT_SIZE;
+        if (old.i_layout == L_PACKED && units < 2 * old_map.i_pack_units) {
+            // leave room to grow, so that appends do not move the file
+            // every time
+            units = 2 * old_map.i_pack_units;
+        }
+        if (units > PACK_MAX_SIZE / PACK_UNIT_SIZE) {
+            units = PACK_MAX_SIZE / PACK_UNIT_SIZE;
+        }
+
+        size_t unit;
+        int b = pack_slot_alloc(inode_block_group(inode), units, &unit);
+        if (b == -1) {
+            return -1;
+        }
+        char *slot = (char *)data_block_get(b) + unit * PACK_UNIT_SIZE;
+        memcpy(slot, contents, old.i_size);
+        memset(slot + old.i_size, 0, units * PACK_UNIT_SIZE - old.i_size);
+
+        inode->i_layout = L_PACKED;
+        inode->i_map->i_pack_block = b;
+        inode->i_map->i_pack_unit = unit;
+        inode->i_map->i_pack_units = units;
+    } else {
+        inode_blocks_init(inode);
+        size_t blocks = (old.i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        for (size_t index = 0; index < blocks;) {
+            size_t run;
+            int b = inode_block_alloc(inode, index, blocks - index, &run);
+            if (b == -1) {
+                inode_blocks_free(inode);
+                inode->i_layout = old.i_layout;
+                *inode->i_map = old_map;
+                return -1;
+            }
+
+            size_t offset = index * BLOCK_SIZE;
+            size_t length = run * BLOCK_SIZE;
+            if (length > old.i_size - offset) {
+                length = old.i_size - offset;
+            }
+            char *block = data_block_get(b);
+            memcpy(block, contents + offset, length);
+            // past the end of the file, blocks are kept zeroed (for holes)
+            memset(block + length, 0, run * BLOCK_SIZE - length);
+            index += run;
+        }
+    }
+
+    if (old.i_layout == L_PACKED) {
+        pack_slot_free(old_map.i_pack_block, old_map.i_pack_unit,
+                       old_map.i_pack_units);
+    }
+    return 0;
+}
+
+/**
+ * Allocation group a data block belongs to.
+ */
+static alloc_group_t *block_group(size_t block_number) {
+    return &alloc_groups[block_number / group_blocks];
+}
+
+/**
+ * Find the first free block of a group at or after a given block.
+ *
+ * Full words of ag_free_blocks are skipped 64 at a time through the
+ * ag_free_blocks_full summary. Should be called with the group's lock held.
+ *
+ * Input:
+ *   - group: the allocation group
+ *   - start: first block to consider (relative to the group's first block)
+ *
+ * Returns the block (relative to the group's first block), or
+ * group->ag_block_count if there are no free blocks.
+ */
+static size_t group_find_free(alloc_group_t const *group, size_t start) {
+    size_t words = bitmap_words(group->ag_block_count);
+    size_t w = start / BITMAP_WORD_BITS;
+    if (w >= words) {
+        return group->ag_block_count;
+    }
+
+    // the word containing start is only partially considered
+    uint64_t free = ~group->ag_free_blocks[w] & bitmap_mask_from(start);
+    if (free != 0) {
+        return w * BITMAP_WORD_BITS + bitmap_ctz(free);
+    }
+
+    for (w++; w < words;) {
+        // simulate storage access delay to the free block map, for every
+        // block of it
+        if (w * sizeof(uint64_t) % BLOCK_SIZE == 0) {
+            insert_delay();
+        }
+
+        uint64_t not_full = ~group->ag_free_blocks_full[w / BITMAP_WORD_BITS] &
+                            bitmap_mask_from(w);
+        if (not_full == 0) {
+            w = (w / BITMAP_WORD_BITS + 1) * BITMAP_WORD_BITS;
+            continue;
+        }
+
+        w = w / BITMAP_WORD_BITS * BITMAP_WORD_BITS + bitmap_ctz(not_full);
+        if (w >= words) {
+            break;
+        }
+        return w * BITMAP_WORD_BITS + bitmap_ctz(~group->ag_free_blocks[w]);
+    }
+    return group->ag_block_count;
+}
+
+/**
+ * Find the first taken block of a group in a range of its blocks.
+ *
+ * Should be called with the group's lock held.
+ *
+ * Input:
+ *   - group: the allocation group
+ *   - start: first block to consider (relative to the group's first block)
+ *   - limit: first block not to consider (idem)
+ *
+ * Returns the block (relative to the group's first block), or limit if every
+ * block in the range is free.
+ */
+static size_t group_find_taken(alloc_group_t const *group, size_t start,
+                               size_t limit) {
+    while (start < limit) {
+        size_t w = start / BITMAP_WORD_BITS;
+        uint64_t taken = group->ag_free_blocks[w] & bitmap_mask_from(start);
+        if (taken != 0) {
+            size_t b = w * BITMAP_WORD_BITS + bitmap_ctz(taken);
+            return b < limit ? b : limit;
+        }
+        start = (w + 1) * BITMAP_WORD_BITS;
+    }
+    return limit;
+}
+
+/**
+ * Mark a range of blocks of a group as taken or free, a word at a time.
+ *
+ * Should be called with the group's lock held.
+ *
+ * Input:
+ *   - group: the allocation group
+ *   - start: first block of the range (relative to the group's first block)
+ *   - count: number of blocks in the range
+ *   - taken: whether to mark the blocks as taken (or free)
+ */
+static void group_mark(alloc_group_t *group, size_t start, size_t count,
+                       bool taken) {
+    size_t end = start + count;
+    while (start < end) {
+        size_t w = start / BITMAP_WORD_BITS;
+        size_t bits = BITMAP_WORD_BITS - start % BITMAP_WORD_BITS;
+        if (bits > end - start) {
+            bits = end - start;
+        }
+        uint64_t mask = bitmap_mask_range(start, bits);
+        uint64_t *word = &group->ag_free_blocks[w];
+
+        if (taken) {
+            size_t flipped = (size_t)__builtin_popcountll(mask & ~*word);
+            atomic_fetch_sub_explicit(&group->ag_free_count, flipped,
+                                      memory_order_relaxed);
+            *word |= mask;
+            if (*word == ~UINT64_C(0)) {
+                bitmap_set(group->ag_free_blocks_full, w);
+            }
+        } else {
+            size_t flipped = (size_t)__builtin_popcountll(mask & *word);
+            atomic_fetch_add_explicit(&group->ag_free_count, flipped,
+                                      memory_order_relaxed);
+            *word &= ~mask;
+            bitmap_clear(group->ag_free_blocks_full, w);
+        }
+        start += bits;
+    }
+}
+
+/**
+ * Take a run of contiguous free blocks from a group: the first run of want
+ * blocks, or the longest run if there is no such run.
+ *
+ * Should be called with the group's lock held.
+ *
+ * Input:
+ *   - group: the allocation group
+ *   - want: number of blocks wanted
+ *   - got: set to the number of blocks actually taken
+ *
+ * Returns the number of the first block of the run, or -1 if the group has no
+ * free blocks.
+ */
+static int group_take_run(alloc_group_t *group, size_t want, size_t *got) {
+    size_t best_start = 0, best_length = 0;
+    size_t count = group->ag_block_count;
+
+    size_t start = group_find_free(group, 0);
+    while (start < count && best_length < want) {
+        size_t limit = want < count - start ? start + want : count;
+        size_t end = group_find_taken(group, start, limit);
+        if (end - start > best_length) {
+            best_start = start;
+            best_length = end - start;
+        }
+        start = group_find_free(group, end);
+    }
+    group_mark(group, best_start, best_length, true);
+
+    *got = best_length;
+    return best_length > 0 ? (int)(group->ag_first_block + best_start) : -1;
+}
+
+/**
+ * Take the first free block of a group.
+ *
+ * Should be called with the group's lock held.
+ *
+ * Returns the block number, or -1 if the group has no free blocks.
+ */
+static int group_take(alloc_group_t *group) {
+    size_t got;
+    return group_take_run(group, 1, &got);
+}
+
+/**
+ * Obtain the calling thread's block magazine, creating it on first use.
+ *
+ * Returns the magazine, or NULL if magazines are disabled or could not be
+ * allocated.
+ */
+static block_magazine_t *magazine_get(void) {
+    if (MAGAZINE_SIZE == 0) {
+        return NULL;
+    }
+    if (thread_magazine != NULL &&
+        thread_magazine_generation == fs_generation) {
+        return thread_magazine;
+    }
+
+    block_magazine_t *magazine =
+        malloc(sizeof(block_magazine_t) + group_count * sizeof(size_t) +
+               group_count * MAGAZINE_SIZE * sizeof(int));
+    if (magazine == NULL) {
+        return NULL;
+    }
+    init_mutex(&magazine->bm_lock);
+    magazine->bm_counts = (size_t *)(magazine + 1);
+    magazine->bm_blocks = (int *)(magazine->bm_counts + group_count);
+    for (size_t g = 0; g < group_count; g++) {
+        magazine->bm_counts[g] = 0;
+    }
+
+    lock_mutex(&magazines_lock);
+    magazine->bm_next = magazines;
+    magazines = magazine;
+    unlock_mutex(&magazines_lock);
+
+    ALWAYS_ASSERT(pthread_setspecific(magazine_key, magazine) == 0,
+                  "magazine_get: failed to register magazine");
+    thread_magazine = magazine;
+    thread_magazine_generation = fs_generation;
+    return magazine;
+}
+
+/**
+ * Return the last count blocks cached for a group to the group's free block
+ * map.
+ *
+ * Should be called with the magazine's lock held.
+ */
+static void magazine_drain(block_magazine_t *magazine, size_t g,
+                           size_t count) {
+    alloc_group_t *group = &alloc_groups[g];
+    int *blocks = &magazine->bm_blocks[g * MAGAZINE_SIZE];
+
+    lock_mutex(&group->ag_lock);
+    insert_delay(); // simulate storage access delay to the free block map
+    for (size_t i = 0; i < count; i++) {
+        int b = blocks[--magazine->bm_counts[g]];
+        group_mark(group, (size_t)b - group->ag_first_block, 1, false);
+    }
+    unlock_mutex(&group->ag_lock);
+}
+
+/**
+ * Fill half of the (empty) slot of a magazine for a group with free blocks of
+ * that group, in a single batch.
+ *
+ * Should be called with the magazine's lock held.
+ */
+static void magazine_refill(block_magazine_t *magazine, size_t g) {
+    alloc_group_t *group = &alloc_groups[g];
+    int *blocks = &magazine->bm_blocks[g * MAGAZINE_SIZE];
+    size_t batch = (MAGAZINE_SIZE + 1) / 2;
+    size_t count = 0;
+
+    lock_mutex(&group->ag_lock);
+    insert_delay(); // simulate storage access delay to the free block map
+    size_t next = 0;
+    while (count < batch) {
+        size_t b = group_find_free(group, next);
+        if (b == group->ag_block_count) {
+            break;
+        }
+        group_mark(group, b, 1, true);
+        blocks[count++] = (int)(group->ag_first_block + b);
+        next = b + 1;
+    }
+    unlock_mutex(&group->ag_lock);
+
+    // blocks are handed out from the end of the slot, so put the lowest
+    // numbered ones there
+    for (size_t i = 0; i < count / 2; i++) {
+        int b = blocks[i];
+        blocks[i] = blocks[count - 1 - i];
+        blocks[count - 1 - i] = b;
+    }
+    magazine->bm_counts[g] = count;
+}
+
+/**
+ * Return the blocks cached by every thread's magazine to the free block maps.
+ *
+ * Used when the free block maps run out of blocks, which may be cached
+ * elsewhere.
+ */
+static void magazines_reclaim(void) {
+    lock_mutex(&magazines_lock);
+    for (block_magazine_t *m = magazines; m != NULL; m = m->bm_next) {
+        lock_mutex(&m->bm_lock);
+        for (size_t g = 0; g < group_count; g++) {
+            magazine_drain(m, g, m->bm_counts[g]);
+        }
+        unlock_mutex(&m->bm_lock);
+    }
+    unlock_mutex(&magazines_lock);
+}
+
+/**
+ * Release a thread's magazine when the thread exits, returning its blocks to
+ * the free block maps.
+ *
+ * Input:
+ *   - magazine: the thread's magazine
+ */
+static void magazine_release(void *magazine) {
+    block_magazine_t *m = magazine;
+
+    lock_mutex(&magazines_lock);
+    block_magazine_t **prev = &magazines;
+    while (*prev != NULL && *prev != m) {
+        prev = &(*prev)->bm_next;
+    }
+    if (*prev == NULL) {
+        // belongs to a destroyed instance of the FS
+        unlock_mutex(&magazines_lock);
+        return;
+    }
+    *prev = m->bm_next;
+    unlock_mutex(&magazines_lock);
+
+    lock_mutex(&m->bm_lock);
+    for (size_t g = 0; g < group_count; g++) {
+        magazine_drain(m, g, m->bm_counts[g]);
+    }
+    unlock_mutex(&m->bm_lock);
+    destroy_mutex(&m->bm_lock);
+    free(m);
+}
+
+/**
+ * Allocate a new data block from a group, through the calling thread's
+ * magazine (which is refilled in a batch when empty) if there is one.
+ *
+ * Returns the block number, or -1 if the group has no free blocks.
+ */
+static int group_block_alloc(block_magazine_t *magazine, size_t g) {
+    if (magazine == NULL) {
+        alloc_group_t *group = &alloc_groups[g];
+        lock_mutex(&group->ag_lock);
+        insert_delay(); // simulate storage access delay to the free block map
+        int b = group_take(group);
+        unlock_mutex(&group->ag_lock);
+        return b;
+    }
+
+    int b = -1;
+    lock_mutex(&magazine->bm_lock);
+    if (magazine->bm_counts[g] == 0) {
+        magazine_refill(magazine, g);
+    }
+    if (magazine->bm_counts[g] > 0) {
+        b = magazine->bm_blocks[g * MAGAZINE_SIZE + --magazine->bm_counts[g]];
+    }
+    unlock_mutex(&magazine->bm_lock);
+    return b;
+}
+
+/**
+ * Allocate a new data block.
+ *
+ * Blocks come from the goal allocation group if it has free blocks (or from
+ * the following groups otherwise), through the calling thread's magazine.
+ *
+ * Input:
+ *   - goal: allocation group to allocate from
+ *
+ * Returns block number/index if successful, -1 otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc(size_t goal) {
+    block_magazine_t *magazine = magazine_get();
+    for (size_t i = 0; i < group_count; i++) {
+        int b = group_block_alloc(magazine, (goal + i) % group_count);
+        if (b != -1) {
+            return b;
+        }
+    }
+
+    if (magazine == NULL) {
+        return -1;
+    }
+
+    // the remaining free blocks may be cached by other threads
+    magazines_reclaim();
+    for (size_t i = 0; i < group_count; i++) {
+        int b = group_block_alloc(NULL, (goal + i) % group_count);
+        if (b != -1) {
+            return b;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Allocate a run of contiguous data blocks.
+ *
+ * Returns the first run of want free blocks of the goal allocation group, or
+ * its longest run of free blocks if there is no such run (moving on to the
+ * following groups if it has no free blocks at all). Single blocks are
+ * allocated like in data_block_alloc.
+ *
+ * Input:
+ *   - goal: allocation group to allocate from
+ *   - want: number of blocks wanted (at least 1)
+ *   - got: set to the number of blocks actually allocated
+ *
+ * Returns the number of the first block of the run if successful, -1
+ * otherwise.
+ *
+ * Possible errors:
+ *   - No free data blocks.
+ */
+int data_block_alloc_run(size_t goal, size_t want, size_t *got) {
+    if (want <= 1) {
+        int b = data_block_alloc(goal);
+        *got = b == -1 ? 0 : 1;
+        return b;
+    }
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+        for (size_t i = 0; i < group_count; i++) {
+            alloc_group_t *group = &alloc_groups[(goal + i) % group_count];
+            lock_mutex(&group->ag_lock);
+            insert_delay(); // simulate storage access delay to free block map
+            int b = group_take_run(group, want, got);
+            unlock_mutex(&group->ag_lock);
+            if (b != -1) {
+                return b;
+            }
+        }
+
+        if (MAGAZINE_SIZE == 0) {
+            break;
+        }
+        // the remaining free blocks may be cached by magazines
+        magazines_reclaim();
+    }
+    return -1;
+}
+
+/**
+ * Allocate the free data blocks that directly follow a given block (in the
+ * same allocation group).
+ *
+ * Input:
+ *   - block_number: the first block to allocate
+ *   - want: maximum number of blocks to allocate
+ *
+ * Returns the number of contiguous blocks allocated starting at block_number
+ * (0 if block_number is taken or out of range).
+ */
+size_t data_block_extend(int block_number, size_t want) {
+    if (!valid_block_number(block_number)) {
+        return 0;
+    }
+
+    alloc_group_t *group = block_group((size_t)block_number);
+    size_t start = (size_t)block_number - group->ag_first_block;
+    size_t count = group->ag_block_count;
+    size_t limit = want < count - start ? start + want : count;
+
+    lock_mutex(&group->ag_lock);
+    insert_delay(); // simulate storage access delay to the free block map
+
+    size_t got = group_find_taken(group, start, limit) - start;
+    group_mark(group, start, got, true);
+
+    unlock_mutex(&group->ag_lock);
+
+    return got;
+}
+
+/**
+ * Return a run of contiguous data blocks to the free block maps.
+ *
+ * Input:
+ *   - block_number: number of the first block of the run
+ *   - count: number of blocks in the run
+ */
+static void block_release_run(int block_number, size_t count) {
+    // runs may span several groups (extents grow across group boundaries)
+    size_t start = (size_t)block_number;
+    size_t end = start + count;
+    while (start < end) {
+        alloc_group_t *group = block_group(start);
+        size_t group_end = group->ag_first_block + group->ag_block_count;
+        size_t n = end < group_end ? end - start : group_end - start;
+
+        lock_mutex(&group->ag_lock);
+        insert_delay(); // simulate storage access delay to the free block map
+        group_mark(group, start - group->ag_first_block, n, false);
+        unlock_mutex(&group->ag_lock);
+
+        start += n;
+    }
+}
+
+/**
+ * Return a data block to the free block maps.
+ *
+ * The block is cached in the calling thread's magazine, half of whose slot for
+ * the block's group is returned to the group when it fills up.
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+static void block_release(int block_number) {
+    block_magazine_t *magazine = magazine_get();
+    if (magazine == NULL) {
+        block_release_run(block_number, 1);
+        return;
+    }
+
+    size_t g = (size_t)block_number / group_blocks;
+    lock_mutex(&magazine->bm_lock);
+    if (magazine->bm_counts[g] == MAGAZINE_SIZE) {
+        magazine_drain(magazine, g, MAGAZINE_SIZE / 2);
+    }
+    magazine->bm_blocks[g * MAGAZINE_SIZE + magazine->bm_counts[g]++] =
+        block_number;
+    unlock_mutex(&magazine->bm_lock);
+}
+
+/**
+ * Whether a data block may be mapped more than once or be in the
+ * deduplication index (see block_shared).
+ */
+static bool block_is_shared(int block_number) {
+    uint64_t word = atomic_load_explicit(
+        &block_shared[(size_t)block_number / BITMAP_WORD_BITS],
+        memory_order_acquire);
+    return (word >> ((size_t)block_number % BITMAP_WORD_BITS)) & 1;
+}
+
+/**
+ * Number of contiguous data blocks, from a given one and up to count, that
+ * are not shared (see block_is_shared).
+ */
+static size_t block_private_run(int block_number, size_t count) {
+    size_t run = 0;
+    while (run < count && !block_is_shared(block_number + (int)run)) {
+        run++;
+    }
+    return run;
+}
+
+/**
+ * Whether a data block is compressed.
+ */
+static bool block_is_compressed(size_t block_number) {
+    uint64_t word =
+        atomic_load_explicit(&block_compressed[block_number / BITMAP_WORD_BITS],
+                             memory_order_acquire);
+    return (word >> (block_number % BITMAP_WORD_BITS)) & 1;
+}
+
+/**
+ * Whether any block of a run of contiguous data blocks is compressed.
+ */
+static bool block_run_compressed(int block_number, size_t count) {
+    for (size_t i = 0; COMPRESS_BLOCKS && i < count; i++) {
+        if (block_is_compressed((size_t)block_number + i)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Mark a data block as compressed or not.
+ *
+ * Should be called with compress_lock held.
+ */
+static void block_set_compressed(size_t block_number, bool compressed) {
+    _Atomic uint64_t *word = &block_compressed[block_number / BITMAP_WORD_BITS];
+    uint64_t bit = UINT64_C(1) << (block_number % BITMAP_WORD_BITS);
+    if (compressed) {
+        atomic_fetch_or_explicit(word, bit, memory_order_release);
+    } else {
+        atomic_fetch_and_explicit(word, ~bit, memory_order_release);
+    }
+}
+
+/**
+ * Return to the OS the pages of fs_data overlapping a compressed block that
+ * only hold compressed blocks.
+ *
+ * Should be called with compress_lock held.
+ */
+static void block_pages_release(size_t block_number) {
+    size_t page_size = fs_data_page_size;
+    if (page_size == 0) {
+        return; // fs_data is not mapped
+    }
+    size_t start = block_number * BLOCK_SIZE / page_size * page_size;
+    size_t end = (block_number + 1) * BLOCK_SIZE;
+
+    for (size_t page = start; page < end; page += page_size) {
+        size_t first = page / BLOCK_SIZE;
+        size_t last = (page + page_size - 1) / BLOCK_SIZE;
+        if (last >= DATA_BLOCKS) {
+            last = DATA_BLOCKS - 1;
+        }
+        bool releasable = true;
+        for (size_t b = first; b <= last && releasable; b++) {
+            releasable = block_is_compressed(b);
+        }
+        if (releasable) {
+            madvise(fs_data + page, page_size, MADV_DONTNEED);
+        }
+    }
+}
+
+/**
+ * Replace a data block by a compressed copy.
+ *
+ * The block must not be in use (its file should be write-locked).
+ *
+ * Returns whether the block was compressed (it is not if it does not shrink).
+ */
+static bool block_compress(size_t block_number) {
+    char const *block = &fs_data[block_number * BLOCK_SIZE];
+
+    lock_mutex(&compress_lock);
+    size_t size =
+        lz_compress(block, BLOCK_SIZE, compress_buffer, BLOCK_SIZE - 1);
+    uint8_t *store = size > 0 ? malloc(size) : NULL;
+    if (store == NULL) {
+        unlock_mutex(&compress_lock);
+        return false;
+    }
+    memcpy(store, compress_buffer, size);
+    block_store[block_number] = store;
+    block_store_size[block_number] = size;
+    compressed_blocks++;
+    compressed_bytes += size;
+    block_set_compressed(block_number, true);
+    block_pages_release(block_number);
+    unlock_mutex(&compress_lock);
+
+    return true;
+}
+
+/**
+ * Drop the compressed copy of a data block (if it has one), optionally
+ * decompressing it back in place first.
+ *
+ * Input:
+ *   - block_number: the block
+ *   - restore: whether to decompress the block
+ */
+static void block_uncompress(size_t block_number, bool restore) {
+    lock_mutex(&compress_lock);
+    if (!block_is_compressed(block_number)) {
+        unlock_mutex(&compress_lock); // another thread got here first
+        return;
+    }
+
+    uint8_t *store = block_store[block_number];
+    size_t size = block_store_size[block_number];
+    if (restore) {
+        ALWAYS_ASSERT(lz_decompress(store, size,
+                                    &fs_data[block_number * BLOCK_SIZE],
+                                    BLOCK_SIZE),
+                      "block_uncompress: corrupted compressed block");
+    }
+    free(store);
+    block_store[block_number] = NULL;
+    compressed_blocks--;
+    compressed_bytes -= size;
+    block_set_compressed(block_number, false);
+    unlock_mutex(&compress_lock);
+}
+
+/**
+ * Drop the compressed copy of a data block that is being freed.
+ */
+static void block_discard_compressed(int block_number) {
+    if (block_is_compressed((size_t)block_number)) {
+        block_uncompress((size_t)block_number, false);
+    }
+}
+
+/**
+ * Mark a data block as accessed, decompressing it if needed.
+ */
+static void block_touch(size_t block_number) {
+    atomic_store_explicit(&block_accessed[block_number], 1,
+                          memory_order_relaxed);
+    if (block_is_compressed(block_number)) {
+        block_uncompress(block_number, true);
+    }
+}
+
+/**
+ * Compress the data blocks of files that were not accessed since the previous
+ * pass (blocks that were are given another chance, in the style of the CLOCK
+ * page replacement algorithm).
+ *
+ * Files that are locked are skipped, as they are in use. Blocks of small
+ * files are not compressed, nor are blocks shared through deduplication.
+ *
+ * Returns the number of blocks compressed.
+ */
+size_t data_blocks_compress_cold(void) {
+    if (!COMPRESS_BLOCKS) {
+        return 0;
+    }
+
+    size_t count = 0;
+    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
+        uint64_t taken = atomic_load_explicit(
+            &freeinode_ts[i / BITMAP_WORD_BITS], memory_order_acquire);
+        if (!((taken >> (i % BITMAP_WORD_BITS)) & 1) ||
+            !rwlock_trywrlock(inode_rwlock((int)i))) {
+            continue;
+        }
+        inode_seq_write_begin((int)i);
+
+        inode_t *inode = &inode_table[i];
+        if (inode->i_node_type == T_FILE && inode->i_layout == L_BLOCKS) {
+            size_t blocks = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+            for (size_t index = 0; index < blocks; index++) {
+                int b = inode_block_lookup(inode, index, NULL);
+                if (b == -1 || block_is_compressed((size_t)b) ||
+                    atomic_exchange_explicit(&block_accessed[b], 0,
+                                             memory_order_relaxed)) {
+                    continue;
+                }
+                if (block_is_shared(b)) {
+                    continue; // other files may be reading it
+                }
+                count += block_compress((size_t)b);
+            }
+        }
+        unlock_inode((int)i);
+    }
+    return count;
+}
+
+/**
+ * Fill in the block usage and compression statistics.
+ *
+ * Input:
+ *   - stats: the statistics to fill in
+ */
+void state_stats(tfs_stats_t *stats) {
+    stats->block_count = DATA_BLOCKS;
+
+    size_t free_count = 0;
+    for (size_t g = 0; g < group_count; g++) {
+        free_count += atomic_load_explicit(&alloc_groups[g].ag_free_count,
+                                           memory_order_relaxed);
+    }
+    lock_mutex(&magazines_lock);
+    for (block_magazine_t *m = magazines; m != NULL; m = m->bm_next) {
+        lock_mutex(&m->bm_lock);
+        for (size_t g = 0; g < group_count; g++) {
+            free_count += m->bm_counts[g];
+        }
+        unlock_mutex(&m->bm_lock);
+    }
+    unlock_mutex(&magazines_lock);
+    stats->free_block_count = free_count;
+
+    lock_mutex(&compress_lock);
+    stats->compressed_block_count = compressed_blocks;
+    stats->compressed_bytes = compressed_bytes;
+    unlock_mutex(&compress_lock);
+    stats->compression_ratio =
+        compressed_bytes > 0
+            ? (double)(stats->compressed_block_count * BLOCK_SIZE) /
+                  (double)stats->compressed_bytes
+            : 1.0;
+}
+
+/**
+ * Update the bit of a data block in block_shared after its references or
+ * its place in the deduplication index changed.
+ *
+ * Should be called with share_lock held.
+ */
+static void block_shared_update(int block_number) {
+    _Atomic uint64_t *word =
+        &block_shared[(size_t)block_number / BITMAP_WORD_BITS];
+    uint64_t bit = UINT64_C(1) << ((size_t)block_number % BITMAP_WORD_BITS);
+    if (block_refs[block_number] > 0 ||
+        (DEDUP_BLOCKS && bitmap_test(block_indexed, (size_t)block_number))) {
+        atomic_fetch_or_explicit(word, bit, memory_order_release);
+    } else {
+        atomic_fetch_and_explicit(word, ~bit, memory_order_release);
+    }
+}
+
+/**
+ * Home slot of a hash in the deduplication index.
+ */
+static size_t dedup_slot(uint64_t hash) {
+    return (size_t)hash & (dedup_index_size - 1);
+}
+
+/**
+ * Find an indexed block with given contents.
+ *
+ * Should be called with share_lock held.
+ *
+ * Input:
+ *   - hash: hash of the contents
+ *   - contents: the contents (BLOCK_SIZE bytes)
+ *
+ * Returns the block number, or -1 if no indexed block has those contents.
+ */
+static int dedup_index_find(uint64_t hash, char const *contents) {
+    size_t mask = dedup_index_size - 1;
+    for (size_t i = dedup_slot(hash);; i = (i + 1) & mask) {
+        dedup_entry_t const *e = &dedup_index[i];
+        if (e->de_block == -1) {
+            return -1;
+        }
+        // equal hashes are confirmed, so collisions are harmless
+        if (e->de_hash == hash &&
+            memcmp(data_block_get(e->de_block), contents, BLOCK_SIZE) == 0) {
+            return e->de_block;
+        }
+    }
+}
+
+/**
+ * Add a block to the deduplication index.
+ *
+ * Should be called with share_lock held.
+ */
+static void dedup_index_insert(uint64_t hash, int block_number) {
+    size_t mask = dedup_index_size - 1;
+    size_t i = dedup_slot(hash);
+    while (dedup_index[i].de_block != -1) {
+        i = (i + 1) & mask;
+    }
+    dedup_index[i].de_hash = hash;
+    dedup_index[i].de_block = block_number;
+    block_hashes[block_number] = hash;
+    bitmap_set(block_indexed, (size_t)block_number);
+    block_shared_update(block_number);
+}
+
+/**
+ * Remove a block from the deduplication index, moving back the entries that
+ * follow it so that no probe sequence is broken.
+ *
+ * Should be called with share_lock held.
+ */
+static void dedup_index_remove(int block_number) {
+    size_t mask = dedup_index_size - 1;
+    size_t i = dedup_slot(block_hashes[block_number]);
+    while (dedup_index[i].de_block != block_number) {
+        i = (i + 1) & mask;
     }
 
-    return 0;
+    for (size_t j = (i + 1) & mask; dedup_index[j].de_block != -1;
+         j = (j + 1) & mask) {
+        // the entry at j may fill the gap at i if i is between its home slot
+        // and j
+        size_t home = dedup_slot(dedup_index[j].de_hash);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            dedup_index[i] = dedup_index[j];
+            i = j;
+        }
+    }
+    dedup_index[i].de_block = -1;
+    bitmap_clear(block_indexed, (size_t)block_number);
+    block_shared_update(block_number);
 }
 
 /**
- * Destroy FS state.
+ * Drop a reference to a shared data block, removing it from the deduplication
+ * index once it has no references left.
  *
- * Returns 0 if succesful, -1 otherwise.
+ * Returns whether the block has no references left (and should be freed).
  */
-int state_destroy(void) {
-    // Destroy rwlocks in inode table
-    for (size_t i = 0; i < INODE_TABLE_SIZE; i++) {
-        destroy_rwlock(&inode_rwlocks_table[i]);
+static bool block_unref(int block_number) {
+    lock_mutex(&share_lock);
+    if (block_refs[block_number] > 0) {
+        block_refs[block_number]--;
+        block_shared_update(block_number);
+        unlock_mutex(&share_lock);
+        return false;
     }
-    free(inode_rwlocks_table);
-    free(inode_table);
-    free(freeinode_ts);
-    destroy_mutex(&freeinode_ts_lock);
-    free(fs_data);
-    free(free_blocks);
-    destroy_mutex(&free_blocks_lock);
-    free(open_file_table);
-    // Destroy mutexes in open file locks table
-    for (size_t i = 0; i < MAX_OPEN_FILES; i++) {
-        destroy_mutex(&open_file_locks_table[i]);
+    if (DEDUP_BLOCKS && bitmap_test(block_indexed, (size_t)block_number)) {
+        dedup_index_remove(block_number);
     }
-    free(open_file_locks_table);
-    free(free_open_file_entries);
-    destroy_mutex(&free_open_file_entries_lock);
+    unlock_mutex(&share_lock);
+    return true;
+}
 
-    inode_table = NULL;
-    freeinode_ts = NULL;
-    fs_data = NULL;
-    free_blocks = NULL;
-    open_file_table = NULL;
-    free_open_file_entries = NULL;
+/**
+ * Free a data block (if it is shared, drop a reference to it).
+ *
+ * Input:
+ *   - block_number: the block number/index
+ */
+void data_block_free(int block_number) {
+    ALWAYS_ASSERT(valid_block_number(block_number),
+                  "data_block_free: invalid block number");
 
-    return 0;
+    if (block_is_shared(block_number) && !block_unref(block_number)) {
+        return; // still shared
+    }
+    if (COMPRESS_BLOCKS) {
+        block_discard_compressed(block_number);
+    }
+    block_release(block_number);
 }
 
 /**
- * (Try to) Allocate a new inode in the inode table, without initializing its
- * data.
- *
- * Returns the inumber of the newly allocated inode, or -1 in the case of error.
+ * Free a run of contiguous data blocks (if they may be shared, drop a
+ * reference to each of them).
  *
- * Possible errors:
- *   - No free slots in inode table.
+ * Input:
+ *   - block_number: number of the first block of the run
+ *   - count: number of blocks in the run
  */
-static int inode_alloc(void) {
-    lock_mutex(&freeinode_ts_lock);
-    for (size_t inumber = 0; inumber < INODE_TABLE_SIZE; inumber++) {
-        if ((inumber * sizeof(allocation_state_t) % BLOCK_SIZE) == 0) {
-            insert_delay(); // simulate storage access delay (to freeinode_ts)
-        }
+void data_block_free_run(int block_number, size_t count) {
+    ALWAYS_ASSERT(valid_block_number(block_number) &&
+                      (size_t)block_number + count <= DATA_BLOCKS,
+                  "data_block_free_run: invalid block number");
 
-        // Finds first free entry in inode table
-        if (freeinode_ts[inumber] == FREE) {
-            //  Found a free entry, so takes it for the new inode
-            freeinode_ts[inumber] = TAKEN;
-            unlock_mutex(&freeinode_ts_lock);
-            return (int)inumber;
+    if (COMPRESS_BLOCKS || (count == 1 && MAGAZINE_SIZE > 0) ||
+        block_private_run(block_number, count) < count) {
+        // blocks of the run may be shared or compressed
+        for (size_t i = 0; i < count; i++) {
+            data_block_free(block_number + (int)i);
         }
+        return;
     }
-
-    // no free inodes
-    unlock_mutex(&freeinode_ts_lock);
-    return -1;
+    block_release_run(block_number, count);
 }
 
 /**
- * Create a new inode in the inode table.
- *
- * Allocates and initializes a new inode.
- * Directories will have their data block allocated and initialized, with i_size
- * set to BLOCK_SIZE. Regular files will not have their data block allocated
- * (i_size will be set to 0, i_data_block to -1).
+ * Move the blocks mapped by an inode's extents to its block map, so that they
+ * can be remapped one at a time.
  *
  * Input:
- *   - i_type: the type of the node (file or directory)
+ *   - inode: the inode (should be write-locked)
  *
- * Returns inumber of the new inode, or -1 in the case of error.
+ * Returns 0 if successful, -1 otherwise (in which case the extents are left
+ * in place).
  *
  * Possible errors:
- *   - No free slots in inode table.
- *   - (if creating a directory) No free data blocks.
- *   - Failed to initialize inode rwlock.
+ *   - No free data blocks for the indirect blocks of the block map.
  */
-int inode_create(inode_type i_type) {
-    int inumber = inode_alloc();
-    if (inumber == -1) {
-        return -1; // no free slots in inode table
-    }
-    lock_wr_inode(inumber);
-    // wrlock_rwlock(&inode_rwlocks_table[inumber]);
-    inode_t *inode = &inode_table[inumber];
-    insert_delay(); // simulate storage access delay (to inode)
-
-    inode->i_node_type = i_type;
-    // Initialize rwlock
-    switch (i_type) {
-    case T_DIRECTORY: {
-        // Initializes directory (filling its block with empty entries, labeled
-        // with inumber==-1)
-        int b = data_block_alloc();
-        if (b == -1) {
-            // ensure fields are initialized
-            inode->i_size = 0;
-            inode->i_data_block = -1;
-
-            // run regular deletion process
-            inode_delete(inumber);
-            unlock_inode(inumber);
+static int inode_extents_flatten(inode_t *inode) {
+    size_t end = inode_extent_end(inode);
+    for (size_t index = 0; index < end; index++) {
+        int *slot = inode_block_slot(inode, index, true);
+        if (slot == NULL) {
+            // indirect blocks allocated so far are kept, unmapped
+            for (size_t i = 0; i < index; i++) {
+                *inode_block_slot(inode, i, false) = -1;
+            }
             return -1;
         }
-
-        inode_table[inumber].i_size = BLOCK_SIZE;
-        inode_table[inumber].i_data_block = b;
-        inode_table[inumber].i_links = 1;
-
-        dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(b);
-        ALWAYS_ASSERT(dir_entry != NULL,
-                      "inode_create: data block freed while in use");
-
-        for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-            dir_entry[i].d_inumber = -1;
-        }
-    } break;
-    case T_FILE:
-    case T_SYM_LINK:
-        // In case of a new file or a symbolic link, simply sets its size to 0
-        inode_table[inumber].i_size = 0;
-        inode_table[inumber].i_data_block = -1;
-        inode_table[inumber].i_links = 1;
-        break;
-    default:
-        PANIC("inode_create: unknown file type");
+        *slot = inode_block_lookup(inode, index, NULL);
     }
-    unlock_inode(inumber);
-    return inumber;
+    inode->i_map->i_extent_count = 0;
+    return 0;
 }
 
 /**
- * Delete an inode.
+ * Map a new block of a file in place of the one mapped at an index, which is
+ * left for the caller to free.
  *
  * Input:
- *   - inumber: inode's number
+ *   - inode: the file's inode (should be write-locked)
+ *   - index: index of the block inside the file
+ *
+ * Returns the new block (with undefined contents), or -1 if none could be
+ * allocated.
+ *
+ * Possible errors:
+ *   - No free data blocks.
  */
-void inode_delete(int inumber) {
-    // simulate storage access delay (to inode and freeinode_ts)
-    insert_delay();
-    insert_delay();
-
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_delete: invalid inumber");
-    lock_mutex(&freeinode_ts_lock);
-    ALWAYS_ASSERT(freeinode_ts[inumber] == TAKEN,
-                  "inode_delete: inode already freed");
-
-    if (inode_table[inumber].i_size > 0) {
-        data_block_free(inode_table[inumber].i_data_block);
+int inode_block_remap(inode_t *inode, size_t index) {
+    if (index < inode_extent_end(inode) && inode_extents_flatten(inode) == -1) {
+        return -1;
+    }
+    int b = data_block_alloc(inode_block_group(inode));
+    if (b != -1) {
+        *inode_block_slot(inode, index, false) = b;
     }
-    freeinode_ts[inumber] = FREE;
-    unlock_mutex(&freeinode_ts_lock);
+    return b;
 }
 
 /**
- * Obtain a pointer to an inode from its inumber.
+ * Make a block of a file private to it before writing to it in place: a
+ * shared block (deduplicated or cloned) is replaced by a copy, and an indexed
+ * block is removed from the deduplication index.
  *
  * Input:
- *   - inumber: inode's number
+ *   - inode: the file's inode (should be write-locked)
+ *   - index: index of the block inside the file
+ *   - block_number: the block currently mapped at index
+ *   - run: number of contiguous mapped blocks that can be written, cut
+ *     short at the first shared one (set to 1 if block_number is shared)
  *
- * Returns pointer to inode.
+ * Returns the block to write to, or -1 if it could not be copied.
+ *
+ * Possible errors:
+ *   - No free data blocks.
  */
-inode_t *inode_get(int inumber) {
-    ALWAYS_ASSERT(valid_inumber(inumber), "inode_get: invalid inumber");
+int inode_block_unshare(inode_t *inode, size_t index, int block_number,
+                        size_t *run) {
+    size_t private = block_private_run(block_number, *run);
+    if (private > 0) {
+        *run = private;
+        return block_number;
+    }
+    *run = 1;
 
-    insert_delay(); // simulate storage access delay to inode
+    lock_mutex(&share_lock);
+    bool shared = block_refs[block_number] > 0;
+    if (!shared && DEDUP_BLOCKS &&
+        bitmap_test(block_indexed, (size_t)block_number)) {
+        // it is about to change, so it can no longer replace other blocks
+        dedup_index_remove(block_number);
+    }
+    unlock_mutex(&share_lock);
+    if (!shared) {
+        return block_number;
+    }
 
-    return &inode_table[inumber];
+    // copy on write
+    int copy = inode_block_remap(inode, index);
+    if (copy == -1) {
+        return -1;
+    }
+    memcpy(data_block_get(copy), data_block_get(block_number), BLOCK_SIZE);
+    data_block_free(block_number);
+    return copy;
 }
 
 /**
- * Clear the directory entry associated with a sub file.
+ * Deduplicate full blocks of a file that were just written: each block is
+ * replaced by an indexed block with the same contents if there is one, or
+ * added to the index otherwise. Does nothing without deduplication.
  *
  * Input:
- *   - inode: directory inode (should be write-locked)
- *   - sub_name: sub file name
- *
- * Returns 0 if successful, -1 otherwise.
- *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain an entry for sub_name.
+ *   - inode: the file's inode (should be write-locked)
+ *   - index: index of the first block inside the file
+ *   - count: number of blocks
  */
-int clear_dir_entry(inode_t *inode, char const *sub_name) {
-    insert_delay();
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+void inode_blocks_dedup(inode_t *inode, size_t index, size_t count) {
+    if (!DEDUP_BLOCKS) {
+        return;
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "clear_dir_entry: directory must have a data block");
+    for (size_t i = index; i < index + count; i++) {
+        int b = inode_block_lookup(inode, i, NULL);
+        ALWAYS_ASSERT(b != -1, "inode_blocks_dedup: block is not mapped");
+        char const *contents = data_block_get(b);
+        uint64_t hash = xxhash64(contents, BLOCK_SIZE, 0);
 
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            dir_entry[i].d_inumber = -1;
-            // TODO lock and unluck
-            memset(dir_entry[i].d_name, 0, MAX_FILE_NAME);
-            return 0;
+        lock_mutex(&share_lock);
+        if (block_refs[b] > 0 || bitmap_test(block_indexed, (size_t)b)) {
+            unlock_mutex(&share_lock);
+            continue; // already deduplicated
+        }
+
+        int d = dedup_index_find(hash, contents);
+        if (d == -1) {
+            dedup_index_insert(hash, b);
+            unlock_mutex(&share_lock);
+            continue;
+        }
+        if (i < inode_extent_end(inode) && inode_extents_flatten(inode) == -1) {
+            unlock_mutex(&share_lock);
+            continue; // no space to remap the block: keep it
         }
+        block_refs[d]++;
+        block_shared_update(d);
+        *inode_block_slot(inode, i, false) = d;
+        unlock_mutex(&share_lock);
+
+        data_block_free(b);
     }
-    return -1; // sub_name not found
 }
 
 /**
- * Store the inumber for a sub file in a directory.
+ * Make a file share the contents of another one: the data blocks of the
+ * source are mapped by the clone too (only its indirect blocks are copied),
+ * and copied on the first write by either file. Small files are copied, as
+ * they take less than a block.
  *
  * Input:
- *   - inode: directory inode (should be write-locked)
- *   - sub_name: sub file name
- *   - sub_inumber: inumber of the sub inode
+ *   - inode: the clone's inode, an empty file (should be write-locked)
+ *   - src: the source file's inode (should be locked)
  *
- * Returns 0 if successful, -1 otherwise.
+ * Returns 0 if successful, -1 otherwise (in which case the clone is left
+ * empty).
  *
  * Possible errors:
- *   - inode is not a directory inode.
- *   - sub_name is not a valid file name (length 0 or > MAX_FILE_NAME - 1).
- *   - Directory is already full of entries.
+ *   - No free data blocks (for indirect blocks or a packed slot).
  */
-int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber) {
-    if (strlen(sub_name) == 0 || strlen(sub_name) > MAX_FILE_NAME - 1) {
-        return -1; // invalid sub_name
-    }
+int inode_clone(inode_t *inode, inode_t const *src) {
+    ALWAYS_ASSERT(inode->i_node_type == T_FILE && inode->i_size == 0,
+                  "inode_clone: clone is not an empty file");
 
-    insert_delay(); // simulate storage access delay to inode with inumber
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+    if (src->i_layout != L_BLOCKS) {
+        if (src->i_size > inode_small_capacity(inode) &&
+            inode_small_grow(inode, src->i_size) == -1) {
+            return -1;
+        }
+        memcpy(inode_small_data(inode), inode_small_data(src), src->i_size);
+        inode->i_size = src->i_size;
+        return 0;
     }
 
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "add_dir_entry: directory must have a data block");
-
-    // Finds and fills the first empty entry
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (dir_entry[i].d_inumber == -1) {
-            // TODO: bloquear dir entry aqui!
-            dir_entry[i].d_inumber = sub_inumber;
-            strncpy(dir_entry[i].d_name, sub_name, MAX_FILE_NAME - 1);
-            dir_entry[i].d_name[MAX_FILE_NAME - 1] = '\0';
+    inode_blocks_init(inode);
+    size_t end = inode_extent_end(src);
+    size_t blocks = (src->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (size_t index = end; index < blocks; index++) {
+        int b = inode_block_lookup(src, index, NULL);
+        if (b == -1) {
+            continue; // hole
+        }
+        int *slot = inode_block_slot(inode, index, true);
+        if (slot == NULL) {
+            // unmap the blocks, which belong to the source, before freeing
+            // the indirect blocks
+            for (size_t i = end; i < index; i++) {
+                int *mapped = inode_block_slot(inode, i, false);
+                if (mapped != NULL) {
+                    *mapped = -1;
+                }
+            }
+            inode_blocks_free(inode);
+            return -1;
+        }
+        *slot = b;
+    }
+    memcpy(inode->i_map->i_extents, src->i_map->i_extents,
+           sizeof(src->i_map->i_extents));
+    inode->i_map->i_extent_count = src->i_map->i_extent_count;
 
-            return 0;
+    lock_mutex(&share_lock);
+    for (size_t index = 0; index < blocks; index++) {
+        int b = inode_block_lookup(inode, index, NULL);
+        if (b != -1) {
+            block_refs[b]++;
+            block_shared_update(b);
         }
     }
+    unlock_mutex(&share_lock);
 
-    return -1; // no space for entry
+    inode->i_size = src->i_size;
+    return 0;
 }
 
 /**
- * Obtain the inumber for a sub file inside a directory.
+ * Copy an inode into the latest snapshot, before its first change since the
+ * snapshot was created. Data blocks are shared with the snapshot (taking a
+ * reference to each of them); the contents of small files are copied.
  *
  * Input:
- *   - inode: directory inode (should be read-locked)
- *   - sub_name: sub file name
- *
- * Returns inumber linked to the target name, -1 if errors occur.
- *
- * Possible errors:
- *   - inode is not a directory inode.
- *   - Directory does not contain a file named sub_name.
- *   - Failed to lock or unlock directory's inode.
+ *   - inumber: the inode (should be write-locked)
  */
-int find_in_dir(const inode_t *inode, char const *sub_name) {
-    ALWAYS_ASSERT(inode != NULL, "find_in_dir: inode must be non-NULL");
-    ALWAYS_ASSERT(sub_name != NULL, "find_in_dir: sub_name must be non-NULL");
-
-    insert_delay(); // simulate storage access delay to inode with inumber
+static void inode_preserve(int inumber) {
+    size_t count = atomic_load_explicit(&snapshot_count, memory_order_relaxed);
+    inode_t const *inode = &inode_table[inumber];
 
-    if (inode->i_node_type != T_DIRECTORY) {
-        return -1; // not a directory
+    snapshot_inode_t *copy = malloc(sizeof(snapshot_inode_t));
+    ALWAYS_ASSERT(copy != NULL, "inode_preserve: failed to allocate copy");
+    copy->si_next = inode_copies[inumber];
+    copy->si_snapshot = count - 1;
+    copy->si_inode = *inode;
+    copy->si_map = *inode->i_map;
+    copy->si_inode.i_map = &copy->si_map;
+    copy->si_dir_map = NULL;
+    if (inode->i_node_type == T_DIRECTORY) {
+        copy->si_dir_map = dir_map_copy(dir_map(inode));
     }
-    // Locates the block containing the entries of the directory
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    ALWAYS_ASSERT(dir_entry != NULL,
-                  "find_in_dir: directory inode must have a data block");
-    // Iterates over the directory entries looking for one that has the target
+    memcpy(copy->si_target, inode_targets[inumber], MAX_SYM_TARGET);
+    copy->si_blocks = NULL;
+    copy->si_block_count = 0;
+    copy->si_data = NULL;
 
-    for (int i = 0; i < MAX_DIR_ENTRIES; i++)
-        if ((dir_entry[i].d_inumber != -1) &&
-            (strncmp(dir_entry[i].d_name, sub_name, MAX_FILE_NAME) == 0)) {
+    if (inode->i_node_type != T_SYM_LINK && inode->i_layout != L_BLOCKS) {
+        copy->si_data = malloc(inode->i_size + 1);
+        ALWAYS_ASSERT(copy->si_data != NULL,
+                      "inode_preserve: failed to allocate contents");
+        memcpy(copy->si_data, inode_small_data(inode), inode->i_size);
+    } else if (inode->i_node_type != T_SYM_LINK) {
+        size_t blocks = (inode->i_size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+        copy->si_blocks = malloc((blocks + 1) * sizeof(int));
+        ALWAYS_ASSERT(copy->si_blocks != NULL,
+                      "inode_preserve: failed to allocate block list");
+        copy->si_block_count = blocks;
+        for (size_t index = 0; index < blocks; index++) {
+            copy->si_blocks[index] = inode_block_lookup(inode, index, NULL);
+        }
 
-            int sub_inumber = dir_entry[i].d_inumber;
-            return sub_inumber;
+        lock_mutex(&share_lock);
+        for (size_t index = 0; index < blocks; index++) {
+            if (copy->si_blocks[index] != -1) {
+                block_refs[copy->si_blocks[index]]++;
+                block_shared_update(copy->si_blocks[index]);
+            }
         }
+        unlock_mutex(&share_lock);
+    }
 
-    return -1; // entry not found
+    inode_copies[inumber] = copy;
+    inode_epochs[inumber] = count;
 }
 
 /**
- * Allocate a new data block.
+ * Create a snapshot of the whole file system.
  *
- * Returns block number/index if successful, -1 otherwise.
+ * Nothing is copied, and no lock is taken: the snapshot is published by
+ * bumping snapshot_count, and inodes are only copied before they change
+ * afterwards (see lock_wr_inode). A change in progress meanwhile (under an
+ * inode lock taken before) is part of the snapshot.
  *
- * Possible errors:
- *   - No free data blocks.
+ * Returns the snapshot's number, or -1 if there are already
+ * max_snapshot_count snapshots.
  */
-int data_block_alloc(void) {
-    lock_mutex(&free_blocks_lock);
-    for (size_t i = 0; i < DATA_BLOCKS; i++) {
-        if (i * sizeof(allocation_state_t) % BLOCK_SIZE == 0) {
-            insert_delay(); // simulate storage access delay to free_blocks
+int snapshot_create(void) {
+    size_t count = atomic_load(&snapshot_count);
+    do {
+        if (count >= MAX_SNAPSHOTS) {
+            return -1;
         }
+    } while (!atomic_compare_exchange_weak(&snapshot_count, &count,
+                                           count + 1));
+    return (int)count;
+}
 
-        if (free_blocks[i] == FREE) {
-            free_blocks[i] = TAKEN;
-            unlock_mutex(&free_blocks_lock);
-            return (int)i;
-        }
+/**
+ * Whether a snapshot exists.
+ */
+bool valid_snapshot(int snapshot) {
+    return snapshot >= 0 &&
+           (size_t)snapshot < atomic_load(&snapshot_count);
+}
+
+/**
+ * Copy of an inode that a snapshot sees (NULL if it is the live inode).
+ *
+ * Input:
+ *   - snapshot: the snapshot
+ *   - inumber: the inode (should be locked)
+ */
+static snapshot_inode_t const *snapshot_copy(int snapshot, int inumber) {
+    snapshot_inode_t const *found = NULL; // not changed since the snapshot
+    for (snapshot_inode_t const *copy = inode_copies[inumber];
+         copy != NULL && copy->si_snapshot >= (size_t)snapshot;
+         copy = copy->si_next) {
+        found = copy;
     }
-    unlock_mutex(&free_blocks_lock);
-    return -1;
+    return found;
 }
 
 /**
- * Free a data block.
+ * Obtain an inode as of a snapshot.
  *
  * Input:
- *   - block_number: the block number/index
+ *   - snapshot: the snapshot
+ *   - inumber: the inode (should be locked, and stay locked while the
+ *     returned inode is used)
  */
-void data_block_free(int block_number) {
-    ALWAYS_ASSERT(valid_block_number(block_number),
-                  "data_block_free: invalid block number");
-        lock_mutex(&free_blocks_lock);
+inode_t const *snapshot_inode_get(int snapshot, int inumber) {
+    ALWAYS_ASSERT(valid_snapshot(snapshot) && valid_inumber(inumber),
+                  "snapshot_inode_get: invalid snapshot or inumber");
+    snapshot_inode_t const *copy = snapshot_copy(snapshot, inumber);
+    return copy != NULL ? &copy->si_inode : &inode_table[inumber];
+}
+
+/**
+ * Obtain the block number of the index-th block of a file as of a snapshot.
+ *
+ * Input:
+ *   - snapshot: the snapshot
+ *   - inumber: the file's inode (should be locked)
+ *   - index: index of the block inside the file
+ *
+ * Returns the block number, or -1 if that block is not mapped.
+ */
+int snapshot_block_lookup(int snapshot, int inumber, size_t index) {
+    snapshot_inode_t const *copy = snapshot_copy(snapshot, inumber);
+    if (copy == NULL) {
+        return inode_block_lookup(&inode_table[inumber], index, NULL);
+    }
+    return index < copy->si_block_count ? copy->si_blocks[index] : -1;
+}
+
+/**
+ * Contents of a small (inline or packed) file as of a snapshot.
+ *
+ * Input:
+ *   - snapshot: the snapshot
+ *   - inumber: the file's inode (should be locked)
+ */
+char const *snapshot_small_data(int snapshot, int inumber) {
+    snapshot_inode_t const *copy = snapshot_copy(snapshot, inumber);
+    if (copy == NULL) {
+        return inode_small_data(&inode_table[inumber]);
+    }
+    return copy->si_data;
+}
 
-    insert_delay(); // simulate storage access delay to free_blocks
+/**
+ * Target of a symbolic link as of a snapshot.
+ *
+ * Input:
+ *   - snapshot: the snapshot
+ *   - inumber: the link's inode (should be locked)
+ */
+char const *snapshot_sym_target(int snapshot, int inumber) {
+    snapshot_inode_t const *copy = snapshot_copy(snapshot, inumber);
+    return copy != NULL ? copy->si_target : inode_targets[inumber];
+}
 
-    free_blocks[block_number] = FREE;
-    unlock_mutex(&free_blocks_lock);
+/**
+ * Obtain the inumber for a sub file inside a directory, as of a snapshot.
+ *
+ * Input:
+ *   - snapshot: the snapshot
+ *   - dir_inumber: the directory's inode (should be locked)
+ *   - sub_name: sub file name
+ *
+ * Returns inumber linked to the target name, -1 if not found.
+ */
+int snapshot_find_in_dir(int snapshot, int dir_inumber, char const *sub_name) {
+    insert_delay(); // simulate storage access delay to inode with inumber
+    inode_t const *inode = snapshot_inode_get(snapshot, dir_inumber);
+    if (inode->i_node_type != T_DIRECTORY) {
+        return -1; // not a directory
+    }
+    snapshot_inode_t const *copy = snapshot_copy(snapshot, dir_inumber);
+    dir_map_t const *map =
+        copy != NULL ? copy->si_dir_map : dir_map(inode);
+    uint64_t hash = dir_name_hash(sub_name);
+    size_t index = map->dm_slots[dir_route(hash, map->dm_depth)].ds_index;
+    return dir_block_find(snapshot_block_lookup(snapshot, dir_inumber, index),
+                          sub_name, hash);
 }
 
 /**
@@ -496,9 +4051,35 @@ void *data_block_get(int block_number) {
                   "data_block_get: invalid block number");
 
     insert_delay(); // simulate storage access delay to block
+    if (COMPRESS_BLOCKS) {
+        block_touch((size_t)block_number);
+    }
     return &fs_data[(size_t)block_number * BLOCK_SIZE];
 }
 
+/**
+ * Obtain a pointer to the contents of a run of contiguous blocks.
+ *
+ * Input:
+ *   - block_number: number of the first block of the run
+ *   - count: number of blocks in the run
+ *
+ * Returns a pointer to the first block (the others follow it).
+ */
+void *data_block_get_run(int block_number, size_t count) {
+    ALWAYS_ASSERT(valid_block_number(block_number) &&
+                      (size_t)block_number + count <= DATA_BLOCKS,
+                  "data_block_get_run: invalid block number");
+
+    void *block = data_block_get(block_number);
+    if (COMPRESS_BLOCKS) {
+        for (size_t i = 1; i < count; i++) {
+            block_touch((size_t)block_number + i);
+        }
+    }
+    return block;
+}
+
 /**
  * Add a new entry to the open file table.
  *
@@ -514,10 +4095,19 @@ void *data_block_get(int block_number) {
 int add_to_open_file_table(int inumber, size_t offset) {
     lock_mutex(&free_open_file_entries_lock);
     for (int i = 0; i < MAX_OPEN_FILES; i++) {
-        if (free_open_file_entries[i] == FREE) {
-            free_open_file_entries[i] = TAKEN;
+        if (atomic_load_explicit(&free_open_file_entries[i],
+                                 memory_order_relaxed) == FREE) {
             open_file_table[i].of_inumber = inumber;
             open_file_table[i].of_offset = offset;
+            open_file_table[i].of_stage =
+                DELAYED_ALLOC_SIZE > 0
+                    ? open_file_stages + (size_t)i * DELAYED_ALLOC_SIZE
+                    : NULL;
+            open_file_table[i].of_stage_length = 0;
+            open_file_table[i].of_snapshot = -1;
+            // the entry is only looked up once it is filled in
+            atomic_store_explicit(&free_open_file_entries[i], TAKEN,
+                                  memory_order_release);
             unlock_mutex(&free_open_file_entries_lock);
             return i;
         }
@@ -540,7 +4130,8 @@ void remove_from_open_file_table(int fhandle) {
     ALWAYS_ASSERT(free_open_file_entries[fhandle] == TAKEN,
                   "remove_from_open_file_table: file handle must be taken");
 
-    free_open_file_entries[fhandle] = FREE;
+    atomic_store_explicit(&free_open_file_entries[fhandle], FREE,
+                          memory_order_relaxed);
     unlock_mutex(&free_open_file_entries_lock);
 }
 
@@ -557,12 +4148,12 @@ open_file_entry_t *get_open_file_entry(int fhandle) {
     if (!valid_file_handle(fhandle)) {
         return NULL;
     }
-    lock_mutex(&free_open_file_entries_lock);
-
-    if (free_open_file_entries[fhandle] != TAKEN) {
+    // no lock: it is only changed by opening and closing the handle, which
+    // should not happen while it is in use
+    if (atomic_load_explicit(&free_open_file_entries[fhandle],
+                             memory_order_acquire) != TAKEN) {
         return NULL;
     }
-    unlock_mutex(&free_open_file_entries_lock);
 
     return &open_file_table[fhandle];
 }
@@ -649,73 +4240,96 @@ void destroy_rwlock(pthread_rwlock_t *rwlock) {
 }
 
 /**
- * Locks a read and write lock (rwlock) only for WRITING
+ * Locks the read and write lock (rwlock) of an inode only for WRITING
  *
  * Input:
- *  - rwlock: rwlock to be locked
+ *  - inumber: inode whose rwlock is to be locked
  *
- * Asserts that the operation was successfully achieved
+ * Asserts that the inode number is valid
  */
 void lock_wr_inode(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber),
                   "lock_wr_inode: invalid inode number");
     //   printf("lock_wr_inode: locking inode %d\n",    inumber);
-    ALWAYS_ASSERT(pthread_rwlock_wrlock(&inode_rwlocks_table[inumber]) == 0,
-                  "lock_wr_inode: failed to lock inode");
+    rwlock_wrlock(inode_rwlock(inumber));
+    inode_seq_write_begin(inumber);
+    // the inode may be about to change: snapshots taken since it last
+    // changed should keep it as it is now (unless it is free, as when it
+    // was unlinked while being opened, and so is in no snapshot)
+    uint64_t taken =
+        atomic_load_explicit(&freeinode_ts[(size_t)inumber / BITMAP_WORD_BITS],
+                             memory_order_relaxed);
+    if (inode_epochs[inumber] <
+            atomic_load_explicit(&snapshot_count, memory_order_acquire) &&
+        ((taken >> ((size_t)inumber % BITMAP_WORD_BITS)) & 1)) {
+        inode_preserve(inumber);
+    }
 }
 
 /**
- * Locks a read and write lock (rwlock) only for READING
+ * Locks the read and write lock (rwlock) of an inode only for READING
  *
  * Input:
- *  - rwlock: rwlock to be locked
+ *  - inumber: inode whose rwlock is to be locked
  *
- * Asserts that the operation was successfully achieved
+ * Asserts that the inode number is valid
  */
 void lock_rd_inode(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber),
                   "lock_rd_inode: invalid inode number");
     //  printf("lock_rd_inode: locking inode %d\n",     inumber);
-    ALWAYS_ASSERT(pthread_rwlock_rdlock(&inode_rwlocks_table[inumber]) == 0,
-                  "lock_rd_inode: failed to lock inode");
+    rwlock_rdlock(inode_rwlock(inumber));
 }
 
 /**
- * Unlocks a read and write lock both for READING and WRITING
+ * Unlocks the read and write lock (rwlock) of an inode, held for READING or
+ * WRITING
  *
  * Input:
- *  - rwlock: rwlock to be unlocked
+ *  - inumber: inode whose rwlock is to be unlocked
  *
- * Asserts that the operation was successfully achieved
+ * Asserts that the inode number is valid
  */
 void unlock_inode(int inumber) {
     ALWAYS_ASSERT(valid_inumber(inumber), "unlock_inode: invalid inode number");
     //  printf("unlock_inode: unlocking inode %d\n", inumber);
-    ALWAYS_ASSERT(pthread_rwlock_unlock(&inode_rwlocks_table[inumber]) == 0,
-                  "unlock_inode: failed to unlock inode");
+    uint32_t seq =
+        atomic_load_explicit(&inode_seqs[inumber], memory_order_relaxed);
+    if (seq & 1) {
+        // held for writing: readers may use what was written from now on
+        atomic_store_explicit(&inode_seqs[inumber], seq + 1,
+                              memory_order_release);
+    }
+    rwlock_unlock(inode_rwlock(inumber));
 }
 
 void lock_dir_entry(const inode_t *inode, const char *sub_name) {
     insert_delay();
 
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            lock_mutex(&open_file_locks_table[i]);
-            return;
-        }
+    uint64_t hash = dir_name_hash(sub_name);
+    dir_map_t *map = dir_map(inode);
+    dir_entry_t *dir_entry = dir_block_entries(atomic_load_explicit(
+        &map->dm_slots[dir_route(hash, map->dm_depth)].ds_block,
+        memory_order_relaxed));
+    int sub_inumber;
+    int i = dir_entry_find(dir_entry, sub_name, hash, &sub_inumber);
+    if (i != -1) {
+        lock_mutex(&open_file_locks_table[i]);
     }
 }
 
 void unlock_dir_entry(const inode_t *inode, const char *sub_name) {
     insert_delay();
 
-    dir_entry_t *dir_entry = (dir_entry_t *)data_block_get(inode->i_data_block);
-    for (size_t i = 0; i < MAX_DIR_ENTRIES; i++) {
-        if (!strcmp(dir_entry[i].d_name, sub_name)) {
-            unlock_mutex(&open_file_locks_table[i]);
-            return;
-        }
+    uint64_t hash = dir_name_hash(sub_name);
+    dir_map_t *map = dir_map(inode);
+    dir_entry_t *dir_entry = dir_block_entries(atomic_load_explicit(
+        &map->dm_slots[dir_route(hash, map->dm_depth)].ds_block,
+        memory_order_relaxed));
+    int sub_inumber;
+    int i = dir_entry_find(dir_entry, sub_name, hash, &sub_inumber);
+    if (i != -1) {
+        unlock_mutex(&open_file_locks_table[i]);
     }
     return;
 }
@@ -4,34 +4,111 @@
 #include "config.h"
 #include "operations.h"
 
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/types.h>
 
 /**
- * Directory entry
+ * Directory entry, whose name is kept in the name heap of its block of
+ * directory entries
  */
 typedef struct {
-    char d_name[MAX_FILE_NAME];
-    int d_inumber;
+    uint32_t d_name_offset; // where the name starts in the heap
+    uint32_t d_name_length; // (there is no null byte after it)
+    // inumber of the entry's file, published after its name is filled in, so
+    // directories can be read without locks (or DIR_ENTRY_FREE or
+    // DIR_ENTRY_RETIRED)
+    _Atomic int d_inumber;
 } dir_entry_t;
 
+#define DIR_ENTRY_FREE (-1)
+// cleared, but lookups may still be reading the name (see add_dir_entry)
+#define DIR_ENTRY_RETIRED (-2)
+
 typedef enum { T_FILE, T_DIRECTORY, T_SYM_LINK } inode_type;
 
+/**
+ * Where the contents of a file are stored
+ */
+typedef enum {
+    L_INLINE, // in the inode, in place of the block map
+    L_PACKED, // in a slot of a data block shared with other small files
+    L_BLOCKS  // in data blocks of its own, through the block map
+} inode_layout;
+
+/**
+ * Extent: a run of contiguous data blocks backing contiguous file blocks
+ */
+typedef struct {
+    uint32_t e_index;  // first file block covered
+    int e_block;       // first data block of the run
+    uint32_t e_length; // number of blocks in the run
+} extent_t;
+
+// Size of the contents of a file that can be stored inline in its inode (the
+// space taken by the block map)
+#define INODE_INLINE_SIZE                                                      \
+    (sizeof(int) * (INODE_DIRECT_BLOCKS + 2) +                                 \
+     sizeof(extent_t) * INODE_EXTENTS + sizeof(size_t))
+
+/**
+ * Block map of an inode, or the contents of small files in its place: the
+ * part of an inode only used to reach the file's contents, kept apart from
+ * the inode table (see inode_t)
+ */
+typedef union {
+    struct {
+        // Block map: the first INODE_DIRECT_BLOCKS blocks of the file are
+        // pointed to directly, the following ones through a single-indirect
+        // block and then through a double-indirect block (-1 marks an
+        // unmapped entry)
+        int i_direct[INODE_DIRECT_BLOCKS];
+        int i_indirect;
+        int i_double_indirect;
+
+        // Extents mapping the first blocks of sequentially written files; the
+        // block map is only used past the end of the last extent
+        extent_t i_extents[INODE_EXTENTS];
+        size_t i_extent_count;
+    };
+
+    // Contents of inline files
+    char i_inline_data[INODE_INLINE_SIZE];
+
+    // Slot of packed files: i_pack_units units, starting at unit i_pack_unit
+    // of data block i_pack_block
+    struct {
+        int i_pack_block;
+        size_t i_pack_unit;
+        size_t i_pack_units;
+    };
+} inode_map_t;
+
 /**
  * Inode
+ *
+ * Only the small fields that scans of the inode table read are kept here;
+ * the block map is in a side table indexed by inumber, and rarely used
+ * fields, such as the targets of symbolic links, in others (see
+ * inode_sym_target).
  */
 typedef struct {
     inode_type i_node_type;
 
-    size_t i_size;
-    int i_data_block;
+    // Regular files keep their contents inline while they fit in
+    // INODE_INLINE_SIZE bytes, then packed with other small files while they
+    // fit in half a block
+    inode_layout i_layout;
 
     int i_links;
 
-    // Only used in symbolic links
-    char i_target_d_name[MAX_FILE_NAME];
+    size_t i_size;
+
+    // the inode's entry of the side table (or a copy's own block map)
+    inode_map_t *i_map;
 
     // in a more complete FS, more fields could exist here
 } inode_t;
@@ -44,24 +121,67 @@ typedef enum { FREE = 0, TAKEN = 1 } allocation_state_t;
 typedef struct {
     int of_inumber;
     size_t of_offset;
+
+    // Staging buffer for delayed allocation (NULL if disabled): holds
+    // of_stage_length bytes to be written at of_stage_offset
+    char *of_stage;
+    size_t of_stage_offset;
+    size_t of_stage_length;
+
+    // Snapshot the file is read from (-1 for the live file system)
+    int of_snapshot;
 } open_file_entry_t;
 
 int state_init(tfs_params);
 int state_destroy(void);
 
 size_t state_block_size(void);
+size_t state_delayed_alloc_size(void);
 
-int inode_create(inode_type n_type);
+int inode_create(inode_type n_type, int dir_inumber);
 void inode_delete(int inumber);
 inode_t *inode_get(int inumber);
+char *inode_sym_target(int inumber);
 
 int clear_dir_entry(inode_t *inode, char const *sub_name);
 int add_dir_entry(inode_t *inode, char const *sub_name, int sub_inumber);
 int find_in_dir(const inode_t *inode, char const *sub_name);
-
-int data_block_alloc(void);
+bool dir_empty(const inode_t *inode);
+
+size_t inode_max_size(void);
+int inode_block_lookup(const inode_t *inode, size_t index, size_t *run);
+int inode_block_alloc(inode_t *inode, size_t index, size_t count,
+                      size_t *run);
+void inode_blocks_free(inode_t *inode);
+int inode_block_remap(inode_t *inode, size_t index);
+int inode_block_unshare(inode_t *inode, size_t index, int block_number,
+                        size_t *run);
+void inode_blocks_dedup(inode_t *inode, size_t index, size_t count);
+int inode_clone(inode_t *inode, inode_t const *src);
+
+int snapshot_create(void);
+bool valid_snapshot(int snapshot);
+inode_t const *snapshot_inode_get(int snapshot, int inumber);
+int snapshot_block_lookup(int snapshot, int inumber, size_t index);
+char const *snapshot_small_data(int snapshot, int inumber);
+char const *snapshot_sym_target(int snapshot, int inumber);
+int snapshot_find_in_dir(int snapshot, int dir_inumber, char const *sub_name);
+ssize_t inode_read_optimistic(int inumber, size_t offset, void *buffer,
+                              size_t len);
+char *inode_small_data(inode_t const *inode);
+size_t inode_small_capacity(inode_t const *inode);
+int inode_small_grow(inode_t *inode, size_t size);
+
+int data_block_alloc(size_t goal);
+int data_block_alloc_run(size_t goal, size_t want, size_t *got);
+size_t data_block_extend(int block_number, size_t want);
 void data_block_free(int block_number);
+void data_block_free_run(int block_number, size_t count);
 void *data_block_get(int block_number);
+void *data_block_get_run(int block_number, size_t count);
+size_t data_blocks_compress_cold(void);
+
+void state_stats(tfs_stats_t *stats);
 
 int add_to_open_file_table(int inumber, size_t offset);
 void remove_from_open_file_table(int fhandle);
@@ -82,7 +202,7 @@ void unlock_inode(int inumber);
 void lock_dir_entry(const inode_t *inode, const char *sub_name);
 void unlock_dir_entry(const inode_t *inode, const char *sub_name);
 
-void open_file_lock(int inumber);
-void open_file_unlock(int inumber);
+void open_file_lock(int fhandle);
+void open_file_unlock(int fhandle);
 
 #endif // STATE_H
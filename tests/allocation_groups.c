@@ -0,0 +1,86 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (1000)
+#define INODE_COUNT (20)
+
+uint8_t pattern_byte(size_t i) { return (uint8_t)(i * 7 + i / BLOCK_SIZE); }
+
+/*
+ * Fills the file system through files spread over every allocation group and
+ * checks that no inode or data block is lost to the split.
+ */
+void run(size_t group_count, uint8_t const *contents) {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.max_inode_count = INODE_COUNT;
+    params.block_size = BLOCK_SIZE;
+    params.allocation_group_count = group_count;
+    assert(tfs_init(&params) != -1);
+
+    // every inode but the root's can be taken, whatever group it is in
+    char path[16] = {0};
+    for (int i = 1; i < INODE_COUNT; i++) {
+        sprintf(path, "/f%d", i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    assert(tfs_open("/one_too_many", TFS_O_CREAT) == -1);
+
+    // the first file takes every free block but the root directory's, one
+    // group after the other (runs that cross into the next group extend the
+    // same extent, otherwise an indirect block may be needed for the map)
+    int f = tfs_open("/f1", 0);
+    assert(f != -1);
+    ssize_t size = tfs_write(f, contents, BLOCK_COUNT * BLOCK_SIZE);
+    assert(size >= (BLOCK_COUNT - 2) * BLOCK_SIZE &&
+           size <= (BLOCK_COUNT - 1) * BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    uint8_t *buffer = malloc((size_t)size);
+    assert(buffer != NULL);
+    f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, (size_t)size) == size);
+    assert(memcmp(buffer, contents, (size_t)size) == 0);
+    assert(tfs_close(f) != -1);
+    free(buffer);
+
+    // freed blocks can be taken by files in other groups
+    f = tfs_open("/f1", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    f = tfs_open("/f19", 0);
+    assert(f != -1);
+    assert(tfs_write(f, contents, (size_t)size) == size);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    uint8_t *contents = malloc(BLOCK_COUNT * BLOCK_SIZE);
+    assert(contents != NULL);
+    for (size_t i = 0; i < BLOCK_COUNT * BLOCK_SIZE; i++) {
+        contents[i] = pattern_byte(i);
+    }
+
+    // groups that do not evenly split the blocks, a single group and more
+    // groups than there is room for
+    size_t const group_counts[] = {4, 3, 1, 64};
+    for (size_t i = 0; i < sizeof(group_counts) / sizeof(*group_counts); i++) {
+        run(group_counts[i], contents);
+    }
+
+    free(contents);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
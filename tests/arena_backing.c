@@ -0,0 +1,74 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_SIZE (600 * 1024 + 77)
+
+uint8_t pattern_byte(size_t i) { return (uint8_t)(i % 251 + i / 4096); }
+
+void check_backing(tfs_arena_backing backing, tfs_arena_numa numa,
+                   uint8_t const *contents, uint8_t *buffer) {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 1024;
+    params.arena_backing = backing;
+    params.arena_numa = numa;
+    params.compress_blocks = true;
+    if (backing != TFS_ARENA_MMAP) {
+        // only pages of the default size are returned to the OS as blocks
+        // are compressed
+        assert(tfs_init(&params) == -1);
+        params.compress_blocks = false;
+    }
+    assert(tfs_init(&params) != -1);
+
+    int f = tfs_open("/f", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // pages of compressed blocks are returned to the OS
+    if (params.compress_blocks) {
+        assert(tfs_compress_cold() == 0);
+        assert(tfs_compress_cold() > 0);
+    }
+
+    f = tfs_open("/f", 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE + 1) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    uint8_t *contents = malloc(FILE_SIZE);
+    uint8_t *buffer = malloc(FILE_SIZE + 1);
+    assert(contents != NULL && buffer != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = pattern_byte(i);
+    }
+
+    // backings that are not available (e.g. without reserved huge pages)
+    // fall back to malloc
+    tfs_arena_backing backings[] = {TFS_ARENA_MMAP, TFS_ARENA_MALLOC,
+                                    TFS_ARENA_HUGETLB, TFS_ARENA_THP};
+    tfs_arena_numa placements[] = {TFS_NUMA_DEFAULT, TFS_NUMA_INTERLEAVE,
+                                   TFS_NUMA_GROUPS};
+    for (size_t b = 0; b < sizeof(backings) / sizeof(backings[0]); b++) {
+        for (size_t n = 0; n < sizeof(placements) / sizeof(placements[0]);
+             n++) {
+            check_backing(backings[b], placements[n], contents, buffer);
+        }
+    }
+
+    free(contents);
+    free(buffer);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
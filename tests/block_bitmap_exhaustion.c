@@ -0,0 +1,52 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// not a multiple of 64, so the last word of the block bitmap is partial
+#define BLOCK_COUNT 1000
+#define BLOCK_SIZE 1024
+
+char const path[] = "/f1";
+
+int main() {
+    size_t capacity = BLOCK_COUNT * BLOCK_SIZE;
+    char *buffer = malloc(capacity);
+    assert(buffer != NULL);
+    memset(buffer, 'x', capacity);
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    for (int i = 0; i < 3; i++) {
+        // every block but the root directory's fits in a single extent
+        int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, buffer, capacity) ==
+               (BLOCK_COUNT - 1) * BLOCK_SIZE);
+        assert(tfs_write(f, buffer, 1) == -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    // once freed, every block can be allocated again one at a time
+    assert(tfs_unlink(path) != -1);
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    size_t written = 0;
+    ssize_t w;
+    while ((w = tfs_write(f, buffer, 100)) > 0) {
+        written += (size_t)w;
+    }
+    assert(written == (BLOCK_COUNT - 1) * BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+    free(buffer);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
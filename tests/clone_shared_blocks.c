@@ -0,0 +1,117 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCKS (40)
+#define FILE_SIZE (BLOCKS * BLOCK_SIZE + 100)
+
+uint8_t pattern_byte(size_t i) { return (uint8_t)(i * 31 + i / BLOCK_SIZE); }
+
+size_t free_blocks(void) {
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    return stats.free_block_count;
+}
+
+void check_file(char const *path, uint8_t const *contents, size_t size) {
+    uint8_t *buffer = malloc(size + 1);
+    assert(buffer != NULL);
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, size + 1) == (ssize_t)size);
+    assert(memcmp(buffer, contents, size) == 0);
+    assert(tfs_close(f) != -1);
+    free(buffer);
+}
+
+void write_at(char const *path, size_t offset, char const *text) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_lseek(f, (off_t)offset, SEEK_SET) == (off_t)offset);
+    assert(tfs_write(f, text, strlen(text)) == (ssize_t)strlen(text));
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    uint8_t *contents = malloc(FILE_SIZE);
+    uint8_t *changed = malloc(FILE_SIZE);
+    assert(contents != NULL && changed != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = pattern_byte(i);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 256;
+    assert(tfs_init(&params) != -1);
+    size_t initial = free_blocks();
+
+    int f = tfs_open("/a", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // the clone takes no data blocks of its own (at most indirect blocks)
+    size_t before = free_blocks();
+    assert(tfs_clone("/a", "/b") != -1);
+    assert(before - free_blocks() <= 2);
+    check_file("/b", contents, FILE_SIZE);
+
+    // writing to the clone copies the block written to, and only it
+    before = free_blocks();
+    size_t offset = 20 * BLOCK_SIZE + 7;
+    write_at("/b", offset, "XYZ");
+    assert(before - free_blocks() >= 1 && before - free_blocks() <= 3);
+    memcpy(changed, contents, FILE_SIZE);
+    memcpy(changed + offset, "XYZ", 3);
+    check_file("/b", changed, FILE_SIZE);
+    check_file("/a", contents, FILE_SIZE);
+
+    // and so does writing to the source
+    write_at("/a", 3, "abc");
+    memcpy(contents + 3, "abc", 3);
+    check_file("/a", contents, FILE_SIZE);
+    check_file("/b", changed, FILE_SIZE);
+
+    // shared blocks are only freed with their last file
+    assert(tfs_unlink("/a") != -1);
+    check_file("/b", changed, FILE_SIZE);
+    assert(tfs_unlink("/b") != -1);
+    assert(free_blocks() == initial);
+
+    // small files and sparse files
+    f = tfs_open("/small", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, 300) == 300);
+    assert(tfs_close(f) != -1);
+    assert(tfs_clone("/small", "/small2") != -1);
+    check_file("/small2", contents, 300);
+
+    f = tfs_open("/sparse", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_lseek(f, 30 * BLOCK_SIZE, SEEK_SET) == 30 * BLOCK_SIZE);
+    assert(tfs_write(f, contents, BLOCK_SIZE) == BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+    assert(tfs_clone("/sparse", "/sparse2") != -1);
+    memset(changed, 0, 30 * BLOCK_SIZE);
+    memcpy(changed + 30 * BLOCK_SIZE, contents, BLOCK_SIZE);
+    check_file("/sparse2", changed, 31 * BLOCK_SIZE);
+
+    // errors
+    assert(tfs_clone("/missing", "/c") == -1);
+    assert(tfs_clone("/small", "/sparse") == -1);
+    assert(tfs_sym_link("/small", "/link") != -1);
+    assert(tfs_clone("/link", "/c") == -1);
+
+    assert(tfs_destroy() != -1);
+    free(contents);
+    free(changed);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCKS (32)
+#define FILE_SIZE (BLOCKS * BLOCK_SIZE)
+
+char const text_path[] = "/text";
+char const noise_path[] = "/noise";
+
+uint8_t text_byte(size_t i) { return (uint8_t)("lorem ipsum "[i % 12]); }
+
+void write_file(char const *path, uint8_t const *contents) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+}
+
+void check_file(char const *path, uint8_t const *contents) {
+    uint8_t *buffer = malloc(FILE_SIZE);
+    assert(buffer != NULL);
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE + 1) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+    free(buffer);
+}
+
+int main() {
+    uint8_t *text = malloc(FILE_SIZE);
+    uint8_t *noise = malloc(FILE_SIZE);
+    assert(text != NULL && noise != NULL);
+    uint64_t x = 88172645463325252ULL;
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        text[i] = text_byte(i);
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        noise[i] = (uint8_t)x;
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 256;
+    params.compress_blocks = true;
+    assert(tfs_init(&params) != -1);
+
+    write_file(text_path, text);
+    write_file(noise_path, noise);
+
+    // the blocks were just written, so they get a second chance
+    assert(tfs_compress_cold() == 0);
+
+    // only the compressible file's blocks shrink
+    assert(tfs_compress_cold() == BLOCKS);
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.compressed_block_count == BLOCKS);
+    assert(stats.compression_ratio > 2.0);
+    assert(tfs_compress_cold() == 0);
+
+    // reading decompresses the blocks, which stay hot until the next pass
+    check_file(text_path, text);
+    check_file(noise_path, noise);
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.compressed_block_count == 0);
+    assert(stats.compressed_bytes == 0);
+    assert(tfs_compress_cold() == 0);
+    assert(tfs_compress_cold() == BLOCKS);
+
+    // a write to part of a compressed block keeps the rest of it
+    int f = tfs_open(text_path, 0);
+    assert(f != -1);
+    size_t offset = 5 * BLOCK_SIZE + 100;
+    assert(tfs_lseek(f, (off_t)offset, SEEK_SET) == (off_t)offset);
+    assert(tfs_write(f, "XYZ", 3) == 3);
+    assert(tfs_close(f) != -1);
+    memcpy(text + offset, "XYZ", 3);
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.compressed_block_count == BLOCKS - 1);
+    check_file(text_path, text);
+
+    // the compressed copies of deleted files are dropped
+    assert(tfs_compress_cold() == 0);
+    assert(tfs_compress_cold() == BLOCKS);
+    assert(tfs_stats(&stats) != -1);
+    size_t free_blocks = stats.free_block_count;
+    assert(tfs_unlink(text_path) != -1);
+    assert(tfs_stats(&stats) != -1);
+    assert(stats.compressed_block_count == 0);
+    assert(stats.free_block_count >= free_blocks + BLOCKS);
+
+    // and their blocks can be reused
+    write_file(text_path, noise);
+    check_file(text_path, noise);
+
+    assert(tfs_destroy() != -1);
+    free(text);
+    free(noise);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (40)
+#define FILE_BLOCKS (20)
+#define FILE_SIZE (FILE_BLOCKS * BLOCK_SIZE)
+#define COPIES (4)
+#define CHUNK_SIZE (512)
+
+char contents[FILE_SIZE];
+
+void write_copy(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    for (size_t offset = 0; offset < FILE_SIZE; offset += CHUNK_SIZE) {
+        assert(tfs_write(f, contents + offset, CHUNK_SIZE) == CHUNK_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+}
+
+void check_copy(char const *path, char const *expected) {
+    static char buffer[FILE_SIZE + 1];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == FILE_SIZE);
+    assert(memcmp(buffer, expected, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    // every block has different contents
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = (char)('a' + (i / BLOCK_SIZE + i) % 26);
+    }
+
+    char external[] = "/tmp/tfs_dedup_XXXXXX";
+    int fd = mkstemp(external);
+    assert(fd != -1);
+    assert(write(fd, contents, FILE_SIZE) == FILE_SIZE);
+    assert(close(fd) == 0);
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    params.dedup_blocks = true;
+    assert(tfs_init(&params) != -1);
+
+    // far more copies than there are blocks for, through tfs_write and
+    // tfs_copy_from_external_fs
+    char path[16] = {0};
+    for (int i = 0; i <= COPIES; i++) {
+        sprintf(path, "/f%d", i);
+        write_copy(path);
+    }
+    assert(tfs_copy_from_external_fs(external, "/c1") != -1);
+    assert(tfs_copy_from_external_fs(external, "/c2") != -1);
+    for (int i = 0; i <= COPIES; i++) {
+        sprintf(path, "/f%d", i);
+        check_copy(path, contents);
+    }
+    check_copy("/c1", contents);
+    check_copy("/c2", contents);
+
+    // writing to a shared block only changes the file written to
+    static char changed[FILE_SIZE];
+    memcpy(changed, contents, FILE_SIZE);
+    memcpy(changed + 3 * BLOCK_SIZE + 10, "changed", 7);
+    int f = tfs_open("/f1", 0);
+    assert(f != -1);
+    assert(tfs_lseek(f, 3 * BLOCK_SIZE + 10, SEEK_SET) != -1);
+    assert(tfs_write(f, "changed", 7) == 7);
+    assert(tfs_close(f) != -1);
+    check_copy("/f1", changed);
+    check_copy("/f0", contents);
+    check_copy("/c1", contents);
+
+    // blocks with the same contents are shared within a file too
+    static char zeros[FILE_SIZE];
+    f = tfs_open("/zeros", TFS_O_CREAT);
+    assert(f != -1);
+    for (int i = 0; i < COPIES; i++) {
+        assert(tfs_write(f, zeros, FILE_SIZE) == FILE_SIZE);
+    }
+    assert(tfs_close(f) != -1);
+
+    // once every copy is gone, so are the shared blocks
+    for (int i = 0; i <= COPIES; i++) {
+        sprintf(path, "/f%d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_unlink("/c1") != -1);
+    assert(tfs_unlink("/c2") != -1);
+    assert(tfs_unlink("/zeros") != -1);
+    static char large[BLOCK_COUNT * BLOCK_SIZE];
+    for (size_t i = 0; i < sizeof(large); i++) {
+        large[i] = (char)(i / BLOCK_SIZE); // no two blocks alike
+    }
+    f = tfs_open("/large", TFS_O_CREAT);
+    assert(f != -1);
+    ssize_t written = tfs_write(f, large, sizeof(large));
+    assert(written >= (BLOCK_COUNT - 2) * BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+    unlink(external);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
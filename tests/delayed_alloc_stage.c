@@ -0,0 +1,143 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (16)
+#define STAGE_SIZE (4 * BLOCK_SIZE)
+#define CHUNK_SIZE (100)
+#define CHUNK_COUNT (30)
+#define WRITERS (4)
+#define WRITER_CHUNKS (2000)
+
+char const path[] = "/f1";
+int shared_handle;
+atomic_bool started;
+
+ssize_t file_size(void) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    off_t size = tfs_lseek(f, 0, SEEK_END);
+    assert(tfs_close(f) != -1);
+    return size;
+}
+
+void *thread_write(void *arg) {
+    char chunk[CHUNK_SIZE];
+    memset(chunk, *(char *)arg, sizeof(chunk));
+    while (!atomic_load(&started)) {
+        // so that the writers run at the same time
+    }
+    for (size_t c = 0; c < WRITER_CHUNKS; c++) {
+        assert(tfs_write(shared_handle, chunk, sizeof(chunk)) ==
+               sizeof(chunk));
+    }
+    return NULL;
+}
+
+int main() {
+    char contents[CHUNK_SIZE * CHUNK_COUNT];
+    for (size_t i = 0; i < sizeof(contents); i++) {
+        contents[i] = (char)('a' + i % 26);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    params.delayed_alloc_size = STAGE_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    // consecutive writes are staged until an explicit flush
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    for (size_t c = 0; c < CHUNK_COUNT; c++) {
+        assert(tfs_write(f, contents + c * CHUNK_SIZE, CHUNK_SIZE) ==
+               CHUNK_SIZE);
+    }
+    assert(file_size() == 0);
+    assert(tfs_fsync(f) != -1);
+    assert(file_size() == sizeof(contents));
+
+    // reading through the same handle sees the staged contents
+    assert(tfs_lseek(f, 0, SEEK_SET) == 0);
+    assert(tfs_write(f, "ABC", 3) == 3);
+    assert(tfs_lseek(f, 0, SEEK_SET) == 0);
+    char buffer[sizeof(contents) + 1];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(contents));
+    assert(memcmp(buffer, "ABC", 3) == 0);
+    assert(memcmp(buffer + 3, contents + 3, sizeof(contents) - 3) == 0);
+
+    // so do other handles, once the file is closed
+    assert(tfs_write(f, "XYZ", 3) == 3);
+    assert(tfs_close(f) != -1);
+    assert(file_size() == sizeof(contents) + 3);
+
+    // a write that does not follow the staged contents flushes them first
+    f = tfs_open(path, TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, 10) == 10);
+    assert(tfs_lseek(f, 100, SEEK_SET) == 100);
+    assert(tfs_write(f, contents, 10) == 10);
+    assert(file_size() == 10);
+    assert(tfs_close(f) != -1);
+    assert(file_size() == 110);
+
+    // running out of space is reported when the staged contents are written
+    f = tfs_open(path, TFS_O_TRUNC);
+    assert(f != -1);
+    for (size_t i = 0; i < BLOCK_COUNT / 4; i++) {
+        char block[STAGE_SIZE] = {0};
+        assert(tfs_write(f, block, sizeof(block)) == sizeof(block));
+    }
+    assert(tfs_close(f) == -1);
+    assert(file_size() == (BLOCK_COUNT - 1) * BLOCK_SIZE);
+    assert(tfs_destroy() != -1);
+
+    // threads writing through the same handle append whole chunks, one
+    // after the other, without losing any
+    params.max_block_count =
+        WRITERS * WRITER_CHUNKS * CHUNK_SIZE / BLOCK_SIZE + BLOCK_COUNT;
+    assert(tfs_init(&params) != -1);
+    shared_handle = tfs_open(path, TFS_O_CREAT);
+    assert(shared_handle != -1);
+    pthread_t writers[WRITERS];
+    char fill[WRITERS];
+    for (int i = 0; i < WRITERS; i++) {
+        fill[i] = (char)('A' + i);
+        assert(pthread_create(&writers[i], NULL, thread_write, &fill[i]) ==
+               0);
+    }
+    atomic_store(&started, true);
+    for (int i = 0; i < WRITERS; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+    assert(tfs_close(shared_handle) != -1);
+    assert(file_size() == WRITERS * WRITER_CHUNKS * CHUNK_SIZE);
+
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    size_t chunks[WRITERS] = {0};
+    for (size_t c = 0; c < WRITERS * WRITER_CHUNKS; c++) {
+        char chunk[CHUNK_SIZE];
+        assert(tfs_read(f, chunk, sizeof(chunk)) == sizeof(chunk));
+        int i = chunk[0] - 'A';
+        assert(i >= 0 && i < WRITERS);
+        for (size_t j = 1; j < sizeof(chunk); j++) {
+            assert(chunk[j] == chunk[0]);
+        }
+        chunks[i]++;
+    }
+    for (int i = 0; i < WRITERS; i++) {
+        assert(chunks[i] == WRITER_CHUNKS);
+    }
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
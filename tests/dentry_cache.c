@@ -0,0 +1,126 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define OWNERS 3
+#define LOOKERS 3
+#define NAMES 4
+#define ROUNDS 300
+
+atomic_bool running;
+
+void name_path(char *path, int owner, int i) {
+    snprintf(path, 32, "/d/n%d_%d", owner, i);
+}
+
+bool exists(char const *path) {
+    int f = tfs_open(path, 0);
+    if (f == -1) {
+        return false;
+    }
+    assert(tfs_close(f) != -1);
+    return true;
+}
+
+void create(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+}
+
+void *thread_own(void *arg) {
+    int id = *(int *)arg;
+    char path[32];
+
+    // a name is found right after it is created, and not found right after
+    // it is removed, however often other threads looked it up before
+    for (int r = 0; r < ROUNDS; r++) {
+        name_path(path, id, r % NAMES);
+        assert(!exists(path));
+        create(path);
+        assert(exists(path));
+        assert(tfs_unlink(path) != -1);
+        assert(!exists(path));
+    }
+    return NULL;
+}
+
+void *thread_look(void *arg) {
+    int id = *(int *)arg;
+    char path[32];
+
+    for (int r = 0; atomic_load(&running); r++) {
+        name_path(path, (r + id) % OWNERS, r % NAMES);
+        exists(path);
+    }
+    return NULL;
+}
+
+void check_sequential(void) {
+    assert(tfs_mkdir("/d") != -1);
+    assert(!exists("/d/f"));
+    assert(!exists("/d/f"));
+    create("/d/f");
+    assert(exists("/d/f"));
+    assert(tfs_sym_link("/d/f", "/d/l") != -1);
+    assert(exists("/d/l"));
+    assert(tfs_unlink("/d/f") != -1);
+    assert(!exists("/d/f"));
+    assert(!exists("/d/l"));
+    assert(tfs_unlink("/d/l") != -1);
+
+    // a directory created again (maybe in the same inode) starts empty
+    create("/d/g");
+    assert(tfs_unlink("/d/g") != -1);
+    assert(tfs_rmdir("/d") != -1);
+    assert(!exists("/d/g"));
+    assert(tfs_mkdir("/d") != -1);
+    assert(!exists("/d/g"));
+    create("/d/g");
+    assert(exists("/d/g"));
+    assert(tfs_unlink("/d/g") != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.dentry_cache_size = 100;
+    assert(tfs_init(&params) == -1); // not a power of two
+
+    size_t sizes[] = {0, 1, 256};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        params.dentry_cache_size = sizes[s];
+        params.max_open_files_count = OWNERS + LOOKERS;
+        assert(tfs_init(&params) != -1);
+        check_sequential();
+
+        atomic_store(&running, true);
+        pthread_t owners[OWNERS], lookers[LOOKERS];
+        int ids[OWNERS + LOOKERS];
+        for (int i = 0; i < OWNERS + LOOKERS; i++) {
+            ids[i] = i;
+        }
+        for (int i = 0; i < LOOKERS; i++) {
+            assert(pthread_create(&lookers[i], NULL, thread_look, &ids[i]) ==
+                   0);
+        }
+        for (int i = 0; i < OWNERS; i++) {
+            assert(pthread_create(&owners[i], NULL, thread_own, &ids[i]) == 0);
+        }
+        for (int i = 0; i < OWNERS; i++) {
+            assert(pthread_join(owners[i], NULL) == 0);
+        }
+        atomic_store(&running, false);
+        for (int i = 0; i < LOOKERS; i++) {
+            assert(pthread_join(lookers[i], NULL) == 0);
+        }
+
+        assert(tfs_destroy() != -1);
+    }
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,92 @@
+#include "fs/config.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NAMES 300
+#define MAX_PADDING 36
+
+// names of many lengths, the number followed by padding of a given length
+void name_path(char *path, int i, int padding) {
+    snprintf(path, MAX_FILE_NAME + 2, "/%d", i);
+    size_t length = strlen(path);
+    memset(path + length, 'x', (size_t)padding);
+    path[length + (size_t)padding] = '\0';
+}
+
+int padding(int i) {
+    return i % MAX_PADDING;
+}
+
+bool exists(char const *path) {
+    int f = tfs_open(path, 0);
+    if (f == -1) {
+        return false;
+    }
+    assert(tfs_close(f) != -1);
+    return true;
+}
+
+void check_names(bool simd) {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = NAMES + 1;
+    params.simd_dir_lookups = simd;
+    params.dentry_cache_size = 0; // every lookup reads the directory
+    assert(tfs_init(&params) != -1);
+
+    char path[MAX_FILE_NAME + 2];
+    for (int i = 0; i < NAMES; i++) {
+        name_path(path, i, padding(i));
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    // every third name is removed, and then found again once added back
+    for (int i = 0; i < NAMES; i += 3) {
+        name_path(path, i, padding(i));
+        assert(tfs_unlink(path) != -1);
+        assert(!exists(path));
+    }
+    for (int i = 0; i < NAMES; i++) {
+        name_path(path, i, padding(i));
+        assert(exists(path) == (i % 3 != 0));
+    }
+    for (int i = 0; i < NAMES; i += 3) {
+        name_path(path, i, padding(i));
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    // names that are a prefix of one another are told apart
+    for (int i = 0; i < NAMES; i++) {
+        name_path(path, i, padding(i));
+        assert(exists(path));
+        name_path(path, i, padding(i) + 1);
+        assert(!exists(path));
+        for (int shorter = 0; shorter < padding(i); shorter++) {
+            name_path(path, i, shorter);
+            assert(!exists(path));
+        }
+    }
+
+    // names too long to be stored are not found
+    memset(path, 'x', sizeof(path));
+    path[0] = '/';
+    path[MAX_FILE_NAME + 1] = '\0';
+    assert(tfs_open(path, TFS_O_CREAT) == -1);
+    assert(!exists(path));
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    check_names(true);
+    check_names(false);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
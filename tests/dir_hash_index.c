@@ -0,0 +1,73 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define MAX_NAMES 64
+#define ROUNDS 500
+
+void name_path(char *path, int generation, int i) {
+    snprintf(path, 32, "/d/name%d_%d", generation, i);
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+    assert(tfs_mkdir("/d") != -1);
+
+    // fill the inode table up, in a single directory
+    char path[32];
+    int count = 0;
+    int generation[MAX_NAMES];
+    for (; count < MAX_NAMES; count++) {
+        name_path(path, 0, count);
+        int f = tfs_open(path, TFS_O_CREAT);
+        if (f == -1) {
+            break;
+        }
+        assert(tfs_close(f) != -1);
+        generation[count] = 0;
+    }
+    assert(count > 1 && count < MAX_NAMES);
+
+    // names come and go, leaving removed entries all over the index, while
+    // every name stays found (or not) as it should
+    for (int r = 1; r <= ROUNDS; r++) {
+        int i = (r * 7) % count;
+        name_path(path, generation[i], i);
+        assert(tfs_unlink(path) != -1);
+        assert(tfs_open(path, 0) == -1);
+
+        generation[i] = r;
+        name_path(path, generation[i], i);
+        assert(tfs_open(path, 0) == -1);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+
+        // the inode table is full again
+        name_path(path, r, count);
+        assert(tfs_open(path, TFS_O_CREAT) == -1);
+
+        for (int j = 0; j < count; j++) {
+            name_path(path, generation[j], j);
+            f = tfs_open(path, 0);
+            assert(f != -1);
+            assert(tfs_close(f) != -1);
+            name_path(path, generation[j] + 1, j);
+            assert(tfs_open(path, 0) == -1);
+        }
+    }
+
+    // emptied, the directory is removed
+    for (int i = 0; i < count; i++) {
+        name_path(path, generation[i], i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_rmdir("/d") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,149 @@
+#include "fs/config.h"
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LIVE_NAMES 8
+#define ROUNDS (2 * 2040) // names repeat every 2040 rounds
+#define PATH_SIZE (2 * MAX_FILE_NAME + 8) // room for two long names
+
+// /<dir>/<i>xxx..., a name of the given length (at least that of the number)
+void name_path(char *path, char const *dir, int i, size_t length) {
+    int n = snprintf(path, PATH_SIZE, "%s/%d", dir, i);
+    size_t start = strlen(dir) + 1;
+    memset(path + n, 'x', length - ((size_t)n - start));
+    path[start + length] = '\0';
+}
+
+void create(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+}
+
+bool exists(char const *path) {
+    int f = tfs_open(path, 0);
+    if (f == -1) {
+        return false;
+    }
+    assert(tfs_close(f) != -1);
+    return true;
+}
+
+size_t free_blocks(void) {
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    return stats.free_block_count;
+}
+
+// blocks too small for the longest names hold shorter ones
+void check_small_blocks(void) {
+    tfs_params params = tfs_default_params();
+    params.block_size = 75; // not even a single directory entry
+    assert(tfs_init(&params) == -1);
+
+    struct {
+        size_t block_size;
+        size_t longest; // name
+    } cases[] = {{76, 16}, {256, 112}, {496, MAX_FILE_NAME - 1}};
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        params.block_size = cases[c].block_size;
+        assert(tfs_init(&params) != -1);
+        char path[PATH_SIZE];
+        for (int i = 0; i < 8; i++) {
+            name_path(path, "", i, cases[c].longest);
+            create(path);
+        }
+        for (int i = 0; i < 8; i++) {
+            name_path(path, "", i, cases[c].longest);
+            assert(exists(path));
+        }
+        if (cases[c].longest < MAX_FILE_NAME - 1) {
+            name_path(path, "", 0, cases[c].longest + 1);
+            assert(tfs_open(path, TFS_O_CREAT) == -1);
+            assert(!exists(path));
+        }
+        assert(tfs_destroy() != -1);
+    }
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 2 * MAX_FILE_NAME;
+    params.max_block_count = 4096;
+    assert(tfs_init(&params) != -1);
+
+    // a name of every length, up to the longest
+    char path[PATH_SIZE];
+    assert(tfs_mkdir("/d") != -1);
+    for (size_t length = 3; length < MAX_FILE_NAME; length++) {
+        name_path(path, "/d", (int)length, length);
+        create(path);
+    }
+    for (size_t length = 3; length < MAX_FILE_NAME; length++) {
+        name_path(path, "/d", (int)length, length);
+        assert(exists(path));
+        if (length < MAX_FILE_NAME - 1) {
+            name_path(path, "/d", (int)length, length + 1);
+            assert(!exists(path));
+        }
+    }
+    name_path(path, "/d", MAX_FILE_NAME, MAX_FILE_NAME);
+    assert(tfs_open(path, TFS_O_CREAT) == -1); // too long
+    assert(!exists(path));
+
+    // long names along a path, and in snapshots
+    char dir[PATH_SIZE];
+    name_path(dir, "", 1, MAX_FILE_NAME - 1);
+    assert(tfs_mkdir(dir) != -1);
+    name_path(path, dir, 2, MAX_FILE_NAME - 1);
+    create(path);
+    int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    assert(tfs_unlink(path) != -1);
+    assert(!exists(path));
+    int f = tfs_snapshot_open(snapshot, path);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(tfs_rmdir(dir) != -1);
+
+    // links to long names (targets of symbolic links stay short)
+    name_path(path, "/d", 200, 200);
+    assert(tfs_link(path, "/hard") != -1);
+    assert(exists("/hard"));
+    assert(tfs_sym_link(path, "/soft") == -1);
+
+    // names of changing lengths come and go in a directory, which stops
+    // taking more blocks once the space of removed names is reused (by the
+    // time every name has come once)
+    assert(tfs_mkdir("/r") != -1);
+    size_t lengths[LIVE_NAMES] = {0};
+    size_t settled = 0;
+    for (int r = 0; r < ROUNDS; r++) {
+        int i = r % LIVE_NAMES;
+        if (lengths[i] != 0) {
+            name_path(path, "/r", i, lengths[i]);
+            assert(tfs_unlink(path) != -1);
+        }
+        lengths[i] = 1 + (size_t)(r * 37) % (MAX_FILE_NAME - 1);
+        name_path(path, "/r", i, lengths[i]);
+        create(path);
+        if (r == ROUNDS / 2) {
+            settled = free_blocks();
+        }
+    }
+    assert(free_blocks() == settled);
+    for (int i = 0; i < LIVE_NAMES; i++) {
+        name_path(path, "/r", i, lengths[i]);
+        assert(exists(path));
+    }
+
+    assert(tfs_destroy() != -1);
+
+    check_small_blocks();
+
+    printf("Successful test.\n");
+
+    return 0;
+}
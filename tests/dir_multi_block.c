@@ -0,0 +1,131 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_COUNT 3000
+#define STABLE_FILES 8
+#define READERS 3
+
+atomic_bool creating;
+
+void name_path(char *path, char const *dir, int i) {
+    snprintf(path, 32, "%s/file%d", dir, i);
+}
+
+void create(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+}
+
+size_t free_blocks(void) {
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    return stats.free_block_count;
+}
+
+bool exists(char const *path) {
+    int f = tfs_open(path, 0);
+    if (f == -1) {
+        return false;
+    }
+    assert(tfs_close(f) != -1);
+    return true;
+}
+
+void *thread_read(void *arg) {
+    int id = *(int *)arg;
+    char path[32];
+
+    // names already there are always found while the directory grows
+    for (int r = 0; atomic_load(&creating); r++) {
+        name_path(path, "/d", (r + id) % STABLE_FILES);
+        assert(exists(path));
+    }
+    return NULL;
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = 2 * FILE_COUNT;
+    params.max_block_count = 4096;
+    params.max_open_files_count = 2 * READERS + 2;
+    params.block_magazine_size = 0; // so that free blocks are counted exactly
+    assert(tfs_init(&params) != -1);
+
+    // many more files than fit in a block of entries, in the root directory,
+    // which only ever grows by the block that is full (and an indirect one)
+    char path[32];
+    size_t free = free_blocks();
+    for (int i = 0; i < FILE_COUNT; i++) {
+        name_path(path, "", i);
+        create(path);
+        size_t now = free_blocks();
+        assert(free - now <= 2);
+        free = now;
+    }
+    for (int i = 0; i < FILE_COUNT; i++) {
+        name_path(path, "", i);
+        assert(exists(path));
+    }
+    name_path(path, "", FILE_COUNT);
+    assert(!exists(path));
+
+    // every other one is removed, before and after a snapshot
+    int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    for (int i = 0; i < FILE_COUNT; i += 2) {
+        name_path(path, "", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    for (int i = 0; i < FILE_COUNT; i++) {
+        name_path(path, "", i);
+        assert(exists(path) == (i % 2 == 1));
+        int f = tfs_snapshot_open(snapshot, path);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    for (int i = 1; i < FILE_COUNT; i += 2) {
+        name_path(path, "", i);
+        assert(tfs_unlink(path) != -1);
+    }
+
+    // a subdirectory grows while its first files are looked up
+    assert(tfs_mkdir("/d") != -1);
+    for (int i = 0; i < STABLE_FILES; i++) {
+        name_path(path, "/d", i);
+        create(path);
+    }
+    atomic_store(&creating, true);
+    pthread_t threads[READERS];
+    int ids[READERS];
+    for (int i = 0; i < READERS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, thread_read, &ids[i]) == 0);
+    }
+    for (int i = STABLE_FILES; i < FILE_COUNT / 2; i++) {
+        name_path(path, "/d", i);
+        create(path);
+    }
+    atomic_store(&creating, false);
+    for (int i = 0; i < READERS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // only once emptied, the directory is removed
+    assert(tfs_rmdir("/d") == -1);
+    for (int i = 0; i < FILE_COUNT / 2; i++) {
+        name_path(path, "/d", i);
+        assert(tfs_unlink(path) != -1);
+    }
+    assert(tfs_rmdir("/d") != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
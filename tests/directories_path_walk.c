@@ -0,0 +1,121 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREADS 4
+#define ROUNDS 50
+
+void write_file(char const *path, char const *contents) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, strlen(contents)) ==
+           (ssize_t)strlen(contents));
+    assert(tfs_close(f) != -1);
+}
+
+void check_file(char const *path, char const *contents) {
+    char buffer[64];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)strlen(contents));
+    assert(memcmp(buffer, contents, strlen(contents)) == 0);
+    assert(tfs_close(f) != -1);
+}
+
+void *thread_own_dir(void *arg) {
+    int id = *(int *)arg;
+    char dir[16], sub[32], path[48];
+    snprintf(dir, sizeof(dir), "/t%d", id);
+    snprintf(sub, sizeof(sub), "%s/sub", dir);
+    snprintf(path, sizeof(path), "%s/f", sub);
+
+    // every thread builds and tears down its own tree under the root
+    for (int r = 0; r < ROUNDS; r++) {
+        assert(tfs_mkdir(dir) != -1);
+        assert(tfs_mkdir(sub) != -1);
+        write_file(path, dir);
+        check_file(path, dir);
+        assert(tfs_rmdir(sub) == -1);
+        assert(tfs_unlink(path) != -1);
+        assert(tfs_rmdir(sub) != -1);
+        assert(tfs_rmdir(dir) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    // files in nested directories
+    assert(tfs_mkdir("/a") != -1);
+    assert(tfs_mkdir("/a") == -1);
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_mkdir("/x/y") == -1); // no parent
+    write_file("/a/b/f", "nested");
+    write_file("/a/f", "shallow");
+    check_file("/a/b/f", "nested");
+    check_file("/a/f", "shallow");
+    assert(tfs_open("/a/b/g", 0) == -1);
+    assert(tfs_open("/a/f/g", TFS_O_CREAT) == -1); // not a directory
+    assert(tfs_open("/a/", TFS_O_CREAT) == -1);
+    assert(tfs_open("/a//f", 0) == -1);
+
+    // directories are neither opened nor unlinked
+    assert(tfs_open("/a", 0) == -1);
+    assert(tfs_unlink("/a/b") == -1);
+    assert(tfs_rmdir("/a/f") == -1);
+
+    // links across directories
+    assert(tfs_link("/a/b/f", "/hard") != -1);
+    assert(tfs_sym_link("/a/f", "/a/b/soft") != -1);
+    assert(tfs_link("/a/b", "/a/dirlink") == -1);
+    check_file("/hard", "nested");
+    check_file("/a/b/soft", "shallow");
+    assert(tfs_clone("/a/f", "/a/b/clone") != -1);
+    assert(tfs_clone("/a/f", "/a/b/clone") == -1);
+    assert(tfs_clone("/a/f", "/nope/clone") == -1);
+    check_file("/a/b/clone", "shallow");
+
+    // only empty directories are removed
+    assert(tfs_rmdir("/a/b") == -1);
+    assert(tfs_unlink("/a/b/f") != -1);
+    check_file("/hard", "nested");
+    assert(tfs_unlink("/a/b/soft") != -1);
+    assert(tfs_unlink("/a/b/clone") != -1);
+    assert(tfs_rmdir("/a/b") != -1);
+    assert(tfs_open("/a/b/f", 0) == -1);
+    assert(tfs_mkdir("/a/b") != -1);
+    assert(tfs_open("/a/b/f", 0) == -1);
+
+    // snapshots keep directories that are removed afterwards
+    write_file("/a/b/f", "before");
+    int snapshot = tfs_snapshot_create();
+    assert(snapshot != -1);
+    assert(tfs_unlink("/a/b/f") != -1);
+    assert(tfs_rmdir("/a/b") != -1);
+    int f = tfs_snapshot_open(snapshot, "/a/b/f");
+    assert(f != -1);
+    char buffer[16];
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 6);
+    assert(memcmp(buffer, "before", 6) == 0);
+    assert(tfs_close(f) != -1);
+
+    pthread_t threads[THREADS];
+    int ids[THREADS];
+    for (int i = 0; i < THREADS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, thread_own_dir, &ids[i]) ==
+               0);
+    }
+    for (int i = 0; i < THREADS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
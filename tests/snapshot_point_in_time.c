@@ -0,0 +1,203 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define FILE_SIZE (20 * BLOCK_SIZE + 10)
+#define WRITERS (3)
+#define WRITE_SIZE (2 * BLOCK_SIZE)
+#define BUSY_SNAPSHOTS (6)
+
+atomic_bool running;
+
+uint8_t pattern_byte(size_t i) { return (uint8_t)(i * 31 + i / BLOCK_SIZE); }
+
+size_t free_blocks(void) {
+    tfs_stats_t stats;
+    assert(tfs_stats(&stats) != -1);
+    return stats.free_block_count;
+}
+
+void write_file(char const *path, void const *contents, size_t size) {
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_write(f, contents, size) == (ssize_t)size);
+    assert(tfs_close(f) != -1);
+}
+
+void write_at(char const *path, size_t offset, char const *text) {
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_lseek(f, (off_t)offset, SEEK_SET) == (off_t)offset);
+    assert(tfs_write(f, text, strlen(text)) == (ssize_t)strlen(text));
+    assert(tfs_close(f) != -1);
+}
+
+void check_fd(int f, void const *contents, size_t size) {
+    uint8_t *buffer = malloc(size + 1);
+    assert(buffer != NULL);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, size + 1) == (ssize_t)size);
+    assert(memcmp(buffer, contents, size) == 0);
+    assert(tfs_close(f) != -1);
+    free(buffer);
+}
+
+void writer_path(char *path, int writer) {
+    snprintf(path, 16, "/w%d", writer);
+}
+
+void *thread_write(void *arg) {
+    char path[16];
+    writer_path(path, *(int *)arg);
+    uint8_t buffer[WRITE_SIZE];
+    for (int r = 0; atomic_load(&running); r++) {
+        memset(buffer, r, sizeof(buffer));
+        write_file(path, buffer, sizeof(buffer));
+    }
+    return NULL;
+}
+
+// snapshots are created, without waiting, while other threads keep the
+// files locked most of the time, and each sees every file between two writes
+void check_busy_writers(void) {
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 512;
+    params.max_snapshot_count = BUSY_SNAPSHOTS;
+    assert(tfs_init(&params) != -1);
+
+    atomic_store(&running, true);
+    pthread_t writers[WRITERS];
+    int ids[WRITERS];
+    for (int i = 0; i < WRITERS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&writers[i], NULL, thread_write, &ids[i]) == 0);
+    }
+    int snapshots[BUSY_SNAPSHOTS];
+    for (int k = 0; k < BUSY_SNAPSHOTS; k++) {
+        snapshots[k] = tfs_snapshot_create();
+        assert(snapshots[k] == k);
+    }
+    atomic_store(&running, false);
+    for (int i = 0; i < WRITERS; i++) {
+        assert(pthread_join(writers[i], NULL) == 0);
+    }
+
+    for (int k = 0; k < BUSY_SNAPSHOTS; k++) {
+        for (int i = 0; i < WRITERS; i++) {
+            char path[16];
+            writer_path(path, i);
+            int f = tfs_snapshot_open(snapshots[k], path);
+            if (f == -1) {
+                continue; // not created yet
+            }
+            uint8_t buffer[WRITE_SIZE + 1];
+            ssize_t size = tfs_read(f, buffer, sizeof(buffer));
+            assert(size == 0 || size == WRITE_SIZE); // truncated, or written
+            for (ssize_t j = 1; j < size; j++) {
+                assert(buffer[j] == buffer[0]);
+            }
+            assert(tfs_close(f) != -1);
+        }
+    }
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    uint8_t *contents = malloc(FILE_SIZE);
+    uint8_t *first = malloc(FILE_SIZE);
+    uint8_t *second = malloc(FILE_SIZE);
+    assert(contents != NULL && first != NULL && second != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = pattern_byte(i);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.block_size = BLOCK_SIZE;
+    params.max_block_count = 256;
+    params.max_snapshot_count = 3;
+    assert(tfs_init(&params) != -1);
+    size_t initial = free_blocks();
+
+    write_file("/a", contents, FILE_SIZE);
+    write_file("/small", "small file", 10);
+    write_file("/gone", contents, 2 * BLOCK_SIZE);
+    assert(tfs_sym_link("/a", "/link") != -1);
+
+    // creating a snapshot copies nothing
+    size_t before = free_blocks();
+    int s0 = tfs_snapshot_create();
+    assert(s0 == 0);
+    assert(free_blocks() == before);
+
+    // changes after the snapshot
+    write_at("/a", 5 * BLOCK_SIZE + 1, "changed");
+    memcpy(first, contents, FILE_SIZE);
+    memcpy(first + 5 * BLOCK_SIZE + 1, "changed", 7);
+    int f = tfs_open("/small", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, " grown", 6) == 6);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink("/gone") != -1);
+    write_file("/new", "new", 3);
+
+    // the live file system sees them
+    check_fd(tfs_open("/a", 0), first, FILE_SIZE);
+    check_fd(tfs_open("/small", 0), "small file grown", 16);
+    assert(tfs_open("/gone", 0) == -1);
+
+    // the snapshot does not
+    check_fd(tfs_snapshot_open(s0, "/a"), contents, FILE_SIZE);
+    check_fd(tfs_snapshot_open(s0, "/link"), contents, FILE_SIZE);
+    check_fd(tfs_snapshot_open(s0, "/small"), "small file", 10);
+    check_fd(tfs_snapshot_open(s0, "/gone"), contents, 2 * BLOCK_SIZE);
+    assert(tfs_snapshot_open(s0, "/new") == -1);
+
+    // files of snapshots are read-only
+    f = tfs_snapshot_open(s0, "/a");
+    assert(f != -1);
+    assert(tfs_write(f, "x", 1) == -1);
+    assert(tfs_lseek(f, 0, SEEK_END) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // each snapshot keeps its own point in time
+    int s1 = tfs_snapshot_create();
+    assert(s1 == 1);
+    write_at("/a", 0, "again");
+    memcpy(second, first, FILE_SIZE);
+    memcpy(second, "again", 5);
+    check_fd(tfs_open("/a", 0), second, FILE_SIZE);
+    check_fd(tfs_snapshot_open(s1, "/a"), first, FILE_SIZE);
+    check_fd(tfs_snapshot_open(s0, "/a"), contents, FILE_SIZE);
+    check_fd(tfs_snapshot_open(s1, "/new"), "new", 3);
+
+    // the blocks of deleted files stay with the snapshots
+    assert(tfs_unlink("/a") != -1);
+    assert(tfs_unlink("/small") != -1);
+    assert(tfs_unlink("/new") != -1);
+    assert(free_blocks() < initial);
+    check_fd(tfs_snapshot_open(s0, "/a"), contents, FILE_SIZE);
+    check_fd(tfs_snapshot_open(s1, "/a"), first, FILE_SIZE);
+
+    // errors
+    assert(tfs_snapshot_open(5, "/a") == -1);
+    assert(tfs_snapshot_open(-1, "/a") == -1);
+    assert(tfs_snapshot_create() == 2);
+    assert(tfs_snapshot_create() == -1);
+
+    assert(tfs_destroy() != -1);
+    check_busy_writers();
+    free(contents);
+    free(first);
+    free(second);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,121 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define BLOCK_COUNT (8)
+// far more blocks than the file system has
+#define FAR_OFFSET (100 * BLOCK_SIZE + 10)
+
+char const path[] = "/f1";
+
+/*
+ * Checks that a file has the given size, with the given text at offset and
+ * zeros everywhere else.
+ */
+void check_sparse(char const *name, size_t size, size_t offset,
+                  char const *text) {
+    char *buffer = malloc(size + 1);
+    assert(buffer != NULL);
+
+    int f = tfs_open(name, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, size + 1) == (ssize_t)size);
+    assert(tfs_close(f) != -1);
+
+    for (size_t i = 0; i < size; i++) {
+        if (i >= offset && i < offset + strlen(text)) {
+            assert(buffer[i] == text[i - offset]);
+        } else {
+            assert(buffer[i] == 0);
+        }
+    }
+    free(buffer);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    // writing far into an empty file only takes the written block (and an
+    // indirect block to map it)
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_lseek(f, FAR_OFFSET, SEEK_SET) == FAR_OFFSET);
+    assert(tfs_write(f, "hello", 5) == 5);
+    assert(tfs_lseek(f, 0, SEEK_CUR) == FAR_OFFSET + 5);
+    assert(tfs_lseek(f, 0, SEEK_END) == FAR_OFFSET + 5);
+    assert(tfs_close(f) != -1);
+    check_sparse(path, FAR_OFFSET + 5, FAR_OFFSET, "hello");
+
+    // invalid offsets and whence values leave the offset alone
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_lseek(f, -1, SEEK_SET) == -1);
+    assert(tfs_lseek(f, -FAR_OFFSET - 6, SEEK_END) == -1);
+    assert(tfs_lseek(f, 0, 42) == -1);
+    assert(tfs_lseek(f, -5, SEEK_END) == FAR_OFFSET);
+    char buffer[8] = {0};
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 5);
+    assert(strcmp(buffer, "hello") == 0);
+
+    // reading past the end of the file reads nothing
+    assert(tfs_lseek(f, 10, SEEK_END) == FAR_OFFSET + 15);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == 0);
+
+    // writing inside a hole only fills in the written bytes
+    assert(tfs_lseek(f, 50 * BLOCK_SIZE + 100, SEEK_SET) ==
+           50 * BLOCK_SIZE + 100);
+    assert(tfs_write(f, "world", 5) == 5);
+    assert(tfs_close(f) != -1);
+    char *contents = malloc(FAR_OFFSET + 5);
+    assert(contents != NULL);
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, contents, FAR_OFFSET + 5) == FAR_OFFSET + 5);
+    assert(tfs_close(f) != -1);
+    for (size_t i = 0; i < FAR_OFFSET + 5; i++) {
+        if (i >= 50 * BLOCK_SIZE + 100 && i < 50 * BLOCK_SIZE + 105) {
+            assert(contents[i] == "world"[i - (50 * BLOCK_SIZE + 100)]);
+        } else if (i >= FAR_OFFSET) {
+            assert(contents[i] == "hello"[i - FAR_OFFSET]);
+        } else {
+            assert(contents[i] == 0);
+        }
+    }
+    free(contents);
+
+    // holes in small files, kept when the file moves to blocks of its own
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_lseek(f, 50, SEEK_SET) == 50);
+    assert(tfs_write(f, "small", 5) == 5);
+    assert(tfs_close(f) != -1);
+    check_sparse("/f2", 55, 50, "small");
+    f = tfs_open("/f2", 0);
+    assert(f != -1);
+    assert(tfs_lseek(f, 3 * BLOCK_SIZE, SEEK_SET) == 3 * BLOCK_SIZE);
+    assert(tfs_write(f, "x", 1) == 1);
+    assert(tfs_close(f) != -1);
+    contents = malloc(3 * BLOCK_SIZE + 1);
+    assert(contents != NULL);
+    f = tfs_open("/f2", 0);
+    assert(f != -1);
+    assert(tfs_read(f, contents, 3 * BLOCK_SIZE + 1) == 3 * BLOCK_SIZE + 1);
+    assert(tfs_close(f) != -1);
+    for (size_t i = 0; i < 3 * BLOCK_SIZE + 1; i++) {
+        char expected = i >= 50 && i < 55 ? "small"[i - 50] : 0;
+        assert(contents[i] == (i == 3 * BLOCK_SIZE ? 'x' : expected));
+    }
+    free(contents);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
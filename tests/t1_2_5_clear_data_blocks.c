@@ -5,7 +5,8 @@
 #include <stdio.h>
 #include <string.h>
 
-uint8_t const file_contents[] = "AAA!";
+// a whole block, so that the contents are not stored inline in the inode
+uint8_t file_contents[1024];
 char const target_path1[] = "/f1";
 char const target_path2[] = "/f2";
 char const target_path3[] = "/f3";
@@ -34,6 +35,7 @@ void write_contents(char const *path) {
 }
 
 int main() {
+    memset(file_contents, 'A', sizeof(file_contents));
 
     // init TécnicoFS
     tfs_params params = tfs_default_params();
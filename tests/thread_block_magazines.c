@@ -0,0 +1,97 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT 8
+#define ROUNDS 20
+#define BLOCK_COUNT 256
+#define BLOCK_SIZE 1024
+#define CHUNK_SIZE 300
+#define CHUNK_COUNT 12
+
+pthread_barrier_t work_done, check_done;
+
+void *thread_work(void *arg) {
+    int id = *(int *)arg;
+    char path[16], buffer[CHUNK_SIZE], read_buffer[CHUNK_SIZE];
+    snprintf(path, sizeof(path), "/t%d", id);
+    memset(buffer, 'a' + id, sizeof(buffer));
+
+    // allocate and free blocks, which end up cached in this thread
+    for (int r = 0; r < ROUNDS; r++) {
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        for (int c = 0; c < CHUNK_COUNT; c++) {
+            assert(tfs_write(f, buffer, CHUNK_SIZE) == CHUNK_SIZE);
+        }
+        assert(tfs_close(f) != -1);
+
+        f = tfs_open(path, 0);
+        assert(f != -1);
+        for (int c = 0; c < CHUNK_COUNT; c++) {
+            assert(tfs_read(f, read_buffer, CHUNK_SIZE) == CHUNK_SIZE);
+            assert(memcmp(read_buffer, buffer, CHUNK_SIZE) == 0);
+        }
+        assert(tfs_close(f) != -1);
+        assert(tfs_unlink(path) != -1);
+    }
+
+    // stay alive (holding on to the cached blocks) while the main thread
+    // checks every block can still be allocated
+    pthread_barrier_wait(&work_done);
+    pthread_barrier_wait(&check_done);
+    return NULL;
+}
+
+void fill_filesystem(char const *path) {
+    static char buffer[BLOCK_COUNT * BLOCK_SIZE];
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+    assert(f != -1);
+    // every block except the root directory's (and an indirect block, if
+    // blocks freed by other threads left the free space in too many runs
+    // for the inode's extents)
+    ssize_t written = tfs_write(f, buffer, sizeof(buffer));
+    assert(written >= (BLOCK_COUNT - 2) * BLOCK_SIZE &&
+           written <= (BLOCK_COUNT - 1) * BLOCK_SIZE);
+    assert(tfs_close(f) != -1);
+    assert(tfs_unlink(path) != -1);
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_block_count = BLOCK_COUNT;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    assert(pthread_barrier_init(&work_done, NULL, THREAD_COUNT + 1) == 0);
+    assert(pthread_barrier_init(&check_done, NULL, THREAD_COUNT + 1) == 0);
+
+    pthread_t threads[THREAD_COUNT];
+    int ids[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, thread_work, &ids[i]) == 0);
+    }
+
+    // blocks cached by other threads are reclaimed when needed
+    pthread_barrier_wait(&work_done);
+    fill_filesystem("/full1");
+    pthread_barrier_wait(&check_done);
+
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    // and returned when those threads exit
+    fill_filesystem("/full2");
+
+    assert(pthread_barrier_destroy(&work_done) == 0);
+    assert(pthread_barrier_destroy(&check_done) == 0);
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
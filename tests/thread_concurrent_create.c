@@ -0,0 +1,81 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define THREAD_COUNT 4
+#define FILES_PER_THREAD 5
+#define INODE_COUNT 16
+#define ROUNDS 10
+
+atomic_int created;
+
+void *thread_create(void *arg) {
+    int id = *(int *)arg;
+    char path[16] = {0};
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        snprintf(path, sizeof(path), "/t%d_%d", id, i);
+        int f = tfs_open(path, TFS_O_CREAT);
+        if (f == -1) {
+            continue; // inode table full
+        }
+        atomic_fetch_add(&created, 1);
+        assert(tfs_write(f, path, sizeof(path)) == sizeof(path));
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+void *thread_check_and_unlink(void *arg) {
+    int id = *(int *)arg;
+    char path[16] = {0}, buffer[16];
+
+    for (int i = 0; i < FILES_PER_THREAD; i++) {
+        snprintf(path, sizeof(path), "/t%d_%d", id, i);
+        int f = tfs_open(path, 0);
+        if (f == -1) {
+            continue; // was not created
+        }
+        // no two files share an inode
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, path, sizeof(path)) == 0);
+        assert(tfs_close(f) != -1);
+        assert(tfs_unlink(path) != -1);
+    }
+    return NULL;
+}
+
+void run_threads(void *(*routine)(void *)) {
+    pthread_t threads[THREAD_COUNT];
+    int ids[THREAD_COUNT];
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL, routine, &ids[i]) == 0);
+    }
+    for (int i = 0; i < THREAD_COUNT; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+}
+
+int main() {
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = INODE_COUNT;
+    assert(tfs_init(&params) != -1);
+
+    for (int r = 0; r < ROUNDS; r++) {
+        atomic_store(&created, 0);
+        run_threads(thread_create);
+        // every inode but the root directory's was taken exactly once
+        assert(atomic_load(&created) == INODE_COUNT - 1);
+        run_threads(thread_check_and_unlink);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
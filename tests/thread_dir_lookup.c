@@ -0,0 +1,94 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define STABLE_FILES 5
+#define CHURNERS 2
+#define CHURN_FILES 8
+#define OPENERS 4
+#define ROUNDS 200
+
+void stable_path(char *path, int i) { snprintf(path, 16, "/stable%d", i); }
+
+void churn_path(char *path, int id, int i) {
+    snprintf(path, 16, "/churn%d_%d", id, i);
+}
+
+void write_name(char const *path) {
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, path, 16) == 16);
+    assert(tfs_close(f) != -1);
+}
+
+void *thread_churn(void *arg) {
+    int id = *(int *)arg;
+    char path[16] = {0};
+
+    // entries are cleared and reused over and over while being looked up
+    for (int r = 0; r < ROUNDS / 10; r++) {
+        for (int i = 0; i < CHURN_FILES; i++) {
+            churn_path(path, id, i);
+            write_name(path);
+        }
+        for (int i = 0; i < CHURN_FILES; i++) {
+            churn_path(path, id, i);
+            assert(tfs_unlink(path) != -1);
+        }
+    }
+    return NULL;
+}
+
+void *thread_open(void *arg) {
+    int id = *(int *)arg;
+    char path[16] = {0}, buffer[16];
+
+    for (int r = 0; r < ROUNDS; r++) {
+        // files that are not touched are always found
+        stable_path(path, (r + id) % STABLE_FILES);
+        int f = tfs_open(path, 0);
+        assert(f != -1);
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(memcmp(buffer, path, sizeof(path)) == 0);
+        assert(tfs_close(f) != -1);
+
+        // files that come and go may or may not be found (once open, they
+        // may be unlinked and their inodes reused, so they are not read)
+        churn_path(path, r % CHURNERS, (r + id) % CHURN_FILES);
+        f = tfs_open(path, 0);
+        if (f != -1) {
+            assert(tfs_close(f) != -1);
+        }
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    char path[16] = {0};
+    for (int i = 0; i < STABLE_FILES; i++) {
+        stable_path(path, i);
+        write_name(path);
+    }
+
+    pthread_t threads[CHURNERS + OPENERS];
+    int ids[CHURNERS + OPENERS];
+    for (int i = 0; i < CHURNERS + OPENERS; i++) {
+        ids[i] = i < CHURNERS ? i : i - CHURNERS;
+        assert(pthread_create(&threads[i], NULL,
+                              i < CHURNERS ? thread_churn : thread_open,
+                              &ids[i]) == 0);
+    }
+    for (int i = 0; i < CHURNERS + OPENERS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
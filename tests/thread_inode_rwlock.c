@@ -0,0 +1,75 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WRITERS 4
+#define READERS 4
+#define FILE_COUNT 3
+#define FILE_SIZE (3000)
+#define ROUNDS 200
+
+char const *paths[FILE_COUNT] = {"/f0", "/f1", "/f2"};
+
+void *thread_write(void *arg) {
+    int id = *(int *)arg;
+    char buffer[FILE_SIZE];
+    memset(buffer, 'a' + id, sizeof(buffer));
+
+    for (int r = 0; r < ROUNDS; r++) {
+        int f = tfs_open(paths[(r + id) % FILE_COUNT], 0);
+        assert(f != -1);
+        assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+void *thread_read(void *arg) {
+    int id = *(int *)arg;
+    char buffer[FILE_SIZE];
+
+    for (int r = 0; r < ROUNDS; r++) {
+        int f = tfs_open(paths[(r + id) % FILE_COUNT], 0);
+        assert(f != -1);
+        // writes hold the file's lock, so they are never seen half done
+        assert(tfs_read(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        for (size_t i = 1; i < sizeof(buffer); i++) {
+            assert(buffer[i] == buffer[0]);
+        }
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+int main() {
+    assert(tfs_init(NULL) != -1);
+
+    char buffer[FILE_SIZE];
+    memset(buffer, 'z', sizeof(buffer));
+    for (int i = 0; i < FILE_COUNT; i++) {
+        int f = tfs_open(paths[i], TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, buffer, sizeof(buffer)) == sizeof(buffer));
+        assert(tfs_close(f) != -1);
+    }
+
+    pthread_t threads[WRITERS + READERS];
+    int ids[WRITERS + READERS];
+    for (int i = 0; i < WRITERS + READERS; i++) {
+        ids[i] = i;
+        assert(pthread_create(&threads[i], NULL,
+                              i < WRITERS ? thread_write : thread_read,
+                              &ids[i]) == 0);
+    }
+    for (int i = 0; i < WRITERS + READERS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,102 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define WRITERS 2
+#define READERS 4
+#define MAX_SIZE (40 * 1024)
+#define ROUNDS 300
+
+char const *paths[WRITERS] = {"/f0", "/f1"};
+char buffers[READERS][MAX_SIZE + 1];
+atomic_bool running;
+
+void *thread_write(void *arg) {
+    int id = *(int *)arg;
+    static char contents[WRITERS][MAX_SIZE];
+
+    for (int r = 0; r < ROUNDS; r++) {
+        // the blocks freed by the truncation are reused by the other writer,
+        // while readers may still be copying them
+        size_t size = (size_t)(r * 7919) % MAX_SIZE;
+        memset(contents[id], 'a' + r % 26, size);
+        int f = tfs_open(paths[id], TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, contents[id], size) == (ssize_t)size);
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+void *thread_read(void *arg) {
+    int id = *(int *)arg;
+    char *buffer = buffers[id];
+
+    for (int r = 0; r < ROUNDS; r++) {
+        int f = tfs_open(paths[(r + id) % WRITERS], 0);
+        assert(f != -1);
+        // each read sees the file between two writes
+        ssize_t read = tfs_read(f, buffer, MAX_SIZE + 1);
+        assert(read >= 0 && read <= MAX_SIZE);
+        for (ssize_t i = 1; i < read; i++) {
+            assert(buffer[i] == buffer[0]);
+        }
+        assert(tfs_close(f) != -1);
+    }
+    return NULL;
+}
+
+void *thread_compress(void *arg) {
+    (void)arg;
+    // blocks are compressed under readers that copy them without locks
+    while (atomic_load(&running)) {
+        tfs_compress_cold();
+    }
+    return NULL;
+}
+
+void check_readers(bool compress) {
+    tfs_params params = tfs_default_params();
+    params.compress_blocks = compress;
+    assert(tfs_init(&params) != -1);
+    for (int i = 0; i < WRITERS; i++) {
+        int f = tfs_open(paths[i], TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+
+    atomic_store(&running, true);
+    pthread_t compressor;
+    if (compress) {
+        assert(pthread_create(&compressor, NULL, thread_compress, NULL) == 0);
+    }
+    pthread_t threads[WRITERS + READERS];
+    int ids[WRITERS + READERS];
+    for (int i = 0; i < WRITERS + READERS; i++) {
+        ids[i] = i < WRITERS ? i : i - WRITERS;
+        assert(pthread_create(&threads[i], NULL,
+                              i < WRITERS ? thread_write : thread_read,
+                              &ids[i]) == 0);
+    }
+    for (int i = 0; i < WRITERS + READERS; i++) {
+        assert(pthread_join(threads[i], NULL) == 0);
+    }
+    atomic_store(&running, false);
+    if (compress) {
+        assert(pthread_join(compressor, NULL) == 0);
+    }
+
+    assert(tfs_destroy() != -1);
+}
+
+int main() {
+    check_readers(false);
+    check_readers(true);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
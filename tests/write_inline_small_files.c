@@ -0,0 +1,96 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_COUNT (15)
+#define SMALL_SIZE (100)
+#define LARGE_SIZE (600)
+
+uint8_t file_byte(size_t file, size_t i) {
+    return (uint8_t)('a' + (file * 3 + i) % 26);
+}
+
+void check_contents(char const *path, size_t file, size_t size) {
+    uint8_t buffer[2 * LARGE_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)size);
+    for (size_t i = 0; i < size; i++) {
+        assert(buffer[i] == file_byte(file, i));
+    }
+    assert(tfs_close(f) != -1);
+}
+
+int main() {
+    uint8_t contents[FILE_COUNT][LARGE_SIZE];
+    for (size_t file = 0; file < FILE_COUNT; file++) {
+        for (size_t i = 0; i < sizeof(contents[file]); i++) {
+            contents[file][i] = file_byte(file, i);
+        }
+    }
+
+    // only the root directory's block and one more
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = FILE_COUNT + 1;
+    params.max_block_count = 2;
+    assert(tfs_init(&params) != -1);
+
+    // small files do not take data blocks
+    char path[16] = {0};
+    for (size_t file = 0; file < FILE_COUNT; file++) {
+        sprintf(path, "/f%zu", file);
+        int f = tfs_open(path, TFS_O_CREAT);
+        assert(f != -1);
+        assert(tfs_write(f, contents[file], SMALL_SIZE / 2) == SMALL_SIZE / 2);
+        assert(tfs_write(f, contents[file] + SMALL_SIZE / 2,
+                         SMALL_SIZE / 2) == SMALL_SIZE / 2);
+        assert(tfs_close(f) != -1);
+    }
+    for (size_t file = 0; file < FILE_COUNT; file++) {
+        sprintf(path, "/f%zu", file);
+        check_contents(path, file, SMALL_SIZE);
+    }
+
+    // files that grow a little share the only free block
+    for (size_t file = 0; file < 2; file++) {
+        sprintf(path, "/f%zu", file);
+        int f = tfs_open(path, TFS_O_APPEND);
+        assert(f != -1);
+        assert(tfs_write(f, contents[file] + SMALL_SIZE, SMALL_SIZE) ==
+               SMALL_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+    check_contents("/f0", 0, 2 * SMALL_SIZE);
+    check_contents("/f1", 1, 2 * SMALL_SIZE);
+
+    // others can no longer grow past their inode
+    int f = tfs_open("/f2", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, contents[2] + SMALL_SIZE, LARGE_SIZE - SMALL_SIZE) <
+           LARGE_SIZE - SMALL_SIZE);
+    assert(tfs_close(f) != -1);
+    check_contents("/f3", 3, SMALL_SIZE);
+
+    // truncating the grown files frees the block
+    for (size_t file = 0; file < 2; file++) {
+        sprintf(path, "/f%zu", file);
+        f = tfs_open(path, TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+        check_contents(path, file, 0);
+    }
+    f = tfs_open("/f3", TFS_O_APPEND);
+    assert(f != -1);
+    assert(tfs_write(f, contents[3] + SMALL_SIZE, LARGE_SIZE - SMALL_SIZE) ==
+           LARGE_SIZE - SMALL_SIZE);
+    assert(tfs_close(f) != -1);
+    check_contents("/f3", 3, LARGE_SIZE);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
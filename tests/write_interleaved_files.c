@@ -0,0 +1,73 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define FILE_COUNT 3
+#define CHUNK_SIZE 3000
+#define CHUNK_COUNT 40
+
+char const *paths[FILE_COUNT] = {"/f1", "/f2", "/f3"};
+
+uint8_t file_byte(int file, size_t i) {
+    return (uint8_t)((size_t)file * 7 + i % 251);
+}
+
+int main() {
+    uint8_t buffer[CHUNK_SIZE];
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 1024;
+    assert(tfs_init(&params) != -1);
+
+    int f[FILE_COUNT];
+    for (int i = 0; i < FILE_COUNT; i++) {
+        f[i] = tfs_open(paths[i], TFS_O_CREAT);
+        assert(f[i] != -1);
+    }
+
+    // interleaved writes prevent the files from growing contiguously, so
+    // their blocks end up spread over several extents and the block map
+    for (size_t c = 0; c < CHUNK_COUNT; c++) {
+        for (int i = 0; i < FILE_COUNT; i++) {
+            for (size_t j = 0; j < CHUNK_SIZE; j++) {
+                buffer[j] = file_byte(i, c * CHUNK_SIZE + j);
+            }
+            assert(tfs_write(f[i], buffer, CHUNK_SIZE) == CHUNK_SIZE);
+        }
+    }
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        assert(tfs_close(f[i]) != -1);
+    }
+
+    for (int i = 0; i < FILE_COUNT; i++) {
+        int fd = tfs_open(paths[i], 0);
+        assert(fd != -1);
+        for (size_t c = 0; c < CHUNK_COUNT; c++) {
+            assert(tfs_read(fd, buffer, CHUNK_SIZE) == CHUNK_SIZE);
+            for (size_t j = 0; j < CHUNK_SIZE; j++) {
+                assert(buffer[j] == file_byte(i, c * CHUNK_SIZE + j));
+            }
+        }
+        assert(tfs_read(fd, buffer, CHUNK_SIZE) == 0);
+        assert(tfs_close(fd) != -1);
+    }
+
+    // freeing the first file makes room for a large sequential one
+    assert(tfs_unlink(paths[0]) != -1);
+    int fd = tfs_open("/f4", TFS_O_CREAT);
+    assert(fd != -1);
+    for (size_t c = 0; c < CHUNK_COUNT; c++) {
+        memset(buffer, (int)c, CHUNK_SIZE);
+        assert(tfs_write(fd, buffer, CHUNK_SIZE) == CHUNK_SIZE);
+    }
+    assert(tfs_close(fd) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILE_SIZE (3 * 1024 * 1024 + 123)
+
+char const path[] = "/f1";
+
+uint8_t pattern_byte(size_t i) { return (uint8_t)(i * 31 + i / 1024); }
+
+int main() {
+    uint8_t *contents = malloc(FILE_SIZE);
+    uint8_t *buffer = malloc(FILE_SIZE);
+    assert(contents != NULL && buffer != NULL);
+    for (size_t i = 0; i < FILE_SIZE; i++) {
+        contents[i] = pattern_byte(i);
+    }
+
+    tfs_params params = tfs_default_params();
+    params.max_block_count = 4 * 1024;
+    assert(tfs_init(&params) != -1);
+
+    // a single write spanning direct, indirect and double-indirect blocks
+    int f = tfs_open(path, TFS_O_CREAT);
+    assert(f != -1);
+    assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    // a single read of the whole file
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, FILE_SIZE + 1) == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    // reads in strides that do not match the block size
+    f = tfs_open(path, 0);
+    assert(f != -1);
+    size_t offset = 0;
+    ssize_t r;
+    while ((r = tfs_read(f, buffer + offset, 1000)) > 0) {
+        offset += (size_t)r;
+    }
+    assert(r == 0);
+    assert(offset == FILE_SIZE);
+    assert(memcmp(buffer, contents, FILE_SIZE) == 0);
+    assert(tfs_close(f) != -1);
+
+    // truncating frees every block, so the file can be written again
+    for (int i = 0; i < 3; i++) {
+        f = tfs_open(path, TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_write(f, contents, FILE_SIZE) == FILE_SIZE);
+        assert(tfs_close(f) != -1);
+    }
+
+    // running out of blocks results in a short write
+    f = tfs_open("/f2", TFS_O_CREAT);
+    assert(f != -1);
+    r = tfs_write(f, contents, FILE_SIZE);
+    assert(r > 0 && r < FILE_SIZE);
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+    free(contents);
+    free(buffer);
+
+    printf("Successful test.\n");
+
+    return 0;
+}
@@ -0,0 +1,113 @@
+#include "fs/operations.h"
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define BLOCK_SIZE (1024)
+#define FILE_COUNT (15)
+#define FILE_SIZE (300)   // too large to be inline, three fit in a block
+#define GROWN_SIZE (400)  // still packed
+#define LARGE_SIZE (1000) // with a block of its own
+
+uint8_t file_byte(size_t file, size_t i) {
+    return (uint8_t)('a' + (file * 5 + i) % 26);
+}
+
+void check_contents(size_t file, size_t size) {
+    char path[16] = {0};
+    sprintf(path, "/f%zu", file);
+    uint8_t buffer[2 * LARGE_SIZE];
+    int f = tfs_open(path, 0);
+    assert(f != -1);
+    assert(tfs_read(f, buffer, sizeof(buffer)) == (ssize_t)size);
+    for (size_t i = 0; i < size; i++) {
+        assert(buffer[i] == file_byte(file, i));
+    }
+    assert(tfs_close(f) != -1);
+}
+
+ssize_t append(size_t file, size_t from, size_t to) {
+    static uint8_t contents[LARGE_SIZE];
+    for (size_t i = from; i < to; i++) {
+        contents[i] = file_byte(file, i);
+    }
+
+    char path[16] = {0};
+    sprintf(path, "/f%zu", file);
+    int f = tfs_open(path, TFS_O_CREAT | TFS_O_APPEND);
+    assert(f != -1);
+    ssize_t written = tfs_write(f, contents + from, to - from);
+    assert(tfs_close(f) != -1);
+    return written;
+}
+
+int main() {
+    int f;
+
+    // the root directory's block and five for the contents of 15 files
+    tfs_params params = tfs_default_params();
+    params.max_inode_count = FILE_COUNT + 1;
+    params.max_block_count = 1 + FILE_COUNT / 3;
+    params.block_size = BLOCK_SIZE;
+    assert(tfs_init(&params) != -1);
+
+    for (size_t file = 0; file < FILE_COUNT; file++) {
+        assert(append(file, 0, FILE_SIZE) == FILE_SIZE);
+    }
+    for (size_t file = 0; file < FILE_COUNT; file++) {
+        check_contents(file, FILE_SIZE);
+    }
+
+    // every packed block is full: only the rest of the slot can be written
+    ssize_t written = append(3, FILE_SIZE, GROWN_SIZE);
+    assert(written >= 0 && written < GROWN_SIZE - FILE_SIZE);
+    check_contents(3, FILE_SIZE + (size_t)written);
+    f = tfs_open("/f3", TFS_O_TRUNC);
+    assert(f != -1);
+    assert(tfs_close(f) != -1);
+    assert(append(3, 0, FILE_SIZE) == FILE_SIZE);
+
+    // emptying the files of two packed blocks frees them
+    for (size_t file = 0; file < 9; file++) {
+        if (file >= 3 && file < 6) {
+            continue;
+        }
+        char path[16] = {0};
+        sprintf(path, "/f%zu", file);
+        assert(tfs_unlink(path) != -1);
+    }
+
+    // a file that grows out of its slot moves to a larger one, then to a block
+    // of its own
+    assert(append(3, FILE_SIZE, GROWN_SIZE) == GROWN_SIZE - FILE_SIZE);
+    check_contents(3, GROWN_SIZE);
+    assert(append(3, GROWN_SIZE, LARGE_SIZE) == LARGE_SIZE - GROWN_SIZE);
+    check_contents(3, LARGE_SIZE);
+    for (size_t file = 4; file < FILE_COUNT; file++) {
+        if (file < 6 || file >= 9) {
+            check_contents(file, FILE_SIZE);
+        }
+    }
+
+    // once every file is truncated, every block can be used again
+    for (size_t file = 3; file < FILE_COUNT; file++) {
+        char path[16] = {0};
+        sprintf(path, "/f%zu", file);
+        f = tfs_open(path, TFS_O_CREAT | TFS_O_TRUNC);
+        assert(f != -1);
+        assert(tfs_close(f) != -1);
+    }
+    uint8_t large[FILE_COUNT / 3 * BLOCK_SIZE];
+    memset(large, 'x', sizeof(large));
+    f = tfs_open("/f3", 0);
+    assert(f != -1);
+    assert(tfs_write(f, large, sizeof(large)) == sizeof(large));
+    assert(tfs_close(f) != -1);
+
+    assert(tfs_destroy() != -1);
+
+    printf("Successful test.\n");
+
+    return 0;
+}